@@ -0,0 +1,564 @@
+// benchmarks of the time integrators and their scaling, the NonlinearFunction
+// combinators, the Newton solver, mass-spring assembly and modal analysis
+//
+// usage: bench_ode [scale] > results.json
+//   scale (default 1) multiplies the problem sizes
+//   NEO_ODE_SIMD=generic|avx2 in the environment caps the instruction set
+//   of the dispatched kernels, for comparisons
+//
+// output is one JSON document, one record per benchmark:
+//   { "name", "params", "reps", "min_s", "median_s", "per_unit_s", "unit" }
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <ode.h>
+#include <taskgraph.h>
+#include "mass_spring.h"
+#include "modal.h"
+
+using namespace Neo_ODE;
+using namespace Neo_CLA;
+using namespace std;
+
+
+// n coupled oscillators, first order form y = (x, v), x'' = -K x
+class OscillatorChain : public NonlinearFunction
+{
+  size_t n;
+public:
+  OscillatorChain (size_t _n) : n(_n) { }
+  size_t DimX() const override { return 2*n; }
+  size_t DimF() const override { return 2*n; }
+  
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    for (size_t i = 0; i < n; i++)
+      {
+        double left = (i > 0) ? y(i-1) : 0;
+        double right = (i+1 < n) ? y(i+1) : 0;
+        f(i) = y(n+i);
+        f(n+i) = left - 2*y(i) + right;
+      }
+  }
+  
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    for (size_t i = 0; i < n; i++)
+      {
+        df(i, n+i) = 1;
+        df(n+i, i) = -2;
+        if (i > 0) df(n+i, i-1) = 1;
+        if (i+1 < n) df(n+i, i+1) = 1;
+      }
+  }
+};
+
+// the same chain in second order form, x'' = -K x
+class ChainForce : public NonlinearFunction
+{
+  size_t n;
+public:
+  ChainForce (size_t _n) : n(_n) { }
+  size_t DimX() const override { return n; }
+  size_t DimF() const override { return n; }
+  
+  void Evaluate (VectorView<double> x, VectorView<double> f) const override
+  {
+    for (size_t i = 0; i < n; i++)
+      f(i) = ((i > 0) ? x(i-1) : 0) - 2*x(i) + ((i+1 < n) ? x(i+1) : 0);
+  }
+  
+  void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    for (size_t i = 0; i < n; i++)
+      {
+        df(i,i) = -2;
+        if (i > 0) df(i, i-1) = 1;
+        if (i+1 < n) df(i, i+1) = 1;
+      }
+  }
+};
+
+// RC ladder of n stages driven by cos(omega t), the last component is the time
+// (as in test_RC). Stiff for small R*C.
+class RCLadder : public NonlinearFunction
+{
+  size_t n;
+  double rc;
+  double omega = 100*M_PI;
+public:
+  RCLadder (size_t _n, double _rc) : n(_n), rc(_rc) { }
+  size_t DimX() const override { return n+1; }
+  size_t DimF() const override { return n+1; }
+
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    for (size_t i = 0; i < n; i++)
+      {
+        double left = (i > 0) ? y(i-1) : std::cos(omega*y(n));
+        double right = (i+1 < n) ? y(i+1) : y(i);
+        f(i) = (left - 2*y(i) + right) / rc;
+      }
+    f(n) = 1;
+  }
+  
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    for (size_t i = 0; i < n; i++)
+      {
+        df(i,i) = ((i+1 < n) ? -2 : -1) / rc;
+        if (i > 0) df(i,i-1) = 1/rc;
+        if (i+1 < n) df(i,i+1) = 1/rc;
+      }
+    df(0,n) = -omega*std::sin(omega*y(n)) / rc;
+  }
+};
+
+// coupled nonlinear system x_i + x_i^3 - (x_{i-1}+x_{i+1})/4 = 1 for Newton,
+// for double and float
+template <typename T>
+class NonlinearChainT : public NonlinearFunctionT<T>
+{
+  size_t n;
+public:
+  NonlinearChainT (size_t _n) : n(_n) { }
+  size_t DimX() const override { return n; }
+  size_t DimF() const override { return n; }
+  
+  void Evaluate (VectorView<T> x, VectorView<T> f) const override
+  {
+    for (size_t i = 0; i < n; i++)
+      f(i) = x(i) + x(i)*x(i)*x(i) - T(0.25)*(((i > 0) ? x(i-1) : 0) + ((i+1 < n) ? x(i+1) : 0)) - 1;
+  }
+  
+  void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
+  {
+    df = 0.0;
+    for (size_t i = 0; i < n; i++)
+      {
+        df(i,i) = 1 + 3*x(i)*x(i);
+        if (i > 0) df(i,i-1) = -0.25;
+        if (i+1 < n) df(i,i+1) = -0.25;
+      }
+  }
+};
+
+using NonlinearChain = NonlinearChainT<double>;
+
+
+// k x k net of masses hanging from fixes along the first row
+template <int D>
+void BuildNet (MassSpringSystem<D> & mss, size_t k)
+{
+  Vec<D> gravity = 0.0;
+  gravity(D-1) = -9.81;
+  mss.SetGravity (gravity);
+
+  std::vector<Connector> nodes;
+  for (size_t i = 0; i < k; i++)
+    for (size_t j = 0; j < k; j++)
+      {
+        Vec<D> pos = 0.0;
+        pos(0) = j;
+        pos(D-1) = -double(i);
+        if (i == 0)
+          nodes.push_back (mss.AddFix ( { pos } ));
+        else
+          nodes.push_back (mss.AddMass ( { 1, pos } ));
+      }
+
+  for (size_t i = 0; i < k; i++)
+    for (size_t j = 0; j < k; j++)
+      {
+        if (j+1 < k && i > 0)
+          mss.AddSpring ( { 1, 100, { nodes[i*k+j], nodes[i*k+j+1] } } );
+        if (i+1 < k)
+          mss.AddSpring ( { 1, 100, { nodes[i*k+j], nodes[(i+1)*k+j] } } );
+      }
+}
+
+
+
+class BenchmarkRecorder
+{
+  std::vector<std::string> records;
+public:
+  // runs func repeatedly for at least mintime seconds (and at least 3 times)
+  // func performs 'units' units of work (steps, evaluations, solves)
+  template <typename TFUNC>
+  void Run (const std::string & name, const std::string & params,
+            double units, const std::string & unit, TFUNC func,
+            double mintime = 0.2)
+  {
+    using clock = std::chrono::steady_clock;
+    std::vector<double> times;
+    double total = 0;
+    while (times.size() < 3 || (total < mintime && times.size() < 1000))
+      {
+        auto start = clock::now();
+        func();
+        double sec = std::chrono::duration<double>(clock::now()-start).count();
+        times.push_back (sec);
+        total += sec;
+      }
+    std::sort (times.begin(), times.end());
+    double median = times[times.size()/2];
+    
+    std::stringstream str;
+    str.precision(6);
+    str << "    { \"name\": \"" << name << "\", \"params\": { " << params << " }, "
+        << "\"reps\": " << times.size() << ", "
+        << "\"min_s\": " << times[0] << ", "
+        << "\"median_s\": " << median << ", "
+        << "\"per_unit_s\": " << median/units << ", "
+        << "\"unit\": \"" << unit << "\" }";
+    records.push_back (str.str());
+    std::cerr << name << " (" << params << "): " << median << " s" << std::endl;
+  }
+
+  void Print (std::ostream & ost, double scale) const
+  {
+    ost << "{" << std::endl
+        << "  \"suite\": \"neo_ode\"," << std::endl
+        << "  \"scale\": " << scale << "," << std::endl
+        << "  \"simd\": \"" << SIMDLevelName() << "\"," << std::endl
+        << "  \"benchmarks\": [" << std::endl;
+    for (size_t i = 0; i < records.size(); i++)
+      ost << records[i] << (i+1 < records.size() ? "," : "") << std::endl;
+    ost << "  ]" << std::endl << "}" << std::endl;
+  }
+};
+
+
+string Param (const string & name, double val)
+{
+  stringstream str;
+  str << "\"" << name << "\": " << val;
+  return str.str();
+}
+
+
+void BenchSolvers (BenchmarkRecorder & rec, double scale)
+{
+  int steps = 100;
+  for (size_t n : { size_t(10), size_t(40*scale) })
+    {
+      auto rhs = make_shared<OscillatorChain>(n);
+      string params = Param("n", n) + ", " + Param("steps", steps);
+      Vector<> y0(2*n), y(2*n);
+      y0 = 0.0;
+      y0(0) = 1;
+
+      rec.Run ("chain/EE", params, steps, "step", [&]() { y = y0; SolveODE_EE(10, steps, y, rhs); });
+      rec.Run ("chain/IE", params, steps, "step", [&]() { y = y0; SolveODE_IE(10, steps, y, rhs); });
+      rec.Run ("chain/CN", params, steps, "step", [&]() { y = y0; SolveODE_CN(10, steps, y, rhs); });
+
+      auto force = make_shared<ChainForce>(n);
+      auto mass = make_shared<IdentityFunction>(n);
+      Vector<> x(n), dx(n), ddx(n);
+      rec.Run ("chain/Newmark", params, steps, "step", [&]()
+      {
+        x = 0.0; x(0) = 1; dx = 0.0;
+        SolveODE_Newmark(10, steps, x, dx, force, mass);
+      });
+      rec.Run ("chain/Alpha", params, steps, "step", [&]()
+      {
+        x = 0.0; x(0) = 1; dx = 0.0; ddx = 0.0;
+        SolveODE_Alpha(10, steps, 0.8, x, dx, ddx, force, mass);
+      });
+    }
+
+  for (size_t n : { size_t(4), size_t(20*scale) })
+    {
+      auto rhs = make_shared<RCLadder>(n, 1e-4);
+      string params = Param("n", n) + ", " + Param("steps", steps);
+      Vector<> y(n+1);
+      rec.Run ("rcladder/IE", params, steps, "step", [&]() { y = 0.0; SolveODE_IE(0.02, steps, y, rhs); });
+      rec.Run ("rcladder/CN", params, steps, "step", [&]() { y = 0.0; SolveODE_CN(0.02, steps, y, rhs); });
+    }
+}
+
+
+// implicit steps on the tridiagonal chain against its length: the residual
+// Jacobians are assembled without dense products and factored in the band,
+// such that the time per step grows as the dense Jacobian, about n^2, not n^3
+void BenchScaling (BenchmarkRecorder & rec, double scale)
+{
+  int steps = 2;
+  for (size_t n : { size_t(100*scale), size_t(200*scale), size_t(400*scale), size_t(800*scale) })
+    {
+      string params = Param("n", n) + ", " + Param("steps", steps);
+      auto force = make_shared<ChainForce>(n);
+      auto mass = make_shared<IdentityFunction>(n);
+      Vector<> x(n), dx(n), ddx(n);
+
+      // the heat equation y' = -K y
+      rec.Run ("scaling/chain/CN", params, steps, "step", [&]()
+      {
+        x = 0.0; x(0) = 1;
+        SolveODE_CN(0.1, steps, x, force);
+      });
+      rec.Run ("scaling/chain/Alpha", params, steps, "step", [&]()
+      {
+        x = 0.0; x(0) = 1; dx = 0.0; ddx = 0.0;
+        SolveODE_Alpha(0.1, steps, 0.8, x, dx, ddx, force, mass);
+      });
+    }
+}
+
+
+template <int D>
+void BenchMassSpring (BenchmarkRecorder & rec, size_t k)
+{
+  MassSpringSystem<D> mss;
+  BuildNet (mss, k);
+  size_t n = D*mss.Masses().size();
+  string params = Param("dim", D) + ", " + Param("k", k) + ", " + Param("masses", mss.Masses().size());
+  
+  auto func = make_shared<MSS_Function<D>>(mss);
+  auto mass = make_shared<IdentityFunction>(n);
+  Vector<> x0(n), dx0(n), ddx0(n), x(n), dx(n), ddx(n), f(n);
+  mss.GetState (x0, dx0, ddx0);
+
+  string name = "massspring" + to_string(D) + "d";
+  rec.Run (name + "/evaluate", params, 100, "evaluation", [&]()
+  {
+    for (int i = 0; i < 100; i++)
+      func->Evaluate (x0, f);
+  });
+
+  Matrix<> jac(n, n);
+  rec.Run (name + "/jacobian", params, 1, "evaluation", [&]() { func->EvaluateDeriv (x0, jac); });
+
+  int steps = 10;
+  rec.Run (name + "/Alpha", params + ", " + Param("steps", steps), steps, "step", [&]()
+  {
+    x = x0; dx = dx0; ddx = ddx0;
+    SolveODE_Alpha (0.1, steps, 0.8, x, dx, ddx, func, mass);
+  });
+  rec.Run (name + "/Newmark", params + ", " + Param("steps", steps), steps, "step", [&]()
+  {
+    x = x0; dx = dx0;
+    SolveODE_Newmark (0.1, steps, x, dx, func, mass);
+  });
+}
+
+
+// lowest modes of a renumbered net by shift-invert Lanczos, and steps of
+// the linearized dynamics in the modal basis
+void BenchModal (BenchmarkRecorder & rec, double scale)
+{
+  MassSpringSystem<2> mss;
+  size_t k = size_t(16*std::sqrt(scale));
+  BuildNet (mss, k);
+  mss.Renumber (ORDER_RCM);
+  size_t n = 2*mss.Masses().size();
+  size_t modes = 10;
+  string params = Param("k", k) + ", " + Param("masses", mss.Masses().size()) + ", " + Param("modes", modes);
+
+  rec.Run ("modal/massspring2d/analysis", params, 1, "analysis", [&]() { ModalAnalysis modal(mss, modes); });
+
+  ModalAnalysis modal(mss, modes);
+  ModalIntegrator integrator(modal);
+  Vector<> x(n), dx(n), ddx(n);
+  mss.GetState (x, dx, ddx);
+  integrator.SetState (0, x, dx);
+  int steps = 100;
+  rec.Run ("modal/massspring2d/step", params + ", " + Param("steps", steps), steps, "step", [&]()
+  {
+    for (int i = 0; i < steps; i++)
+      integrator.Step (0.01);
+  });
+}
+
+
+void BenchCombinators (BenchmarkRecorder & rec, double scale)
+{
+  size_t n = 100*scale;
+  Vector<> x(n), f(n);
+  Matrix<> df(n, n);
+  for (size_t i = 0; i < n; i++) x(i) = i;
+  
+  for (int depth : { 1, 4, 16 })
+    {
+      string params = Param("n", n) + ", " + Param("depth", depth);
+      shared_ptr<NonlinearFunction> id = make_shared<IdentityFunction>(n);
+
+      shared_ptr<NonlinearFunction> sum = id;
+      shared_ptr<NonlinearFunction> scaled = id;
+      shared_ptr<NonlinearFunction> compose = id;
+      for (int i = 0; i < depth; i++)
+        {
+          sum = sum + id;
+          scaled = 0.5 * scaled;
+          compose = Compose(compose, id);
+        }
+
+      for (auto combinator : { std::make_pair("Sum", sum),
+                               std::make_pair("Scale", scaled),
+                               std::make_pair("Compose", compose) })
+        {
+          string name = combinator.first;
+          auto func = combinator.second;
+          rec.Run (string("combinator/") + name + "/evaluate", params, 100, "evaluation", [&]()
+          {
+            for (int i = 0; i < 100; i++)
+              func->Evaluate (x, f);
+          });
+          rec.Run (string("combinator/") + name + "/deriv", params, 1, "evaluation", [&]()
+          {
+            func->EvaluateDeriv (x, df);
+          });
+        }
+    }
+}
+
+
+void BenchNewton (BenchmarkRecorder & rec, double scale)
+{
+  for (size_t n : { size_t(10), size_t(50), size_t(200*scale) })
+    {
+      auto func = make_shared<NonlinearChain>(n);
+      Vector<> x(n);
+      for (auto variant : { std::make_pair("fullstep", FULLSTEP),
+                            std::make_pair("linesearch", LINESEARCH),
+                            std::make_pair("trustregion", TRUSTREGION) })
+        {
+          NEWTON_MODE mode = variant.second;
+          rec.Run (string("newton/") + variant.first, Param("n", n), 1, "solve", [&]()
+          {
+            x = 0.0;
+            NewtonSolver (func, x, mode, 1e-10, 20);
+          });
+        }
+
+      // the banded factorization against dense inversion of the same Jacobians
+      NewtonWorkspace dense(n, n);
+      dense.SetBandwidth (n);
+      rec.Run ("newton/fullstep/dense", Param("n", n), 1, "solve", [&]()
+      {
+        x = 0.0;
+        dense.Solve (func, x, FULLSTEP, 1e-10, 20);
+      });
+    }
+}
+
+
+// double, float and mixed precision (float inverse, refinement in double)
+void BenchPrecision (BenchmarkRecorder & rec, double scale)
+{
+  for (size_t n : { size_t(50), size_t(400*scale) })
+    {
+      auto funcd = make_shared<NonlinearChainT<double>>(n);
+      auto funcf = make_shared<NonlinearChainT<float>>(n);
+      Vector<double> xd(n);
+      Vector<float> xf(n);
+      NewtonWorkspaceT<double> wsd(n, n), wsm(n, n);
+      NewtonWorkspaceT<float> wsf(n, n);
+      wsm.SetMixedPrecision (true);
+
+      rec.Run ("precision/newton/double", Param("n", n), 1, "solve", [&]()
+      { xd = 0.0; wsd.Solve (funcd, xd, FULLSTEP, 1e-10, 20); });
+      rec.Run ("precision/newton/float", Param("n", n), 1, "solve", [&]()
+      { xf = 0.0; wsf.Solve (funcf, xf, FULLSTEP, 1e-4, 20); });
+      rec.Run ("precision/newton/mixed", Param("n", n), 1, "solve", [&]()
+      { xd = 0.0; wsm.Solve (funcd, xd, FULLSTEP, 1e-10, 20); });
+    }
+
+  // generalized alpha on a large net, with double and mixed precision Newton
+  MassSpringSystem<3> mss;
+  size_t k = size_t(10*std::sqrt(scale));
+  BuildNet (mss, k);
+  size_t n = 3*mss.Masses().size();
+  auto func = make_shared<MSS_Function<3>>(mss);
+  auto mass = make_shared<IdentityFunction>(n);
+  Vector<> x0(n), dx0(n), ddx0(n), x(n), dx(n), ddx(n);
+  mss.GetState (x0, dx0, ddx0);
+  int steps = 10;
+  string params = Param("k", k) + ", " + Param("masses", mss.Masses().size()) + ", " + Param("steps", steps);
+  for (bool mixed : { false, true })
+    {
+      NewtonParameters np;
+      np.mixedprecision = mixed;
+      rec.Run (string("precision/massspring3d/Alpha/") + (mixed ? "mixed" : "double"), params, steps, "step", [&]()
+      {
+        x = x0; dx = dx0; ddx = ddx0;
+        SolveODE_Alpha (0.1, steps, 0.8, x, dx, ddx, func, mass, nullptr, np);
+      });
+    }
+}
+
+
+// residual trees evaluated directly and as task graphs, sequential and on a pool
+void BenchTaskGraph (BenchmarkRecorder & rec, double scale)
+{
+  MassSpringSystem<3> mss;
+  size_t k = size_t(8*std::sqrt(scale));
+  BuildNet (mss, k);
+  size_t n = 3*mss.Masses().size();
+  auto func = make_shared<MSS_Function<3>>(mss);
+  auto mass = make_shared<IdentityFunction>(n);
+  Vector<> x0(n), dx0(n), ddx0(n);
+  mss.GetState (x0, dx0, ddx0);
+  int steps = 10;
+  auto pool = make_shared<TaskPool>();
+  string params = Param("k", k) + ", " + Param("masses", mss.Masses().size()) + ", "
+    + Param("steps", steps) + ", " + Param("threads", pool->NumThreads());
+
+  for (auto variant : { std::make_pair("tree", 0), std::make_pair("graph", 1), std::make_pair("graphpool", 2) })
+    rec.Run (string("taskgraph/massspring3d/Alpha/") + variant.first, params, steps, "step", [&]()
+    {
+      AlphaIntegrator integrator(func, mass, 0.01, 0.8);
+      if (variant.second == 1) UseTaskGraph (integrator, nullptr);
+      if (variant.second == 2) UseTaskGraph (integrator, pool);
+      integrator.SetState (0, x0, dx0, ddx0);
+      for (int i = 0; i < steps; i++)
+        integrator.Step();
+    });
+
+  // one integrator per thread in the tasks of the pool, their graphs on
+  // the same pool run inline
+  size_t nthreads = pool->NumThreads();
+  rec.Run ("taskgraph/massspring3d/Alpha/nested", params, steps*nthreads, "step", [&]()
+  {
+    pool->ParallelFor (nthreads, [&](size_t)
+    {
+      AlphaIntegrator integrator(func, mass, 0.01, 0.8);
+      UseTaskGraph (integrator, pool);
+      integrator.SetState (0, x0, dx0, ddx0);
+      for (int i = 0; i < steps; i++)
+        integrator.Step();
+    });
+  });
+}
+
+
+int main (int argc, char ** argv)
+{
+  double scale = (argc > 1) ? std::stod(argv[1]) : 1;
+  
+  BenchmarkRecorder rec;
+  BenchSolvers (rec, scale);
+  BenchScaling (rec, scale);
+  BenchMassSpring<2> (rec, 4);
+  BenchMassSpring<2> (rec, size_t(8*std::sqrt(scale)));
+  BenchMassSpring<3> (rec, 4);
+  BenchMassSpring<3> (rec, size_t(6*std::sqrt(scale)));
+  BenchModal (rec, scale);
+  BenchCombinators (rec, scale);
+  BenchNewton (rec, scale);
+  BenchPrecision (rec, scale);
+  BenchTaskGraph (rec, scale);
+  
+  rec.Print (cout, scale);
+}
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cmath>
 #include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
 
 #include <nonlinfunc.h>
 #include <ode.h>
@@ -83,12 +84,268 @@ Matrix<> test_mass_spring()
 }
 
 
+
+// Python functions as right hand sides. States are passed as numpy arrays
+// on the solver memory, valid only during the call: Evaluate(x, f) writes
+// into f, x is read only.
+
+py::array_t<double> AsNumpy (VectorView<double> v, bool writeable = true)
+{
+  py::array_t<double> a({ v.Size() }, { v.Dist()*sizeof(double) }, v.Data(),
+                        py::capsule(v.Data(), [](void*) { }));
+  if (!writeable) a.attr("setflags")(py::arg("write") = false);
+  return a;
+}
+
+py::array_t<double> AsNumpy (MatrixView<double> m, bool writeable = true)
+{
+  size_t dist = m.height() > 1 ? &m(1,0) - &m(0,0) : m.width();
+  py::array_t<double> a({ m.height(), m.width() }, { dist*sizeof(double), sizeof(double) },
+                        &m(0,0), py::capsule(&m(0,0), [](void*) { }));
+  if (!writeable) a.attr("setflags")(py::arg("write") = false);
+  return a;
+}
+
+
+// central differences for Python functions without EvaluateDeriv
+void NumericalDeriv (const NonlinearFunction & func, VectorView<double> x, MatrixView<double> df)
+{
+  Vector<> xp(x.Size()), fp(func.DimF()), fm(func.DimF());
+  xp = x;
+  for (size_t j = 0; j < x.Size(); j++)
+    {
+      double eps = 1e-6 * std::max(1.0, std::abs(x(j)));
+      xp(j) = x(j) + eps;
+      func.Evaluate (xp, fp);
+      xp(j) = x(j) - eps;
+      func.Evaluate (xp, fm);
+      xp(j) = x(j);
+      for (size_t i = 0; i < func.DimF(); i++)
+        df(i,j) = (fp(i)-fm(i)) / (2*eps);
+    }
+}
+
+
+class PyNonlinearFunction : public NonlinearFunction
+{
+public:
+  size_t DimX() const override { PYBIND11_OVERRIDE_PURE(size_t, NonlinearFunction, DimX); }
+  size_t DimF() const override { PYBIND11_OVERRIDE_PURE(size_t, NonlinearFunction, DimF); }
+
+  void Evaluate (VectorView<double> x, VectorView<double> f) const override
+  {
+    py::gil_scoped_acquire gil;
+    py::function func = py::get_override(static_cast<const NonlinearFunction*>(this), "Evaluate");
+    if (!func) throw std::logic_error("NonlinearFunction.Evaluate is not implemented");
+    func (AsNumpy(x, false), AsNumpy(f));
+  }
+
+  void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+  {
+    py::gil_scoped_acquire gil;
+    py::function func = py::get_override(static_cast<const NonlinearFunction*>(this), "EvaluateDeriv");
+    if (func)
+      func (AsNumpy(x, false), AsNumpy(df));
+    else
+      NumericalDeriv (*this, x, df);
+  }
+};
+
+
+// Python functions of a whole ensemble: EvaluateBatch(x, f) gets all
+// members as rows of x, EvaluateDerivBatch(x, df) their Jacobians as
+// df[i,:,:]. Without EvaluateDerivBatch, the Jacobians are central
+// differences perturbing all members at once, 2 dim batch calls.
+class PyBatchFunction : public BatchFunction
+{
+public:
+  using BatchFunction::BatchFunction;
+
+  void EvaluateBatch (MatrixView<double> x, MatrixView<double> f) const override
+  {
+    py::gil_scoped_acquire gil;
+    py::function func = py::get_override(static_cast<const BatchFunction*>(this), "EvaluateBatch");
+    if (!func) throw std::logic_error("BatchFunction.EvaluateBatch is not implemented");
+    func (AsNumpy(x, false), AsNumpy(f));
+  }
+
+  void EvaluateDerivBatch (MatrixView<double> x, MatrixView<double> df) const override
+  {
+    py::gil_scoped_acquire gil;
+    py::function func = py::get_override(static_cast<const BatchFunction*>(this), "EvaluateDerivBatch");
+    if (func)
+      {
+        func (AsNumpy(x, false), AsNumpy(df).reshape({ members, dim, dim }));
+        return;
+      }
+
+    Matrix<> xp(members, dim), fp(members, dim), fm(members, dim);
+    Vector<> eps(members);
+    xp = x;
+    for (size_t l = 0; l < dim; l++)
+      {
+        for (size_t i = 0; i < members; i++)
+          {
+            eps(i) = 1e-6 * std::max(1.0, std::abs(x(i,l)));
+            xp(i,l) = x(i,l) + eps(i);
+          }
+        EvaluateBatch (xp, fp);
+        for (size_t i = 0; i < members; i++)
+          xp(i,l) = x(i,l) - eps(i);
+        EvaluateBatch (xp, fm);
+        for (size_t i = 0; i < members; i++)
+          {
+            xp(i,l) = x(i,l);
+            for (size_t k = 0; k < dim; k++)
+              df(i, k*dim+l) = (fp(i,k)-fm(i,k)) / (2*eps(i));
+          }
+      }
+  }
+};
+
+
+// states are copied from numpy arrays of any shape, e.g. (members, dim)
+// for ensembles, and returned in the same shape
+using InputArray = py::array_t<double, py::array::c_style | py::array::forcecast>;
+
+Vector<> ToVector (const InputArray & a)
+{
+  Vector<> v(a.size());
+  for (size_t i = 0; i < v.Size(); i++)
+    v(i) = a.data()[i];
+  return v;
+}
+
+py::array_t<double> FromVector (VectorView<double> v, const std::vector<py::ssize_t> & shape)
+{
+  py::array_t<double> a(shape);
+  for (size_t i = 0; i < v.Size(); i++)
+    a.mutable_data()[i] = v(i);
+  return a;
+}
+
+std::vector<py::ssize_t> Shape (const InputArray & a)
+{
+  return std::vector<py::ssize_t>(a.shape(), a.shape()+a.ndim());
+}
+
+std::function<void(double,VectorView<double>)> WrapCallback (py::object callback, std::vector<py::ssize_t> shape)
+{
+  if (callback.is_none()) return nullptr;
+  return [callback, shape](double t, VectorView<double> y) { callback (t, FromVector(y, shape)); };
+}
+
+
 PYBIND11_MODULE(ode, m)
 {
-  m.doc() = "just a test of ode methods";
+  m.doc() = "time integrators for right hand sides defined in Python";
 
   // https://pybind11.readthedocs.io/en/stable/advanced/smart_ptrs.html
   m.def("test_mass_spring", &test_mass_spring);
 
+  py::class_<NonlinearFunction, PyNonlinearFunction, shared_ptr<NonlinearFunction>>
+    (m, "NonlinearFunction",
+     "base class of right hand sides, derived classes implement DimX(), DimF(),\n"
+     "Evaluate(x, f) writing into f and optionally EvaluateDeriv(x, df)")
+    .def(py::init<>())
+    .def("DimX", &NonlinearFunction::DimX)
+    .def("DimF", &NonlinearFunction::DimF);
+
+  py::class_<BatchFunction, PyBatchFunction, NonlinearFunction, shared_ptr<BatchFunction>>
+    (m, "BatchFunction",
+     "the same function applied to all members of an ensemble, derived classes\n"
+     "implement EvaluateBatch(x, f) with one member per row of x and f, and\n"
+     "optionally EvaluateDerivBatch(x, df) with df[i] the Jacobian of member i")
+    .def(py::init<size_t, size_t>(), py::arg("members"), py::arg("dim"))
+    .def_property_readonly("members", &BatchFunction::Members)
+    .def_property_readonly("dim", &BatchFunction::Dim);
+
+  py::enum_<NEWTON_MODE>(m, "NewtonMode")
+    .value("fullstep", FULLSTEP)
+    .value("linesearch", LINESEARCH)
+    .value("trustregion", TRUSTREGION);
+
+  py::class_<NewtonParameters>(m, "NewtonParameters")
+    .def(py::init<>())
+    .def_readwrite("mode", &NewtonParameters::mode)
+    .def_readwrite("tol", &NewtonParameters::tol)
+    .def_readwrite("maxsteps", &NewtonParameters::maxsteps)
+    .def_readwrite("maxhalvings", &NewtonParameters::maxhalvings)
+    .def_readwrite("reusejacobian", &NewtonParameters::reusejacobian)
+    .def_readwrite("mixedprecision", &NewtonParameters::mixedprecision)
+    .def_readwrite("bandwidth", &NewtonParameters::bandwidth);
+
+  // the solvers return the final state, callback(t, y) gets copies
+  m.def("SolveODE_EE", [](double tend, int steps, InputArray y0,
+                          shared_ptr<NonlinearFunction> rhs, py::object callback)
+  {
+    Vector<> y = ToVector(y0);
+    SolveODE_EE (tend, steps, y, rhs, WrapCallback(callback, Shape(y0)));
+    return FromVector (y, Shape(y0));
+  }, py::arg("tend"), py::arg("steps"), py::arg("y"), py::arg("rhs"), py::arg("callback") = py::none());
+
+  m.def("SolveODE_IE", [](double tend, int steps, InputArray y0,
+                          shared_ptr<NonlinearFunction> rhs, py::object callback, NewtonParameters params)
+  {
+    Vector<> y = ToVector(y0);
+    SolveODE_IE (tend, steps, y, rhs, WrapCallback(callback, Shape(y0)), params);
+    return FromVector (y, Shape(y0));
+  }, py::arg("tend"), py::arg("steps"), py::arg("y"), py::arg("rhs"), py::arg("callback") = py::none(),
+    py::arg("params") = NewtonParameters());
+
+  m.def("SolveODE_CN", [](double tend, int steps, InputArray y0,
+                          shared_ptr<NonlinearFunction> rhs, py::object callback, NewtonParameters params)
+  {
+    Vector<> y = ToVector(y0);
+    SolveODE_CN (tend, steps, y, rhs, WrapCallback(callback, Shape(y0)), params);
+    return FromVector (y, Shape(y0));
+  }, py::arg("tend"), py::arg("steps"), py::arg("y"), py::arg("rhs"), py::arg("callback") = py::none(),
+    py::arg("params") = NewtonParameters());
+
+  m.def("SolveODE_IMEX", [](double tend, int steps, InputArray y0,
+                            shared_ptr<NonlinearFunction> stiff, shared_ptr<NonlinearFunction> nonstiff,
+                            py::object callback, NewtonParameters params)
+  {
+    Vector<> y = ToVector(y0);
+    SolveODE_IMEX (tend, steps, y, stiff, nonstiff, WrapCallback(callback, Shape(y0)),
+                   IMEXTableau::ARS222(), params);
+    return FromVector (y, Shape(y0));
+  }, py::arg("tend"), py::arg("steps"), py::arg("y"), py::arg("stiff"), py::arg("nonstiff"),
+    py::arg("callback") = py::none(), py::arg("params") = NewtonParameters());
+
+  // mass * x'' = rhs(x) or rhs(x, x'), the mass defaults to the identity
+  m.def("SolveODE_Newmark", [](double tend, int steps, InputArray x0, InputArray dx0,
+                               shared_ptr<NonlinearFunction> rhs, shared_ptr<NonlinearFunction> mass,
+                               py::object callback, NewtonParameters params)
+  {
+    Vector<> x = ToVector(x0), dx = ToVector(dx0);
+    if (!mass) mass = make_shared<IdentityFunction>(x.Size());
+    SolveODE_Newmark (tend, steps, x, dx, rhs, mass, WrapCallback(callback, Shape(x0)), params);
+    return py::make_tuple (FromVector(x, Shape(x0)), FromVector(dx, Shape(x0)));
+  }, py::arg("tend"), py::arg("steps"), py::arg("x"), py::arg("dx"), py::arg("rhs"),
+    py::arg("mass") = nullptr, py::arg("callback") = py::none(), py::arg("params") = NewtonParameters());
+
+  m.def("SolveODE_Alpha", [](double tend, int steps, double rhoinf,
+                             InputArray x0, InputArray dx0, InputArray ddx0,
+                             shared_ptr<NonlinearFunction> rhs, shared_ptr<NonlinearFunction> mass,
+                             py::object callback, NewtonParameters params)
+  {
+    Vector<> x = ToVector(x0), dx = ToVector(dx0), ddx = ToVector(ddx0);
+    if (!mass) mass = make_shared<IdentityFunction>(x.Size());
+    SolveODE_Alpha (tend, steps, rhoinf, x, dx, ddx, rhs, mass, WrapCallback(callback, Shape(x0)), params);
+    return py::make_tuple (FromVector(x, Shape(x0)), FromVector(dx, Shape(x0)), FromVector(ddx, Shape(x0)));
+  }, py::arg("tend"), py::arg("steps"), py::arg("rhoinf"), py::arg("x"), py::arg("dx"), py::arg("ddx"),
+    py::arg("rhs"), py::arg("mass") = nullptr, py::arg("callback") = py::none(),
+    py::arg("params") = NewtonParameters());
+
+  // the kernels are dispatched by the CPU features detected here, at import
+  m.attr("simd_level") = SIMDLevelName(SIMDLevel());
+  m.def("SetSIMDLevel", [](std::string level)
+  {
+    SetSIMDLevel (level == "avx512" ? SIMD_AVX512 : level == "avx2" ? SIMD_AVX2 : SIMD_GENERIC);
+    return std::string(SIMDLevelName());
+  }, py::arg("level"),
+    "caps the instruction set of the kernels, 'generic', 'avx2' or 'avx512', returns the level in use");
+
 }
 
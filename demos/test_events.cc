@@ -0,0 +1,74 @@
+#include <iostream>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <events.h>
+
+using namespace Neo_ODE;
+using namespace Neo_CLA;
+using namespace std;
+
+
+// free fall, x'' = -g
+class Gravity : public NonlinearFunction
+{
+  size_t DimX() const override { return 1; }
+  size_t DimF() const override { return 1; }
+  
+  void Evaluate (VectorView<double> x, VectorView<double> f) const override
+  {
+    f(0) = -9.81;
+  }
+  void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+  {
+    df(0,0) = 0;
+  }
+};
+
+
+// charging capacitor, the time is the second component
+class Charge : public NonlinearFunction
+{
+  size_t DimX() const override { return 2; }
+  size_t DimF() const override { return 2; }
+
+  void Evaluate (VectorView<double> x, VectorView<double> f) const override
+  {
+    f(0) = (1 - x(0))/(100*1e-6);
+    f(1) = 1;
+  }
+  void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    df(0,0) = -1/(100*1e-6);
+  }
+};
+
+
+int main()
+{
+  // bouncing ball: the state is (x, v, a), the event x = 0 reverts the velocity
+  NewmarkIntegrator ball(make_shared<Gravity>(), make_shared<IdentityFunction>(1), 0.01);
+  ball.SetState (0, Vector<>{1.}, Vector<>{0.});
+
+  Event bounce;
+  bounce.g = [](double t, VectorView<double> u) { return u(0); };
+  bounce.direction = -1;
+  bounce.action = MODIFY;
+  bounce.modify = [](double t, VectorView<double> u) { u(1) = -0.9*u(1); };
+
+  AdvanceWithEvents (ball, 3, { bounce },
+                     [](size_t i, double t, VectorView<double> u)
+                     { cout << "bounce at t = " << t << ", v = " << u(1) << endl; });
+
+  // capacitor voltage reaching a level, stops the integration
+  ImplicitEulerIntegrator rc(make_shared<Charge>(), 1e-5);
+  rc.SetState (0, Vector<>{0., 0.});
+
+  Event level;
+  level.g = [](double t, VectorView<double> u) { return u(0) - 0.5; };
+  
+  double tstop = AdvanceWithEvents (rc, 0.01, { level });
+  cout << "voltage 0.5 reached at t = " << tstop
+       << ", exact " << 100*1e-6*std::log(2) << endl;
+}
@@ -0,0 +1,88 @@
+// fixed-size functions and solvers for small systems, compared with the
+// generic solvers on the same equations
+
+#include <iostream>
+#include <chrono>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <ode.h>
+#include <fixedsize.h>
+
+using namespace Neo_ODE;
+using namespace std;
+
+
+// x'' = -x as first order system
+class MassSpring : public FixedFunction<MassSpring, 2>
+{
+public:
+  void EvaluateFixed (const FixedVector<2> & x, FixedVector<2> & f) const
+  {
+    f[0] = x[1];
+    f[1] = -x[0];
+  }
+  void EvaluateDerivFixed (const FixedVector<2> & x, FixedMatrix<2,2> & df) const
+  {
+    df = { { { 0, 1 }, { -1, 0 } } };
+  }
+};
+
+// stationary point of the pendulum Lagrangian, see test_alpha
+class dLagrange : public FixedFunction<dLagrange, 3>
+{
+public:
+  void EvaluateFixed (const FixedVector<3> & x, FixedVector<3> & f) const
+  {
+    f[0] = 2*x[0]*x[2];
+    f[1] = 2*x[1]*x[2] - 1;
+    f[2] = x[0]*x[0]+x[1]*x[1]-1;
+  }
+  void EvaluateDerivFixed (const FixedVector<3> & x, FixedMatrix<3,3> & df) const
+  {
+    df = { { { 2*x[2], 0, 2*x[0] },
+             { 0, 2*x[2], 2*x[1] },
+             { 2*x[0], 2*x[1], 0 } } };
+  }
+};
+
+
+template <typename FUNC>
+double Seconds (FUNC func)
+{
+  auto start = chrono::steady_clock::now();
+  func();
+  return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+}
+
+int main()
+{
+  double tend = 4*M_PI;
+  int steps = 1000000;
+
+  MassSpring fixedrhs;
+  auto rhs = make_shared<MassSpring>();
+
+  FixedVector<2> yf { 1, 0 };
+  Vector<> y { 1, 0 };
+  double tfixed = Seconds ([&]() { SolveODE_CN (tend, steps, yf, fixedrhs); });
+  double tgeneric = Seconds ([&]() { SolveODE_CN (tend, steps/100, y, rhs); });
+  cout << "CN fixed:   y = " << yf[0] << ", " << yf[1]
+       << ", " << steps/tfixed << " steps/s" << endl;
+  cout << "CN generic: y = " << y(0) << ", " << y(1)
+       << ", " << steps/100/tgeneric << " steps/s" << endl;
+
+  yf = { 1, 0 };
+  tfixed = Seconds ([&]() { SolveODE_IE (tend, steps, yf, fixedrhs); });
+  cout << "IE fixed:   y = " << yf[0] << ", " << yf[1]
+       << ", " << steps/tfixed << " steps/s" << endl;
+
+  yf = { 1, 0 };
+  tfixed = Seconds ([&]() { SolveODE_EE (tend, steps, yf, fixedrhs); });
+  cout << "EE fixed:   y = " << yf[0] << ", " << yf[1]
+       << ", " << steps/tfixed << " steps/s" << endl;
+
+  FixedVector<3> x { 0.5, -0.5, 1 };
+  NewtonSolver (dLagrange(), x);
+  cout << "pendulum equilibrium: " << x[0] << ", " << x[1] << ", lambda = " << x[2] << endl;
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <ode.h>
+
+using namespace Neo_ODE;
+
+
+// RC circuit as in test_RC, y = (voltage, time), split into the stiff
+// relaxation of the capacitor and the non-stiff source and time
+class Relaxation : public NonlinearFunction
+{
+  double RC;
+public:
+  Relaxation (double _RC) : RC(_RC) { }
+  size_t DimX() const override { return 2; }
+  size_t DimF() const override { return 2; }
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    f(0) = -y(0)/RC;
+    f(1) = 0;
+  }
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    df(0,0) = -1/RC;
+  }
+};
+
+class Source : public NonlinearFunction
+{
+  double RC;
+public:
+  Source (double _RC) : RC(_RC) { }
+  size_t DimX() const override { return 2; }
+  size_t DimF() const override { return 2; }
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    f(0) = std::cos(100*M_PI*y(1))/RC;
+    f(1) = 1;
+  }
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    df(0,1) = -100*M_PI*std::sin(100*M_PI*y(1))/RC;
+  }
+};
+
+
+int main()
+{
+  double RC = 1e-4, tend = 0.05;
+  auto stiff = make_shared<Relaxation>(RC);
+  auto nonstiff = make_shared<Source>(RC);
+
+  // reference by Crank-Nicolson with small steps on the full rhs
+  Vector<> yref { 0, 0 };
+  SolveODE_CN (tend, 100000, yref, stiff + nonstiff);
+
+  for (int steps : { 250, 500, 1000, 2000 })
+    {
+      Vector<> y { 0, 0 };
+      SolveODE_IMEX (tend, steps, y, stiff, nonstiff);
+      Vector<> ye { 0, 0 };
+      SolveODE_IMEX (tend, steps, ye, stiff, nonstiff, nullptr, IMEXTableau::Euler());
+      std::cout << "steps = " << steps
+                << ", error ARS(2,2,2) = " << std::abs(y(0)-yref(0))
+                << ", error IMEX Euler = " << std::abs(ye(0)-yref(0)) << std::endl;
+    }
+}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <multirate.h>
+
+using namespace Neo_ODE;
+
+
+// two weakly coupled oscillators, y = (x1, v1, x2, v2): a fast one with
+// frequency omega and a slow one with frequency 1. The groups count their
+// evaluations.
+class FastPart : public NonlinearFunction
+{
+  double omega, eps;
+public:
+  mutable int evaluations = 0;
+  FastPart (double _omega, double _eps) : omega(_omega), eps(_eps) { }
+  size_t DimX() const override { return 4; }
+  size_t DimF() const override { return 2; }
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    evaluations++;
+    f(0) = y(1);
+    f(1) = -omega*omega*y(0) + eps*(y(2)-y(0));
+  }
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    df(0,1) = 1;
+    df(1,0) = -omega*omega - eps;
+    df(1,2) = eps;
+  }
+};
+
+class SlowPart : public NonlinearFunction
+{
+  double eps;
+public:
+  mutable int evaluations = 0;
+  SlowPart (double _eps) : eps(_eps) { }
+  size_t DimX() const override { return 4; }
+  size_t DimF() const override { return 2; }
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    evaluations++;
+    f(0) = y(3);
+    f(1) = -y(2) + eps*(y(0)-y(2));
+  }
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    df(0,1) = 1;
+    df(1,2) = -1 - eps;
+    df(1,0) = eps;
+  }
+};
+
+
+int main()
+{
+  double tend = 2;
+  auto fast = make_shared<FastPart>(50, 0.5);
+  auto slow = make_shared<SlowPart>(0.5);
+
+  // single rate implicit Euler with the small step
+  Vector<> yref { 0.01, 0, 1, 0 };
+  SolveODE_IE (tend, 4000, yref, Compose(make_shared<ScatterFunction>(std::vector<size_t>{0,1}, 4), fast)
+               + Compose(make_shared<ScatterFunction>(std::vector<size_t>{2,3}, 4), slow));
+  std::cout << "single rate:  x2 = " << yref(2)
+            << ", fast evaluations = " << fast->evaluations
+            << ", slow evaluations = " << slow->evaluations << std::endl;
+
+  fast->evaluations = slow->evaluations = 0;
+  Vector<> y { 0.01, 0, 1, 0 };
+  SolveODE_Multirate (tend, 200, 20, y, fast, { 0, 1 }, slow, { 2, 3 });
+  std::cout << "multirate:    x2 = " << y(2)
+            << ", fast evaluations = " << fast->evaluations
+            << ", slow evaluations = " << slow->evaluations << std::endl;
+}
@@ -23,3 +23,51 @@ plt.plot(t, ee[:, 0], "orange")
 plt.plot(t, cn[:, 0], "black")
 
 plt.show()
+
+
+# right hand sides in Python: Evaluate writes into f, the Jacobian is
+# computed by differences unless EvaluateDeriv is defined as well
+
+class VanDerPol(NonlinearFunction):
+    def __init__(self, mu):
+        super().__init__()
+        self.mu = mu
+    def DimX(self): return 2
+    def DimF(self): return 2
+    def Evaluate(self, x, f):
+        f[0] = x[1]
+        f[1] = self.mu*(1-x[0]**2)*x[1] - x[0]
+
+traj = []
+y = SolveODE_CN(20, 2000, np.array([2.0, 0.0]), VanDerPol(1.0),
+                callback=lambda t, y: traj.append(y))
+traj = np.array(traj)
+plt.plot(traj[:, 0], traj[:, 1])
+plt.show()
+
+
+# an ensemble of van der Pol oscillators as one system: EvaluateBatch gets
+# all members as rows, one Python call per evaluation instead of one per member
+
+class VanDerPolEnsemble(BatchFunction):
+    def __init__(self, mus):
+        super().__init__(len(mus), 2)
+        self.mus = np.asarray(mus)
+    def EvaluateBatch(self, x, f):
+        f[:, 0] = x[:, 1]
+        f[:, 1] = self.mus*(1-x[:, 0]**2)*x[:, 1] - x[:, 0]
+    def EvaluateDerivBatch(self, x, df):
+        df[:, 0, 0] = 0
+        df[:, 0, 1] = 1
+        df[:, 1, 0] = -2*self.mus*x[:, 0]*x[:, 1] - 1
+        df[:, 1, 1] = self.mus*(1-x[:, 0]**2)
+
+mus = np.linspace(0.5, 5, 100)
+y0 = np.tile([2.0, 0.0], (len(mus), 1))
+params = NewtonParameters()
+params.bandwidth = 1       # the Jacobian is block diagonal with 2x2 blocks
+y = SolveODE_IE(10, 1000, y0, VanDerPolEnsemble(mus), params=params)
+plt.plot(mus, y[:, 0], "o")
+plt.xlabel("mu")
+plt.ylabel("x(10)")
+plt.show()
@@ -0,0 +1,47 @@
+#include <iostream>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <parareal.h>
+
+using namespace Neo_ODE;
+using namespace Neo_CLA;
+using namespace std;
+
+
+class MassSpring : public NonlinearFunction
+{
+  size_t DimX() const override { return 2; }
+  size_t DimF() const override { return 2; }
+  
+  void Evaluate (VectorView<double> x, VectorView<double> f) const override
+  {
+    f(0) = x(1);
+    f(1) = -x(0);
+  }
+  
+  void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    df(0,1) = 1;
+    df(1,0) = -1;
+  }
+};
+
+
+int main()
+{
+  double tend = 20*M_PI;
+  int slices = 40;
+  Vector<> y { 1, 0 };
+  auto rhs = make_shared<MassSpring>();
+
+  // coarse: 4 Crank-Nicolson steps per slice, fine: 100 steps
+  int its = SolveODE_Parareal (tend, slices, y,
+                               CNPropagator(rhs, 4), CNPropagator(rhs, 100),
+                               slices, 1e-10,
+                               [](double t, VectorView<double> y)
+                               { cout << t << " \t " << y(0) << " \t " << y(1) << endl; });
+
+  cout << "Parareal iterations: " << its << endl;
+}
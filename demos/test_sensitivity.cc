@@ -0,0 +1,162 @@
+// parameter gradients of a time integration: forward sensitivities, the
+// checkpointed adjoint and finite differences for the same objective
+
+#include <iostream>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <ode.h>
+#include <sensitivity.h>
+
+using namespace Neo_ODE;
+using namespace std;
+
+
+// two masses on springs, x1'' = -k1 x1 + k2 (x2-x1) - c x1' - q x1^3,
+// x2'' = -k2 (x2-x1) - c x2', parameters p = (k1, k2, c, q).
+// As second order system rhs(x, v), or first order with y = (x, v).
+class Oscillator : public ParametricFunction
+{
+  bool firstorder;
+public:
+  double p[4] = { 1, 2, 0.1, 0.5 };
+
+  Oscillator (bool _firstorder) : firstorder(_firstorder) { }
+  size_t DimX() const override { return 4; }
+  size_t DimF() const override { return firstorder ? 4 : 2; }
+  size_t NumParameters() const override { return 4; }
+
+  void Force (VectorView<double> y, double & f1, double & f2) const
+  {
+    f1 = -p[0]*y(0) + p[1]*(y(1)-y(0)) - p[2]*y(2) - p[3]*y(0)*y(0)*y(0);
+    f2 = -p[1]*(y(1)-y(0)) - p[2]*y(3);
+  }
+
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    size_t off = firstorder ? 2 : 0;
+    if (firstorder)
+      {
+        f(0) = y(2);
+        f(1) = y(3);
+      }
+    Force (y, f(off), f(off+1));
+  }
+
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    size_t off = firstorder ? 2 : 0;
+    if (firstorder)
+      {
+        df(0,2) = 1;
+        df(1,3) = 1;
+      }
+    df(off,0) = -p[0] - p[1] - 3*p[3]*y(0)*y(0);
+    df(off,1) = p[1];
+    df(off,2) = -p[2];
+    df(off+1,0) = p[1];
+    df(off+1,1) = -p[1];
+    df(off+1,3) = -p[2];
+  }
+
+  void EvaluateParameterDeriv (VectorView<double> y, MatrixView<double> dfdp) const override
+  {
+    dfdp = 0.0;
+    size_t off = firstorder ? 2 : 0;
+    dfdp(off,0) = -y(0);
+    dfdp(off,1) = y(1)-y(0);
+    dfdp(off,2) = -y(2);
+    dfdp(off,3) = -y(0)*y(0)*y(0);
+    dfdp(off+1,1) = -(y(1)-y(0));
+    dfdp(off+1,2) = -y(3);
+  }
+};
+
+
+// least squares distance of x1 to cos(t)
+double Misfit (double t, VectorView<double> y, VectorView<double> dgdy)
+{
+  double d = y(0) - cos(t);
+  dgdy(0) = d;
+  return 0.5*d*d;
+}
+
+
+int main()
+{
+  double tend = 5;
+  int steps = 200;
+  double eps = 1e-6;
+
+  for (string method : { "IE", "CN", "Alpha" })
+    {
+      bool firstorder = method != "Alpha";
+      auto rhs = make_shared<Oscillator>(firstorder);
+      auto mass = make_shared<IdentityFunction>(2);
+
+      // initial state, for Alpha with the acceleration of the nominal parameters
+      Vector<> y0(4), a0(2);
+      y0 = 0.0;
+      y0(0) = 1;
+      if (!firstorder) rhs->Evaluate (y0, a0);
+
+      auto run = [&](Vector<> & grad) -> double
+      {
+        Vector<> y(4);
+        y = y0;
+        if (method == "IE")
+          return AdjointODE_IE (tend, steps, y, rhs, Misfit, grad);
+        if (method == "CN")
+          return AdjointODE_CN (tend, steps, y, rhs, Misfit, grad, 7);
+        Vector<> x(2), v(2), a(2);
+        x = y.Range(0, 2);
+        v = 0.0;
+        a = a0;
+        return AdjointODE_Alpha (tend, steps, 0.8, x, v, a, rhs, mass, Misfit, grad, 7);
+      };
+
+      Vector<> grad(4), dummy(4);
+      double value = run (grad);
+      cout << method << ": objective = " << value << endl;
+      cout << "  adjoint gradient       = " << grad << endl;
+
+      Vector<> fd(4);
+      for (int i = 0; i < 4; i++)
+        {
+          double pi = rhs->p[i];
+          rhs->p[i] = pi + eps;
+          double vp = run (dummy);
+          rhs->p[i] = pi - eps;
+          double vm = run (dummy);
+          rhs->p[i] = pi;
+          fd(i) = (vp-vm) / (2*eps);
+        }
+      cout << "  finite differences     = " << fd << endl;
+
+      // forward sensitivities of the final position x1
+      Matrix<> sens(firstorder ? 4 : 2, 4);
+      sens = 0.0;
+      Vector<> y(4);
+      y = y0;
+      if (firstorder)
+        {
+          if (method == "IE")
+            SensitivityODE_IE (tend, steps, y, rhs, sens);
+          else
+            SensitivityODE_CN (tend, steps, y, rhs, sens);
+        }
+      else
+        {
+          Matrix<> sv(2, 4), sa(2, 4);
+          sv = 0.0;
+          sa = 0.0;
+          Vector<> x(2), v(2), a(2);
+          x = y.Range(0, 2);
+          v = 0.0;
+          a = a0;
+          SensitivityODE_Alpha (tend, steps, 0.8, x, v, a, rhs, mass, sens, sv, sa);
+        }
+      cout << "  forward d x1(T) / dp   = " << sens.Row(0) << endl;
+    }
+}
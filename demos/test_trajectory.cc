@@ -0,0 +1,94 @@
+// compressed storage of a trajectory, lossless and with a tolerance:
+// the states are decoded by index, sequentially and after saving and
+// loading, and compared with the input
+
+#include <iostream>
+#include <sstream>
+#include <cmath>
+
+#include <nonlinfunc.h>
+#include <ode.h>
+#include <trajectory.h>
+
+using namespace Neo_ODE;
+using namespace std;
+
+
+// two damped oscillators with frequencies 1 and 7, y = (x1, v1, x2, v2)
+class Oscillators : public NonlinearFunction
+{
+public:
+  size_t DimX() const override { return 4; }
+  size_t DimF() const override { return 4; }
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    f(0) = y(1);
+    f(1) = -y(0) - 0.1*y(1);
+    f(2) = y(3);
+    f(3) = -49*y(2) - 0.1*y(3);
+  }
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    df(0,1) = 1;
+    df(1,0) = -1;
+    df(1,1) = -0.1;
+    df(2,3) = 1;
+    df(3,2) = -49;
+    df(3,3) = -0.1;
+  }
+};
+
+
+int main()
+{
+  int steps = 2000;
+  Matrix<> states(steps, 4);
+  Vector<> y { 1, 0, 1, 0 };
+  int k = 0;
+  SolveODE_CN (20, steps, y, make_shared<Oscillators>(),
+               [&](double t, VectorView<double> y) { states.Row(k++) = y; });
+
+  for (double tol : { 0.0, 1e-6 })
+    {
+      // the first half, saved and loaded, then the second half appended
+      CompressedTrajectory traj(4, tol, 64);
+      for (int i = 0; i < steps/2; i++)
+        traj.Append (i, states.Row(i));
+      stringstream buffer;
+      traj.Save (buffer);
+      CompressedTrajectory loaded = CompressedTrajectory::Load (buffer);
+      for (int i = steps/2; i < steps; i++)
+        {
+          traj.Append (i, states.Row(i));
+          loaded.Append (i, states.Row(i));
+        }
+
+      Vector<> z(4);
+      double errget = 0, errreader = 0, errloaded = 0;
+      for (int i = 0; i < steps; i++)
+        {
+          traj.Get (i, z);
+          for (int j = 0; j < 4; j++)
+            errget = max(errget, abs(z(j) - states(i,j)));
+        }
+      CompressedTrajectory::Reader reader(traj);
+      for (int i = 0; !reader.Done(); i++)
+        {
+          reader.Next (z);
+          for (int j = 0; j < 4; j++)
+            errreader = max(errreader, abs(z(j) - states(i,j)));
+        }
+      for (int i = 0; i < steps; i++)
+        {
+          loaded.Get (i, z);
+          for (int j = 0; j < 4; j++)
+            errloaded = max(errloaded, abs(z(j) - states(i,j)));
+        }
+
+      cout << "tolerance " << tol << ": " << traj.Size() << " states, ratio "
+           << double(steps*4*sizeof(double)) / traj.Bytes()
+           << ", max error Get " << errget << ", Reader " << errreader
+           << ", after Save/Load " << errloaded << endl;
+    }
+}
@@ -2,8 +2,15 @@
 // #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
+#include <pybind11/numpy.h>
+#include <fstream>
 
 #include "mass_spring.h"
+#include "checkpoint.h"
+#include "equilibrium.h"
+#include "modal.h"
+#include <trajectory.h>
+#include <sensitivity.h>
 
 namespace py = pybind11;
 using namespace std;
@@ -15,6 +22,9 @@ PYBIND11_MAKE_OPAQUE(std::vector<Spring>);
 PYBIND11_MODULE(mass_spring, m) {
     m.doc() = "mass-spring-system simulator";
 
+    // the force kernels are dispatched by the CPU features detected at import
+    m.attr("simd_level") = SIMDLevelName(SIMDLevel());
+
     // not that elegant, but necessary
     py::class_<Vector<double>> (m, "Vector", py::buffer_protocol())
       .def(py::init<size_t>(),
@@ -140,14 +150,45 @@ PYBIND11_MODULE(mass_spring, m) {
       .def(py::init<double, double, std::array<Connector,2>>())
       .def_property_readonly("connections",
                              [](Spring & s) { return s.connections; })
+      .def_readwrite("stiffness3", &Spring::stiffness3, "cubic stiffness, force k e + k3 e^3")
+      .def_readwrite("damping", &Spring::damping, "dashpot coefficient along the spring")
+      .def_readwrite("breakstrain", &Spring::breakstrain,
+                     "relative elongation at which the spring breaks, 0 for never")
+      .def_readonly("broken", &Spring::broken)
       ;
 
     
+    py::class_<BendingSpring> (m, "BendingSpring",
+                               "bending resistance k/2 |p1 - 2 p2 + p3|^2 around a straight rest shape")
+      .def(py::init<double, std::array<Connector,3>>())
+      .def_readwrite("stiffness", &BendingSpring::stiffness)
+      .def_property_readonly("connections",
+                             [](BendingSpring & b) { return b.connections; })
+      ;
+
     py::bind_vector<std::vector<Mass<3>>>(m, "Masses3d");
     py::bind_vector<std::vector<Fix<3>>>(m, "Fixes3d");
     py::bind_vector<std::vector<Spring>>(m, "Springs");        
     
     
+    py::class_<ContactModel<3>, std::shared_ptr<ContactModel<3>>> (m, "Contact",
+                                                                  "penalty contact of masses with given radius")
+      .def(py::init<double, double>(), py::arg("radius"), py::arg("stiffness"))
+      .def("AddPlane", [](ContactModel<3> & c, std::array<double,3> n, double offset)
+           { c.AddPlane ({ Vec<3>{n[0],n[1],n[2]}, offset }); },
+           py::arg("normal"), py::arg("offset"), "obstacle normal*x >= offset")
+      .def("AddSphere", [](ContactModel<3> & c, std::array<double,3> center, double radius)
+           { c.AddSphere ({ Vec<3>{center[0],center[1],center[2]}, radius }); },
+           py::arg("center"), py::arg("radius"))
+      .def("SetSelfContact", &ContactModel<3>::SetSelfContact)
+      ;
+    
+    py::enum_<MSS_ORDERING> (m, "Ordering", "order of the masses in state vectors")
+      .value("insertion", ORDER_INSERTION)
+      .value("rcm", ORDER_RCM)
+      .value("morton", ORDER_MORTON)
+      ;
+    
     py::class_<MassSpringSystem<2>> (m, "MassSpringSystem2d")
       .def(py::init<>())
       .def("Add", [](MassSpringSystem<2> & mss, Mass<2> m) { return mss.AddMass(m); })
@@ -165,10 +206,23 @@ PYBIND11_MODULE(mass_spring, m) {
                     [](MassSpringSystem<3> & mss, std::array<double,3> g) { mss.SetGravity(Vec<3>{g[0],g[1],g[2]}); })
       .def("Add", [](MassSpringSystem<3> & mss, Mass<3> m) { return mss.AddMass(m); })
       .def("Add", [](MassSpringSystem<3> & mss, Fix<3> f) { return mss.AddFix(f); })
-      .def("Add", [](MassSpringSystem<3> & mss, Spring s) { return mss.AddSpring(s); })            
+      .def("Add", [](MassSpringSystem<3> & mss, Spring s) { return mss.AddSpring(s); })
+      .def("Add", [](MassSpringSystem<3> & mss, BendingSpring b) { return mss.AddBendingSpring(b); })            
       .def_property_readonly("masses", [](MassSpringSystem<3> & mss) -> auto& { return mss.Masses(); })
       .def_property_readonly("fixes", [](MassSpringSystem<3> & mss) -> auto& { return mss.Fixes(); })
       .def_property_readonly("springs", [](MassSpringSystem<3> & mss) -> auto& { return mss.Springs(); })            
+      .def_property("contact",
+                    [](MassSpringSystem<3> & mss) { return mss.Contact(); },
+                    &MassSpringSystem<3>::SetContact)
+      .def("BreakSpring", &MassSpringSystem<3>::BreakSpring, py::arg("nr"))
+      .def_property_readonly("activesprings", [](MassSpringSystem<3> & mss) { return mss.ActiveSprings(); })
+      .def("UpdateTopology", &MassSpringSystem<3>::UpdateTopology,
+           "rebuild the active springs after modifying masses or springs directly")
+      .def("Renumber", &MassSpringSystem<3>::Renumber, py::arg("ordering") = ORDER_RCM,
+           "reorder the masses in state vectors, connectors stay valid")
+      .def("StateRow", [](MassSpringSystem<3> & mss, Connector c) { return mss.StateRow(c.nr); },
+           "row of a mass in the state returned by GetState")
+      .def_property_readonly("bandwidth", &MassSpringSystem<3>::Bandwidth)
       .def("__getitem__", [](MassSpringSystem<3> mss, Connector & c) {
         if (c.type==Connector::FIX) return py::cast(mss.Fixes()[c.nr]);
         else return py::cast(mss.Masses()[c.nr]);
@@ -181,10 +235,17 @@ PYBIND11_MODULE(mass_spring, m) {
         mss.GetState (x, dx, ddx);
         return x;
       })
+      .def("Save", [] (MassSpringSystem<3> & mss, std::string filename) {
+        SaveCheckpoint (filename, mss);
+      }, py::arg("filename"), "write topology and state to a binary checkpoint")
+      .def("Load", [] (MassSpringSystem<3> & mss, std::string filename) {
+        LoadCheckpoint (filename, mss);
+      }, py::arg("filename"), "read topology and state from a binary checkpoint")
       ;
     
 
-    m.def("Simulate", [](MassSpringSystem<3> & mss, double tend, size_t steps) {
+    m.def("Simulate", [](MassSpringSystem<3> & mss, double tend, size_t steps,
+                         std::string checkpoint, double interval) {
       Vector<> x(3*mss.Masses().size());
       Vector<> dx(3*mss.Masses().size());
       Vector<> ddx(3*mss.Masses().size());
@@ -192,11 +253,240 @@ PYBIND11_MODULE(mass_spring, m) {
       
       auto mss_func = make_shared<MSS_Function<3>> (mss);
       auto mass = make_shared<IdentityFunction> (x.Size());
-      
-      SolveODE_Alpha(tend, steps, 0.8, x, dx, ddx, mss_func, mass);
+
+      if (checkpoint.empty())
+        SolveODE_Alpha(tend, steps, 0.8, x, dx, ddx, mss_func, mass);
+      else
+        {
+          // the mass-spring state holds x, v and a, so a run restarted
+          // from the checkpoint continues exactly
+          AlphaIntegrator integrator(mss_func, mass, tend/steps, 0.8);
+          integrator.SetState (0, x, dx, ddx);
+          PeriodicCheckpoint<3> writer(checkpoint, mss, integrator, interval);
+          for (size_t i = 0; i < steps; i++)
+            {
+              integrator.Step();
+              writer();
+            }
+          integrator.GetState (x, dx, ddx);
+        }
       
       mss.SetState (x, dx, ddx);
-    });
+    }, py::arg("mss"), py::arg("tend"), py::arg("steps"),
+       py::arg("checkpoint") = "", py::arg("interval") = 60.0);
+
+
+
+    py::enum_<EQUILIBRIUM_METHOD> (m, "EquilibriumMethod")
+      .value("newton", EQUILIBRIUM_NEWTON)
+      .value("lbfgs", EQUILIBRIUM_LBFGS)
+      .value("lbfgs_newton", EQUILIBRIUM_LBFGS_NEWTON)
+      ;
 
+    py::class_<EquilibriumStatistics> (m, "EquilibriumStatistics")
+      .def_readonly("loadsteps", &EquilibriumStatistics::loadsteps)
+      .def_readonly("rejected", &EquilibriumStatistics::rejected)
+      .def_readonly("pseudosteps", &EquilibriumStatistics::pseudosteps)
+      .def_readonly("newtonits", &EquilibriumStatistics::newtonits)
+      .def_readonly("lbfgsits", &EquilibriumStatistics::lbfgsits)
+      ;
+
+    m.def("SolveEquilibrium", [](MassSpringSystem<3> & mss, EQUILIBRIUM_METHOD method,
+                                 int loadsteps, double tol) {
+      EquilibriumParameters params;
+      params.method = method;
+      params.loadsteps = loadsteps;
+      params.tol = tol;
+      return SolveEquilibrium (mss, params);
+    }, py::arg("mss"), py::arg("method") = EQUILIBRIUM_NEWTON,
+       py::arg("loadsteps") = 1, py::arg("tol") = 1e-10,
+       "move the masses into static equilibrium under gravity, with zero velocities");
 
+    m.def("MisfitGradient", [](MassSpringSystem<3> & mss, double tend, size_t steps,
+                               py::array_t<double, py::array::c_style | py::array::forcecast> data,
+                               double rhoinf, int interval) {
+      size_t n = 3*mss.Masses().size();
+      if (data.ndim() != 2 || size_t(data.shape(0)) != steps || size_t(data.shape(1)) != n)
+        throw std::invalid_argument("data needs one row of positions per step");
+      Vector<> x(n), dx(n), ddx(n);
+      mss.GetState (x, dx, ddx);
+      
+      auto mss_func = make_shared<MSS_Function<3>> (mss);
+      auto mass = make_shared<IdentityFunction> (n);
+      const double * d = data.data();
+      auto misfit = [d, n, tend, steps] (double t, VectorView<double> x, VectorView<double> dgdx)
+      {
+        size_t row = size_t(std::lround(t/tend*steps)) - 1;
+        double g = 0;
+        for (size_t i = 0; i < n; i++)
+          {
+            dgdx(i) = x(i) - d[row*n+i];
+            g += 0.5*dgdx(i)*dgdx(i);
+          }
+        return g;
+      };
+      Vector<> grad(mss_func->NumParameters());
+      double value = AdjointODE_Alpha (tend, steps, rhoinf, x, dx, ddx, mss_func, mass,
+                                       misfit, grad, interval);
+      
+      size_t nspring = mss.Springs().size();
+      py::array_t<double> dstiffness(nspring), dmass(mss.Masses().size());
+      for (size_t i = 0; i < nspring; i++)
+        dstiffness.mutable_at(i) = grad(i);
+      for (size_t i = 0; i < mss.Masses().size(); i++)
+        dmass.mutable_at(i) = grad(nspring+i);
+      return py::make_tuple (value, dstiffness, dmass);
+    }, py::arg("mss"), py::arg("tend"), py::arg("steps"), py::arg("data"),
+       py::arg("rhoinf") = 0.8, py::arg("interval") = 0,
+       "misfit 1/2 sum_n |x(t_n) - data[n-1]|^2 of a simulation and its gradient with respect to\n"
+       "the spring stiffnesses and the masses, by the checkpointed discrete adjoint. The state of mss\n"
+       "is not changed.");
+
+
+    py::class_<CompressedTrajectory> (m, "Trajectory",
+                                      "compressed states of a run, lossless or within tolerance, with keyframes for random access")
+      .def(py::init<size_t, double, size_t>(),
+           py::arg("dim"), py::arg("tolerance") = 0.0, py::arg("keyinterval") = 64)
+      .def("Append", [](CompressedTrajectory & traj, double t,
+                        py::array_t<double, py::array::c_style | py::array::forcecast> y) {
+        if (size_t(y.size()) != traj.Dim())
+          throw std::invalid_argument("trajectory state has wrong dimension");
+        traj.Append (t, VectorView<double>(traj.Dim(), y.mutable_data()));
+      }, py::arg("t"), py::arg("y"))
+      .def("__len__", &CompressedTrajectory::Size)
+      .def("__getitem__", [](CompressedTrajectory & traj, int i) {
+        if (i < 0) i += traj.Size();
+        if (i < 0 || size_t(i) >= traj.Size()) throw py::index_error("trajectory index out of range");
+        py::array_t<double> y(traj.Dim());
+        CompressedTrajectory::Reader reader(traj, i);
+        double t = reader.Next (y.mutable_data());
+        return py::make_tuple (t, y);
+      }, "(t, y) of state i")
+      .def("__iter__", [](CompressedTrajectory & traj) {
+        return CompressedTrajectory::Reader(traj);
+      }, py::keep_alive<0,1>(), "decodes the states one after the other")
+      .def("Times", [](CompressedTrajectory & traj) {
+        py::array_t<double> t(traj.Size());
+        for (size_t i = 0; i < traj.Size(); i++) t.mutable_at(i) = traj.Time(i);
+        return t;
+      })
+      .def("Slice", [](CompressedTrajectory & traj, size_t first, size_t last) {
+        last = std::min(last, traj.Size());
+        if (first > last) first = last;
+        py::array_t<double> y({ last-first, traj.Dim() });
+        CompressedTrajectory::Reader reader(traj, first);
+        for (size_t i = first; i < last; i++)
+          reader.Next (y.mutable_data(i-first, 0));
+        return y;
+      }, py::arg("first") = 0, py::arg("last") = size_t(-1),
+         "states first ... last-1 as rows of an array, decoded in one sweep")
+      .def_property_readonly("dim", &CompressedTrajectory::Dim)
+      .def_property_readonly("tolerance", &CompressedTrajectory::Tolerance)
+      .def_property_readonly("nbytes", &CompressedTrajectory::Bytes)
+      .def("Save", [](CompressedTrajectory & traj, std::string filename) {
+        std::ofstream out(filename, std::ios::binary);
+        traj.Save (out);
+      }, py::arg("filename"))
+      .def_static("Load", [](std::string filename) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) throw std::runtime_error("cannot open trajectory "+filename);
+        return CompressedTrajectory::Load (in);
+      }, py::arg("filename"))
+      ;
+
+    py::class_<CompressedTrajectory::Reader> (m, "TrajectoryReader")
+      .def("__iter__", [](CompressedTrajectory::Reader & reader) -> CompressedTrajectory::Reader & { return reader; })
+      .def("__next__", [](CompressedTrajectory::Reader & reader) {
+        if (reader.Done()) throw py::stop_iteration();
+        py::array_t<double> y(reader.Dim());
+        double t = reader.Next (y.mutable_data());
+        return py::make_tuple (t, y);
+      })
+      ;
+
+    py::class_<SolverStatistics> (m, "SolverStatistics")
+      .def_readonly("steps", &SolverStatistics::steps)
+      .def_readonly("newtonits", &SolverStatistics::newtonits)
+      .def_readonly("rejected", &SolverStatistics::rejected)
+      ;
+
+    py::class_<MSS_Simulator<3>> (m, "Simulator",
+                                  "steppable generalized-alpha simulation, keeps its workspaces between calls")
+      .def(py::init<MassSpringSystem<3>&, double, double>(),
+           py::arg("mss"), py::arg("dt"), py::arg("rhoinf") = 0.8,
+           py::keep_alive<1,2>())
+      .def_property_readonly("time", &MSS_Simulator<3>::Time)
+      .def_property("dt",
+                    [](MSS_Simulator<3> & sim) { return sim.Integrator().TimeStep(); },
+                    [](MSS_Simulator<3> & sim, double dt) { sim.Integrator().SetTimeStep(dt); })
+      .def_property_readonly("statistics",
+                             [](MSS_Simulator<3> & sim) { return sim.Integrator().Statistics(); })
+      .def("Step", py::overload_cast<>(&MSS_Simulator<3>::Step), "one time step of size dt")
+      .def("Advance", &MSS_Simulator<3>::Advance, py::arg("tend"),
+           "integrate up to time tend")
+      .def("Save", [](MSS_Simulator<3> & sim, std::string filename) {
+        SaveCheckpoint (filename, sim.System(), &sim.Integrator());
+      }, py::arg("filename"), "write the system and the integrator state to a binary checkpoint")
+      .def("Load", [](MSS_Simulator<3> & sim, std::string filename) {
+        LoadCheckpoint (filename, sim.System(), &sim.Integrator());
+      }, py::arg("filename"),
+        "continue from a checkpoint of Save, the system needs the same number of masses")
+      ;
+
+
+    py::class_<ModalAnalysis> (m, "ModalAnalysis",
+                               "lowest vibration modes of the system linearized about its current positions")
+      .def(py::init([](MassSpringSystem<3> & mss, size_t k, py::object shift, double tol, size_t blocksize) {
+        if (shift.is_none())
+          return std::make_unique<ModalAnalysis> (mss, k);
+        LanczosParameters params;
+        params.shift = shift.cast<double>();
+        params.tol = tol;
+        params.blocksize = blocksize;
+        return std::make_unique<ModalAnalysis> (mss, k, params);
+      }), py::arg("mss"), py::arg("k"), py::arg("shift") = py::none(),
+         py::arg("tol") = 1e-10, py::arg("blocksize") = 6,
+         "the k modes with eigenvalues closest to shift, by default the lowest ones")
+      .def_property_readonly("eigenvalues", [](ModalAnalysis & modal) {
+        py::array_t<double> lam(modal.NumModes());
+        for (size_t i = 0; i < modal.NumModes(); i++) lam.mutable_at(i) = modal.Eigenvalues()(i);
+        return lam;
+      }, "omega^2, ascending")
+      .def_property_readonly("frequencies", [](ModalAnalysis & modal) {
+        py::array_t<double> f(modal.NumModes());
+        for (size_t i = 0; i < modal.NumModes(); i++) f.mutable_at(i) = modal.Frequency(i);
+        return f;
+      }, "natural frequencies sqrt(lam)/2pi, zero for rigid body and unstable modes")
+      .def_property_readonly("damping", [](ModalAnalysis & modal) {
+        py::array_t<double> zeta(modal.NumModes());
+        for (size_t i = 0; i < modal.NumModes(); i++) zeta.mutable_at(i) = modal.DampingRatio(i);
+        return zeta;
+      }, "modal damping ratios")
+      .def_property_readonly("modes", [](ModalAnalysis & modal) {
+        py::array_t<double> phi({ modal.NumModes(), modal.Dim() });
+        for (size_t i = 0; i < modal.NumModes(); i++)
+          for (size_t j = 0; j < modal.Dim(); j++)
+            phi.mutable_at(i, j) = modal.Modes()(i,j);
+        return phi;
+      }, "mass-orthonormal mode shapes in state order, one per row")
+      .def_property_readonly("lanczos_dim", &ModalAnalysis::KrylovDim)
+      ;
+
+    py::class_<ModalIntegrator> (m, "ModalIntegrator",
+                                 "exact time stepping of the linearized dynamics in the basis of the modes")
+      .def(py::init<ModalAnalysis&>(), py::arg("modal"), py::keep_alive<1,2>())
+      .def("SetState", [](ModalIntegrator & integ, MassSpringSystem<3> & mss, double t) {
+        Vector<> x(3*mss.Masses().size()), dx(3*mss.Masses().size()), ddx(3*mss.Masses().size());
+        mss.GetState (x, dx, ddx);
+        integ.SetState (t, x, dx);
+      }, py::arg("mss"), py::arg("t") = 0.0, "projects positions and velocities of the masses")
+      .def("Step", &ModalIntegrator::Step, py::arg("h"), "one step of any size")
+      .def_property_readonly("time", &ModalIntegrator::Time)
+      .def("WriteState", [](ModalIntegrator & integ, MassSpringSystem<3> & mss) {
+        size_t n = 3*mss.Masses().size();
+        Vector<> x(n), dx(n), ddx(n);
+        integ.GetState (x, dx, ddx);
+        mss.SetState (x, dx, ddx);
+      }, py::arg("mss"), "writes the reconstructed state into the masses")
+      ;
 }
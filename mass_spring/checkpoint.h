@@ -0,0 +1,434 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mass_spring.h"
+
+
+// Binary checkpoint of a MassSpringSystem<D>, optionally followed by the
+// state of the AlphaIntegrator advancing it. All records are 8-byte words
+// in native endianness, so the file can be used directly from a mapping:
+//
+//   header       CheckpointHeader
+//   fixes        nfix * D doubles                   (pos)
+//   masses       nmass * (1+3D) doubles             (mass, pos, vel, acc)
+//   springs      nspring * SpringRecord
+//   bendings     nbend * BendingRecord
+//   planes       nplane * (D+1) doubles             (normal, offset)
+//   spheres      nsphere * (D+1) doubles            (center, radius)
+//   order        nmass uint64, the masses in state order
+//   integrator   AlphaIntegrator::Save, if hasintegrator
+
+struct CheckpointHeader
+{
+  char magic[8];
+  uint64_t dim;
+  uint64_t nfix, nmass, nspring, nbend;
+  uint64_t hasintegrator;
+  double gravity[3];          // the first D are used
+  // the contact model, if hascontact
+  uint64_t hascontact, selfcontact;
+  double contactradius, contactstiffness;
+  uint64_t nplane, nsphere;
+};
+
+struct SpringRecord
+{
+  double length;
+  double stiffness;
+  uint64_t connections[2];   // 2*nr + (type == MASS)
+  double stiffness3;
+  double damping;
+  double breakstrain;
+  uint64_t broken;
+};
+
+struct BendingRecord
+{
+  double stiffness;
+  uint64_t connections[3];
+};
+
+inline const char * CheckpointMagic() { return "NEOMSS05"; }
+
+inline uint64_t EncodeConnector (Connector c)
+{
+  return 2*uint64_t(c.nr) + (c.type == Connector::MASS ? 1 : 0);
+}
+
+inline Connector DecodeConnector (uint64_t code)
+{
+  return { (code & 1) ? Connector::MASS : Connector::FIX, size_t(code >> 1) };
+}
+
+
+// read-only mapping of a whole file, falls back to reading on Windows
+class MappedFile
+{
+  const char * data = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  std::vector<char> buffer;
+#endif
+public:
+  MappedFile (const std::string & filename)
+  {
+#ifndef _WIN32
+    int fd = open (filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open checkpoint "+filename);
+    struct stat st;
+    if (fstat (fd, &st) != 0)
+      {
+        close (fd);
+        throw std::runtime_error("cannot stat checkpoint "+filename);
+      }
+    size = st.st_size;
+    void * ptr = size ? mmap (nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close (fd);
+    if (ptr == MAP_FAILED) throw std::runtime_error("cannot map checkpoint "+filename);
+    data = static_cast<const char*>(ptr);
+#else
+    std::ifstream ist(filename, std::ios::binary);
+    if (!ist) throw std::runtime_error("cannot open checkpoint "+filename);
+    buffer.assign (std::istreambuf_iterator<char>(ist), std::istreambuf_iterator<char>());
+    data = buffer.data();
+    size = buffer.size();
+#endif
+  }
+
+  ~MappedFile ()
+  {
+#ifndef _WIN32
+    if (data) munmap (const_cast<char*>(data), size);
+#endif
+  }
+
+  MappedFile (const MappedFile &) = delete;
+  MappedFile & operator= (const MappedFile &) = delete;
+  
+  const char * Data() const { return data; }
+  size_t Size() const { return size; }
+};
+
+
+// istream reading from a memory range without copying it
+class MemoryStreamBuffer : public std::streambuf
+{
+public:
+  MemoryStreamBuffer (const char * begin, const char * end)
+  {
+    char * b = const_cast<char*>(begin);
+    setg (b, b, const_cast<char*>(end));
+  }
+};
+
+
+
+template <int D>
+void SaveCheckpoint (const std::string & filename, MassSpringSystem<D> & mss,
+                     const AlphaIntegrator * integrator = nullptr)
+{
+  CheckpointHeader header;
+  std::memcpy (header.magic, CheckpointMagic(), 8);
+  header.dim = D;
+  header.nfix = mss.Fixes().size();
+  header.nmass = mss.Masses().size();
+  header.nspring = mss.Springs().size();
+  header.nbend = mss.BendingSprings().size();
+  header.hasintegrator = integrator != nullptr;
+  for (int j = 0; j < 3; j++)
+    header.gravity[j] = (j < D) ? mss.Gravity()(j) : 0.0;
+
+  auto contact = mss.Contact();
+  header.hascontact = contact != nullptr;
+  header.selfcontact = contact ? contact->SelfContact() : 0;
+  header.contactradius = contact ? contact->Radius() : 0.0;
+  header.contactstiffness = contact ? contact->Stiffness() : 0.0;
+  header.nplane = contact ? contact->Planes().size() : 0;
+  header.nsphere = contact ? contact->Spheres().size() : 0;
+
+  std::vector<double> contactdata((D+1)*(header.nplane+header.nsphere));
+  for (size_t i = 0; i < header.nplane; i++)
+    {
+      auto & p = contact->Planes()[i];
+      for (int j = 0; j < D; j++)
+        contactdata[(D+1)*i+j] = p.normal(j);
+      contactdata[(D+1)*i+D] = p.offset;
+    }
+  for (size_t i = 0; i < header.nsphere; i++)
+    {
+      auto & s = contact->Spheres()[i];
+      double * rec = &contactdata[(D+1)*(header.nplane+i)];
+      for (int j = 0; j < D; j++)
+        rec[j] = s.center(j);
+      rec[D] = s.radius;
+    }
+
+  std::vector<double> fixdata(D*header.nfix);
+  for (size_t i = 0; i < mss.Fixes().size(); i++)
+    for (int j = 0; j < D; j++)
+      fixdata[D*i+j] = mss.Fixes()[i].pos(j);
+
+  std::vector<double> massdata((1+3*D)*header.nmass);
+  for (size_t i = 0; i < mss.Masses().size(); i++)
+    {
+      auto & m = mss.Masses()[i];
+      double * rec = &massdata[(1+3*D)*i];
+      rec[0] = m.mass;
+      for (int j = 0; j < D; j++)
+        {
+          rec[1+j] = m.pos(j);
+          rec[1+D+j] = m.vel(j);
+          rec[1+2*D+j] = m.acc(j);
+        }
+    }
+
+  std::vector<SpringRecord> springdata(header.nspring);
+  for (size_t i = 0; i < mss.Springs().size(); i++)
+    {
+      auto & s = mss.Springs()[i];
+      springdata[i] = { s.length, s.stiffness,
+                        { EncodeConnector(s.connections[0]), EncodeConnector(s.connections[1]) },
+                        s.stiffness3, s.damping, s.breakstrain, s.broken };
+    }
+
+  std::vector<uint64_t> orderdata(mss.StateOrder().begin(), mss.StateOrder().end());
+
+  std::vector<BendingRecord> bendingdata(header.nbend);
+  for (size_t i = 0; i < mss.BendingSprings().size(); i++)
+    {
+      auto & b = mss.BendingSprings()[i];
+      bendingdata[i] = { b.stiffness, { EncodeConnector(b.connections[0]), EncodeConnector(b.connections[1]),
+                                        EncodeConnector(b.connections[2]) } };
+    }
+
+  // write to a temporary file and rename, such that an interrupted write
+  // never destroys the previous checkpoint
+  std::string tmpname = filename + ".tmp";
+  {
+    std::ofstream ost(tmpname, std::ios::binary | std::ios::trunc);
+    if (!ost) throw std::runtime_error("cannot write checkpoint "+tmpname);
+    ost.write (reinterpret_cast<const char*>(&header), sizeof(header));
+    ost.write (reinterpret_cast<const char*>(fixdata.data()), fixdata.size()*sizeof(double));
+    ost.write (reinterpret_cast<const char*>(massdata.data()), massdata.size()*sizeof(double));
+    ost.write (reinterpret_cast<const char*>(springdata.data()), springdata.size()*sizeof(SpringRecord));
+    ost.write (reinterpret_cast<const char*>(bendingdata.data()), bendingdata.size()*sizeof(BendingRecord));
+    ost.write (reinterpret_cast<const char*>(contactdata.data()), contactdata.size()*sizeof(double));
+    ost.write (reinterpret_cast<const char*>(orderdata.data()), orderdata.size()*sizeof(uint64_t));
+    if (integrator)
+      integrator->Save (ost);
+    if (!ost) throw std::runtime_error("writing checkpoint "+tmpname+" failed");
+  }
+#ifdef _WIN32
+  std::remove (filename.c_str());
+#endif
+  if (std::rename (tmpname.c_str(), filename.c_str()) != 0)
+    throw std::runtime_error("cannot rename checkpoint to "+filename);
+}
+
+
+template <int D>
+void LoadCheckpoint (const std::string & filename, MassSpringSystem<D> & mss,
+                     AlphaIntegrator * integrator = nullptr)
+{
+  MappedFile file(filename);
+
+  CheckpointHeader header;
+  if (file.Size() < sizeof(header))
+    throw std::runtime_error("checkpoint "+filename+" is truncated");
+  std::memcpy (&header, file.Data(), sizeof(header));
+  if (std::memcmp (header.magic, CheckpointMagic(), 8) != 0)
+    throw std::runtime_error(filename+" is not a mass-spring checkpoint");
+  if (header.dim != D)
+    throw std::runtime_error("checkpoint "+filename+" has wrong dimension");
+  // everything is checked before the system is modified
+  if (integrator && integrator->Solution().Size() != D*header.nmass)
+    throw std::runtime_error("checkpoint "+filename+" does not match the integrator size");
+  if (integrator && !header.hasintegrator)
+    throw std::runtime_error("checkpoint "+filename+" holds no integrator state");
+
+  // the records in sequence, every count is checked against the remaining
+  // bytes before it is multiplied
+  size_t offset = sizeof(header);
+  auto take = [&](uint64_t count, size_t recsize)
+  {
+    if (count > (file.Size()-offset) / recsize)
+      throw std::runtime_error("checkpoint "+filename+" is truncated");
+    const char * ptr = file.Data()+offset;
+    offset += count*recsize;
+    return ptr;
+  };
+  const double * fixdata = reinterpret_cast<const double*>(take(header.nfix, D*sizeof(double)));
+  const double * massdata = reinterpret_cast<const double*>(take(header.nmass, (1+3*D)*sizeof(double)));
+  const SpringRecord * springdata = reinterpret_cast<const SpringRecord*>(take(header.nspring, sizeof(SpringRecord)));
+  const BendingRecord * bendingdata = reinterpret_cast<const BendingRecord*>(take(header.nbend, sizeof(BendingRecord)));
+  const double * contactdata = reinterpret_cast<const double*>(take(header.nplane, (D+1)*sizeof(double)));
+  take(header.nsphere, (D+1)*sizeof(double));
+  const uint64_t * orderdata = reinterpret_cast<const uint64_t*>(take(header.nmass, sizeof(uint64_t)));
+
+  auto checkconnector = [&](uint64_t code)
+  {
+    Connector c = DecodeConnector(code);
+    if (c.nr >= (c.type == Connector::MASS ? header.nmass : header.nfix))
+      throw std::runtime_error("checkpoint "+filename+" connects to a missing mass or fix");
+  };
+  for (size_t i = 0; i < header.nspring; i++)
+    for (uint64_t code : springdata[i].connections)
+      checkconnector (code);
+  for (size_t i = 0; i < header.nbend; i++)
+    for (uint64_t code : bendingdata[i].connections)
+      checkconnector (code);
+
+  std::vector<bool> inorder(header.nmass, false);
+  for (size_t i = 0; i < header.nmass; i++)
+    {
+      if (orderdata[i] >= header.nmass || inorder[orderdata[i]])
+        throw std::runtime_error("checkpoint "+filename+" has no valid state order");
+      inorder[orderdata[i]] = true;
+    }
+
+  mss.Fixes().resize(header.nfix);
+  for (size_t i = 0; i < header.nfix; i++)
+    for (int j = 0; j < D; j++)
+      mss.Fixes()[i].pos(j) = fixdata[D*i+j];
+
+  mss.Masses().resize(header.nmass);
+  for (size_t i = 0; i < header.nmass; i++)
+    {
+      auto & m = mss.Masses()[i];
+      const double * rec = massdata + (1+3*D)*i;
+      m.mass = rec[0];
+      for (int j = 0; j < D; j++)
+        {
+          m.pos(j) = rec[1+j];
+          m.vel(j) = rec[1+D+j];
+          m.acc(j) = rec[1+2*D+j];
+        }
+    }
+
+  mss.Springs().resize(header.nspring);
+  for (size_t i = 0; i < header.nspring; i++)
+    mss.Springs()[i] = { springdata[i].length, springdata[i].stiffness,
+                         { DecodeConnector(springdata[i].connections[0]),
+                           DecodeConnector(springdata[i].connections[1]) },
+                         springdata[i].stiffness3, springdata[i].damping,
+                         springdata[i].breakstrain, springdata[i].broken != 0 };
+
+  mss.BendingSprings().resize(header.nbend);
+  for (size_t i = 0; i < header.nbend; i++)
+    mss.BendingSprings()[i] = { bendingdata[i].stiffness,
+                                { DecodeConnector(bendingdata[i].connections[0]),
+                                  DecodeConnector(bendingdata[i].connections[1]),
+                                  DecodeConnector(bendingdata[i].connections[2]) } };
+  Vec<D> gravity;
+  for (int j = 0; j < D; j++)
+    gravity(j) = header.gravity[j];
+  mss.SetGravity (gravity);
+
+  std::shared_ptr<ContactModel<D>> contact;
+  if (header.hascontact)
+    {
+      contact = std::make_shared<ContactModel<D>>(header.contactradius, header.contactstiffness);
+      contact->SetSelfContact (header.selfcontact != 0);
+      // the saved normals are normalized already, stored as they are
+      contact->Planes().resize(header.nplane);
+      for (size_t i = 0; i < header.nplane; i++)
+        {
+          auto & p = contact->Planes()[i];
+          for (int j = 0; j < D; j++)
+            p.normal(j) = contactdata[(D+1)*i+j];
+          p.offset = contactdata[(D+1)*i+D];
+        }
+      contact->Spheres().resize(header.nsphere);
+      for (size_t i = 0; i < header.nsphere; i++)
+        {
+          auto & s = contact->Spheres()[i];
+          const double * rec = contactdata + (D+1)*(header.nplane+i);
+          for (int j = 0; j < D; j++)
+            s.center(j) = rec[j];
+          s.radius = rec[D];
+        }
+    }
+  mss.SetContact (contact);
+
+  mss.UpdateTopology();
+  // the integrator state is in this order
+  mss.SetStateOrder (std::vector<size_t>(orderdata, orderdata+header.nmass));
+
+  if (integrator)
+    {
+      MemoryStreamBuffer buf(file.Data()+offset, file.Data()+file.Size());
+      std::istream ist(&buf);
+      integrator->Load (ist);
+      // as in a fresh integrator, the restarted run continues exactly
+      integrator->InvalidateJacobian();
+    }
+}
+
+
+
+// Writes checkpoints during a run, at most every 'interval' seconds of wall
+// time. A checkpoint is also skipped while the time spent writing exceeds
+// the fraction 'maxoverhead' of the elapsed time, which bounds the overhead
+// for large systems on slow file systems.
+template <int D>
+class PeriodicCheckpoint
+{
+  using clock = std::chrono::steady_clock;
+  
+  std::string filename;
+  MassSpringSystem<D> & mss;
+  const AlphaIntegrator & integrator;
+  double interval;
+  double maxoverhead;
+  clock::time_point start, last;
+  double writetime = 0;
+
+  static double Seconds (clock::duration d)
+  { return std::chrono::duration<double>(d).count(); }
+  
+public:
+  PeriodicCheckpoint (std::string _filename, MassSpringSystem<D> & _mss,
+                      const AlphaIntegrator & _integrator,
+                      double _interval = 60, double _maxoverhead = 0.05)
+    : filename(_filename), mss(_mss), integrator(_integrator),
+      interval(_interval), maxoverhead(_maxoverhead),
+      start(clock::now()), last(start) { }
+
+  // to be called after every time step, returns whether a checkpoint was written
+  bool operator() ()
+  {
+    auto now = clock::now();
+    if (Seconds(now-last) < interval) return false;
+    if (writetime > maxoverhead * Seconds(now-start)) return false;
+    
+    Write();
+    
+    last = clock::now();
+    writetime += Seconds(last-now);
+    return true;
+  }
+
+  void Write ()
+  {
+    mss.SetState (integrator.X(), integrator.V(), integrator.A());
+    SaveCheckpoint (filename, mss, &integrator);
+  }
+};
+
+#endif
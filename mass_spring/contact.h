@@ -0,0 +1,312 @@
+#ifndef CONTACT_H
+#define CONTACT_H
+
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+
+#include <vector.h>
+using namespace Neo_CLA;
+
+
+// Penalty contact for point masses of radius 'radius': masses closer than
+// 2*radius, and masses penetrating planes or spheres, are pushed apart by
+// the force stiffness * penetration. Candidate pairs come from a spatial
+// hash with cell size 2*radius, so only neighbouring cells are searched.
+
+template <int D>
+class ContactPlane
+{
+public:
+  Vec<D> normal;     // unit normal, pointing to the free side
+  double offset;     // the plane is normal*x = offset
+};
+
+template <int D>
+class ContactSphere
+{
+public:
+  Vec<D> center;
+  double radius;
+};
+
+
+template <int D>
+class SpatialHash
+{
+  double cellsize = 1;
+  std::unordered_map<uint64_t, std::vector<size_t>> cells;
+  std::vector<uint64_t> cellof;
+
+  static uint64_t Key (const std::array<int64_t,D> & c)
+  {
+    static const uint64_t primes[3] = { 73856093, 19349663, 83492791 };
+    uint64_t key = 0;
+    for (int i = 0; i < D; i++)
+      key ^= uint64_t(c[i]) * primes[i];
+    return key;
+  }
+
+  template <typename TV>
+  std::array<int64_t,D> Cell (const TV & p) const
+  {
+    std::array<int64_t,D> c;
+    for (int i = 0; i < D; i++)
+      c[i] = int64_t(std::floor(p(i)/cellsize));
+    return c;
+  }
+
+  void Remove (uint64_t key, size_t nr)
+  {
+    auto & bucket = cells[key];
+    auto pos = std::find (bucket.begin(), bucket.end(), nr);
+    *pos = bucket.back();
+    bucket.pop_back();
+    if (bucket.empty()) cells.erase(key);
+  }
+
+public:
+  void SetCellSize (double h)
+  {
+    cellsize = h;
+    cells.clear();
+    cellof.clear();
+  }
+
+  // moves only the points which changed their cell, a full rebuild
+  // if the number of points changed
+  template <typename TM>
+  void Update (const TM & points)
+  {
+    size_t n = points.height();
+    if (cellof.size() != n)
+      {
+        cells.clear();
+        cellof.resize(n);
+        for (size_t i = 0; i < n; i++)
+          {
+            cellof[i] = Key(Cell(points.Row(i)));
+            cells[cellof[i]].push_back(i);
+          }
+        return;
+      }
+    for (size_t i = 0; i < n; i++)
+      {
+        uint64_t key = Key(Cell(points.Row(i)));
+        if (key == cellof[i]) continue;
+        Remove (cellof[i], i);
+        cells[key].push_back(i);
+        cellof[i] = key;
+      }
+  }
+
+  // calls func(i, j) for all i < j in the same or neighbouring cells
+  template <typename TM, typename FUNC>
+  void ForEachCandidate (const TM & points, FUNC func) const
+  {
+    int noffsets = 1;
+    for (int i = 0; i < D; i++) noffsets *= 3;
+    std::vector<uint64_t> visited;
+
+    for (size_t i = 0; i < points.height(); i++)
+      {
+        auto c = Cell(points.Row(i));
+        visited.clear();
+        for (int k = 0; k < noffsets; k++)
+          {
+            auto cn = c;
+            for (int j = 0, kk = k; j < D; j++, kk /= 3)
+              cn[j] += kk % 3 - 1;
+            uint64_t key = Key(cn);
+            // hash collisions may map different cells to the same bucket
+            if (std::find (visited.begin(), visited.end(), key) != visited.end()) continue;
+            visited.push_back(key);
+            auto bucket = cells.find(key);
+            if (bucket == cells.end()) continue;
+            for (size_t j : bucket->second)
+              if (i < j) func (i, j);
+          }
+      }
+  }
+};
+
+
+template <int D>
+class ContactModel
+{
+  double radius;
+  double stiffness;
+  std::vector<ContactPlane<D>> planes;
+  std::vector<ContactSphere<D>> spheres;
+  bool selfcontact = true;
+  mutable SpatialHash<D> hash;
+  mutable std::mutex hashlock;
+
+  // penalty force k (l0-l) n and its derivative -k (n n^T + (l-l0)/l (I - n n^T))
+  // with respect to p, where l = |p - q|, n = (p-q)/l
+  static void Penalty (Vec<D> diff, double l0, double k, Vec<D> & force, double (&K)[D][D])
+  {
+    double l = L2Norm(diff);
+    Vec<D> n = 1.0/l * diff;
+    force = (k*(l0-l)) * n;
+    double ks = k*(l-l0)/l;
+    for (int i = 0; i < D; i++)
+      for (int j = 0; j < D; j++)
+        K[i][j] = -(k-ks)*n(i)*n(j) - (i == j ? ks : 0);
+  }
+
+  template <typename TM, typename FUNC>
+  void ForEachPair (const TM & xmat, FUNC func) const
+  {
+    if (!selfcontact) return;
+    std::lock_guard<std::mutex> guard(hashlock);
+    hash.Update (xmat);
+    hash.ForEachCandidate (xmat, [&](size_t i, size_t j)
+    {
+      Vec<D> diff = xmat.Row(i);
+      diff -= xmat.Row(j);
+      double l = L2Norm(diff);
+      if (l < 2*radius && l > 0) func (i, j, diff);
+    });
+  }
+
+public:
+  ContactModel (double _radius, double _stiffness)
+    : radius(_radius), stiffness(_stiffness)
+  {
+    hash.SetCellSize (2*radius);
+  }
+
+  double Radius() const { return radius; }
+  double Stiffness() const { return stiffness; }
+  void SetSelfContact (bool _selfcontact) { selfcontact = _selfcontact; }
+  bool SelfContact() const { return selfcontact; }
+  auto & Planes() { return planes; }
+  auto & Spheres() { return spheres; }
+
+  void AddPlane (ContactPlane<D> p)
+  {
+    p.normal = 1.0/L2Norm(p.normal) * p.normal;
+    planes.push_back (p);
+  }
+  void AddSphere (ContactSphere<D> s) { spheres.push_back (s); }
+
+  // adds the contact forces of masses at positions xmat (one row per mass)
+  template <typename TM, typename TF>
+  void AddForces (const TM & xmat, TF & fmat) const
+  {
+    Vec<D> force;
+    double K[D][D];
+    for (size_t i = 0; i < xmat.height(); i++)
+      {
+        for (auto & p : planes)
+          {
+            double g = -p.offset - radius;
+            for (int k = 0; k < D; k++)
+              g += p.normal(k) * xmat(i,k);
+            if (g < 0) fmat.Row(i) += (-stiffness*g) * p.normal;
+          }
+        for (auto & s : spheres)
+          {
+            Vec<D> diff = xmat.Row(i);
+            diff -= s.center;
+            if (L2Norm(diff) < s.radius + radius)
+              {
+                Penalty (diff, s.radius+radius, stiffness, force, K);
+                fmat.Row(i) += force;
+              }
+          }
+      }
+
+    ForEachPair (xmat, [&](size_t i, size_t j, Vec<D> diff)
+    {
+      Penalty (diff, 2*radius, stiffness, force, K);
+      fmat.Row(i) += force;
+      fmat.Row(j) -= force;
+    });
+  }
+
+  // penalty energy stiffness/2 * penetration^2 of masses at positions xmat,
+  // the potential of the contact forces
+  template <typename TM>
+  double Energy (const TM & xmat) const
+  {
+    double energy = 0;
+    for (size_t i = 0; i < xmat.height(); i++)
+      {
+        for (auto & p : planes)
+          {
+            double g = -p.offset - radius;
+            for (int k = 0; k < D; k++)
+              g += p.normal(k) * xmat(i,k);
+            if (g < 0) energy += stiffness/2 * g*g;
+          }
+        for (auto & s : spheres)
+          {
+            Vec<D> diff = xmat.Row(i);
+            diff -= s.center;
+            double pen = s.radius + radius - L2Norm(diff);
+            if (pen > 0) energy += stiffness/2 * pen*pen;
+          }
+      }
+
+    ForEachPair (xmat, [&](size_t i, size_t j, Vec<D> diff)
+    {
+      double pen = 2*radius - L2Norm(diff);
+      energy += stiffness/2 * pen*pen;
+    });
+    return energy;
+  }
+
+  // adds the derivative of the contact forces, df has D*nmass rows and columns
+  template <typename TM, typename TJ>
+  void AddJacobian (const TM & xmat, TJ && df) const
+  {
+    Vec<D> force;
+    double K[D][D];
+    for (size_t i = 0; i < xmat.height(); i++)
+      {
+        for (auto & p : planes)
+          {
+            double g = -p.offset - radius;
+            for (int k = 0; k < D; k++)
+              g += p.normal(k) * xmat(i,k);
+            if (g < 0)
+              for (int k = 0; k < D; k++)
+                for (int l = 0; l < D; l++)
+                  df(D*i+k, D*i+l) -= stiffness*p.normal(k)*p.normal(l);
+          }
+        for (auto & s : spheres)
+          {
+            Vec<D> diff = xmat.Row(i);
+            diff -= s.center;
+            if (L2Norm(diff) < s.radius + radius)
+              {
+                Penalty (diff, s.radius+radius, stiffness, force, K);
+                for (int k = 0; k < D; k++)
+                  for (int l = 0; l < D; l++)
+                    df(D*i+k, D*i+l) += K[k][l];
+              }
+          }
+      }
+
+    ForEachPair (xmat, [&](size_t i, size_t j, Vec<D> diff)
+    {
+      Penalty (diff, 2*radius, stiffness, force, K);
+      for (int k = 0; k < D; k++)
+        for (int l = 0; l < D; l++)
+          {
+            df(D*i+k, D*i+l) += K[k][l];
+            df(D*i+k, D*j+l) -= K[k][l];
+            df(D*j+k, D*j+l) += K[k][l];
+            df(D*j+k, D*i+l) -= K[k][l];
+          }
+    });
+  }
+};
+
+#endif
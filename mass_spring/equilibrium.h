@@ -0,0 +1,185 @@
+#ifndef EQUILIBRIUM_H
+#define EQUILIBRIUM_H
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <Newton.h>
+#include <lbfgs.h>
+
+#include "mass_spring.h"
+
+
+// Static equilibrium of a mass-spring system under gravity, instead of
+// integrating until the oscillations are damped out:
+//  - EQUILIBRIUM_NEWTON finds the zero of the accelerations a(x) by Newton's
+//    method with load stepping: gravity is applied in increments, every
+//    increment starts from the previous equilibrium. If Newton fails, e.g.
+//    on the singular Jacobian of an unstretched planar net, the increment
+//    is solved by pseudo-transient continuation: implicit Euler steps
+//    x - x_k - tau a(x) = 0 of the overdamped motion, with tau growing
+//    as 1/|a| until they become Newton steps. If that fails as well, the
+//    increment is halved,
+//  - EQUILIBRIUM_LBFGS minimizes the potential energy by L-BFGS, which is
+//    robust from far away but converges only linearly,
+//  - EQUILIBRIUM_LBFGS_NEWTON minimizes to a coarse tolerance and refines
+//    by Newton at the full load.
+// Renumbered masses (Renumber) give banded Jacobians for the Newton solves.
+enum EQUILIBRIUM_METHOD { EQUILIBRIUM_NEWTON, EQUILIBRIUM_LBFGS, EQUILIBRIUM_LBFGS_NEWTON };
+
+struct EquilibriumParameters
+{
+  EQUILIBRIUM_METHOD method = EQUILIBRIUM_NEWTON;
+  int loadsteps = 1;           // initial number of load increments
+  int maxhalvings = 8;         // of a failing load increment
+  NEWTON_MODE mode = LINESEARCH;
+  double tol = 1e-10;          // on the accelerations
+  int maxsteps = 50;           // Newton iterations per load increment
+  int maxpseudosteps = 200;    // of pseudo-transient continuation per increment
+  LBFGSParameters lbfgs = { 10, 1e-6, 10000 };
+  double predictortol = 1e-3;  // relative gradient of L-BFGS before Newton
+};
+
+struct EquilibriumStatistics
+{
+  int loadsteps = 0;           // accepted load increments
+  int rejected = 0;            // halved load increments
+  int pseudosteps = 0;         // pseudo-transient steps
+  int newtonits = 0;
+  int lbfgsits = 0;            // energy evaluations of L-BFGS
+};
+
+
+// moves the masses of mss into equilibrium, starting from their current
+// positions, and sets their velocities and accelerations to zero
+template <int D>
+EquilibriumStatistics SolveEquilibrium (MassSpringSystem<D> & mss,
+                                        EquilibriumParameters params = EquilibriumParameters())
+{
+  EquilibriumStatistics stats;
+  size_t n = D*mss.Masses().size();
+  Vector<> x(n), v(n), a(n);
+  mss.GetState (x, v, a);
+
+  auto func = make_shared<MSS_Function<D>>(mss, false);
+  NewtonWorkspace newton(n, n);
+  auto solve = [&](shared_ptr<NonlinearFunction> equ)
+  {
+    newton.Solve (equ, x, params.mode, params.tol, params.maxsteps,
+                  [&](int, double, VectorView<double>) { stats.newtonits++; });
+  };
+
+  // Newton from x, else pseudo-transient continuation from x
+  auto continuation = [&]()
+  {
+    Vector<> xstart(n);
+    xstart = x;
+    try
+      {
+        solve (func);
+        return;
+      }
+    catch (std::domain_error & e) { x = xstart; }
+
+    Matrix<> jac(n, n);
+    Vector<> acc(n);
+    func->EvaluateDeriv (x, jac);
+    double maxdiag = 0;
+    for (size_t i = 0; i < n; i++)
+      maxdiag = std::max(maxdiag, std::abs(jac(i,i)));
+    double tau = 1 / std::max(maxdiag, 1e-300);
+    func->Evaluate (x, acc);
+    double res = L2Norm(acc);
+
+    auto xk = make_shared<ConstantFunction>(x);
+    auto xnew = make_shared<IdentityFunction>(n);
+    for (int k = 0; k < params.maxpseudosteps; k++)
+      {
+        xk->Set (x);
+        solve (xnew - xk - tau*func);
+        stats.pseudosteps++;
+        func->Evaluate (x, acc);
+        double resnew = L2Norm(acc);
+        if (resnew < params.tol) return;
+
+        // the pseudo steps regularize the Jacobian, Newton may take over
+        xstart = x;
+        try
+          {
+            solve (func);
+            return;
+          }
+        catch (std::domain_error & e) { x = xstart; }
+        // switched evolution relaxation, at least doubling
+        tau *= std::max(2.0, res / resnew);
+        res = resnew;
+      }
+    throw std::domain_error("pseudo-transient continuation did not converge");
+  };
+
+  if (params.method != EQUILIBRIUM_NEWTON)
+    {
+      LBFGSParameters lbfgs = params.lbfgs;
+      if (params.method == EQUILIBRIUM_LBFGS_NEWTON)
+        lbfgs.tol = params.predictortol;
+      auto energy = [&func,&stats](VectorView<double> x, VectorView<double> grad)
+      {
+        stats.lbfgsits++;
+        return func->Energy (x, grad);
+      };
+      if (params.method == EQUILIBRIUM_LBFGS)
+        MinimizeLBFGS (energy, x, lbfgs);
+      else
+        {
+          // Newton continues from the last iterate anyway
+          try { MinimizeLBFGS (energy, x, lbfgs); }
+          catch (std::domain_error & e) { ; }
+          solve (func);
+        }
+    }
+  else
+    {
+      // continuation in the load factor lam of gravity
+      Vec<D> gravity = mss.Gravity();
+      Vector<> xold(n);
+      double lam = 0;
+      double dlam = 1.0 / std::max(1, params.loadsteps);
+      double mindlam = dlam / (1 << params.maxhalvings);
+      try
+        {
+          while (lam < 1)
+            {
+              double next = std::min(1.0, lam+dlam);
+              mss.SetGravity (next * gravity);
+              xold = x;
+              try
+                {
+                  continuation();
+                }
+              catch (std::domain_error & e)
+                {
+                  x = xold;
+                  dlam /= 2;
+                  stats.rejected++;
+                  if (dlam < mindlam) throw;
+                  continue;
+                }
+              lam = next;
+              stats.loadsteps++;
+            }
+        }
+      catch (...)
+        {
+          mss.SetGravity (gravity);
+          throw;
+        }
+      mss.SetGravity (gravity);
+    }
+
+  v = 0.0;
+  a = 0.0;
+  mss.SetState (x, v, a);
+  return stats;
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include "mass_spring.h"
+#include "checkpoint.h"
+#include "multirate_mss.h"
 
 using namespace std;
 
@@ -33,5 +35,50 @@ int main()
   SolveODE_Newmark(tend, steps, x, dx,  mss_func, mass,
                    [](double t, VectorView<double> x) { cout << "t = " << t
                                                              << ", x = " << Vec<4>(x) << endl; });
- 
+
+
+  // checkpoint and restart: the restarted simulation continues exactly
+  MSS_Simulator<2> sim(mss, tend/steps);
+  sim.Advance (1);
+  SaveCheckpoint ("mass_spring.ckpt", mss, &sim.Integrator());
+  sim.Advance (2);
+
+  MassSpringSystem<2> restarted;
+  LoadCheckpoint ("mass_spring.ckpt", restarted);
+  MSS_Simulator<2> resim(restarted, tend/steps);
+  LoadCheckpoint ("mass_spring.ckpt", restarted, &resim.Integrator());
+  resim.Advance (2);
+
+  double diff = 0;
+  for (size_t i = 0; i < x.Size(); i++)
+    diff = max(diff, abs(sim.Integrator().X()(i) - resim.Integrator().X()(i)));
+  cout << "restart at t = 1, difference at t = " << resim.Time() << ": " << diff << endl;
+
+
+  // multirate: a soft chain with one hard spring, whose masses get 10
+  // substeps, against implicit Euler with the small step everywhere
+  MassSpringSystem<2> chain;
+  chain.SetGravity( {0,-9.81} );
+  auto prev = chain.AddFix( { { 0.0, 0.0 } } );
+  for (int i = 1; i <= 6; i++)
+    {
+      auto m = chain.AddMass( { 1, { double(i), 0.0 } } );
+      chain.AddSpring ( { 1, i == 4 ? 1000.0 : 10.0, { prev, m } } );
+      prev = m;
+    }
+
+  size_t nc = 2*chain.Masses().size();
+  Vector<> yref(2*nc), aref(nc);
+  chain.GetState (yref.Range(0, nc), yref.Range(nc, 2*nc), aref);
+  SolveODE_IE (1, 1000, yref, make_shared<MSS_FirstOrderFunction<2>>(chain));
+
+  MSS_MultirateSimulator<2> mrsim(chain, 0.01, 10, 10);
+  mrsim.Advance (1);
+  Vector<> ymr = mrsim.Integrator().Y();
+
+  double mrdiff = 0;
+  for (size_t i = 0; i < nc; i++)
+    mrdiff = max(mrdiff, abs(ymr(i) - yref(i)));
+  cout << "multirate: " << mrsim.FastIndices().size()/4 << " fast masses, "
+       << "difference to the small step at t = 1: " << mrdiff << endl;
 }
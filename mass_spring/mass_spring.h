@@ -3,6 +3,12 @@
 
 
 
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <type_traits>
+
 #include <nonlinfunc.h>
 #include <ode.h>
 
@@ -11,6 +17,8 @@ using namespace Neo_ODE;
 #include <vector.h>
 using namespace Neo_CLA;
 
+#include "contact.h"
+
 
 
 template <int D>
@@ -40,30 +48,200 @@ public:
   size_t nr;
 };
 
-std::ostream & operator<< (std::ostream & ost, const Connector & con)
+inline std::ostream & operator<< (std::ostream & ost, const Connector & con)
 {
   ost << "type = " << int(con.type) << ", nr = " << con.nr;
   return ost;
 }
 
+// force k e + k3 e^3 along the spring with elongation e = l - length,
+// and the dashpot force damping * (relative velocity along the spring)
 class Spring
 {
 public:
   double length;  
   double stiffness;
   std::array<Connector,2> connections;
+  double stiffness3 = 0;
+  double damping = 0;
+  double breakstrain = 0;   // relative elongation at which the spring breaks, 0 for never
+  bool broken = false;
+};
+
+// resists bending at the middle point with energy k/2 |p1 - 2 p2 + p3|^2,
+// the rest shape is straight and equally spaced
+class BendingSpring
+{
+public:
+  double stiffness;
+  std::array<Connector,3> connections;
 };
 
+// orderings of the masses in state vectors
+enum MSS_ORDERING { ORDER_INSERTION, ORDER_RCM, ORDER_MORTON };
+
 template <int D>
 class MassSpringSystem
 {
   std::vector<Fix<D>> fixes;
   std::vector<Mass<D>> masses;
   std::vector<Spring> springs;
+  std::vector<BendingSpring> bendings;
   Vec<D> gravity=0.0;
+
+  // topology: the unbroken springs in a compact list, and for every mass
+  // the coupled masses with the number of springs between them, which is
+  // the block sparsity pattern of the Jacobian. Both are updated
+  // incrementally when springs are added or break.
+  std::vector<size_t> active;
+  std::vector<size_t> activepos;
+  std::vector<std::vector<std::pair<size_t,int>>> coupling;
+  size_t topologyversion = 0;
+
+  // row k of state vectors holds mass order[k], mass i is in row rowof[i].
+  // Connectors and Masses() keep the insertion numbers.
+  std::vector<size_t> order, rowof;
+
+  std::shared_ptr<ContactModel<D>> contact;
+
+  void Couple (size_t i, size_t j, int cnt)
+  {
+    auto & ci = coupling[i];
+    auto pos = std::find_if (ci.begin(), ci.end(), [j](auto & c) { return c.first == j; });
+    if (pos == ci.end())
+      ci.emplace_back (j, cnt);
+    else if ((pos->second += cnt) == 0)
+      {
+        *pos = ci.back();
+        ci.pop_back();
+      }
+  }
+
+  // masses coupled by springs or bending springs
+  std::vector<std::vector<size_t>> Neighbours () const
+  {
+    std::vector<std::vector<size_t>> nb(masses.size());
+    for (size_t i = 0; i < masses.size(); i++)
+      for (auto [j, cnt] : coupling[i])
+        nb[i].push_back (j);
+    for (auto & b : bendings)
+      for (auto & c1 : b.connections)
+        for (auto & c2 : b.connections)
+          if (c1.type == Connector::MASS && c2.type == Connector::MASS && c1.nr != c2.nr)
+            nb[c1.nr].push_back (c2.nr);
+    for (auto & n : nb)
+      {
+        std::sort (n.begin(), n.end());
+        n.erase (std::unique (n.begin(), n.end()), n.end());
+      }
+    return nb;
+  }
+
+  // reverse Cuthill-McKee: breadth first search from a peripheral mass of
+  // every component, neighbours by increasing degree, then reversed
+  std::vector<size_t> RCMOrder () const
+  {
+    auto nb = Neighbours();
+    size_t n = masses.size();
+    std::vector<size_t> perm;
+    std::vector<bool> visited(n, false);
+    std::vector<size_t> level(n);
+    auto bfs = [&](size_t start, std::vector<size_t> & out)
+    {
+      size_t first = out.size();
+      out.push_back (start);
+      visited[start] = true;
+      level[start] = 0;
+      for (size_t k = first; k < out.size(); k++)
+        {
+          size_t i = out[k];
+          std::vector<size_t> next;
+          for (size_t j : nb[i])
+            if (!visited[j])
+              {
+                visited[j] = true;
+                level[j] = level[i]+1;
+                next.push_back (j);
+              }
+          std::sort (next.begin(), next.end(),
+                     [&](size_t a, size_t b) { return nb[a].size() < nb[b].size(); });
+          out.insert (out.end(), next.begin(), next.end());
+        }
+    };
+
+    for (size_t seed = 0; seed < n; seed++)
+      {
+        if (visited[seed]) continue;
+        // pseudo-peripheral start: repeatedly the least coupled mass of the
+        // last level, as long as the eccentricity grows
+        size_t start = seed, eccentricity = 0;
+        for (int sweep = 0; sweep < 4; sweep++)
+          {
+            std::vector<size_t> comp;
+            bfs (start, comp);
+            for (size_t i : comp) visited[i] = false;
+            size_t best = start;
+            for (size_t i : comp)
+              if (level[i] > level[best] ||
+                  (level[i] == level[best] && nb[i].size() < nb[best].size()))
+                best = i;
+            if (sweep > 0 && level[best] <= eccentricity) break;
+            eccentricity = level[best];
+            start = best;
+          }
+        bfs (start, perm);
+      }
+    std::reverse (perm.begin(), perm.end());
+    return perm;
+  }
+
+  // Morton (Z-order) curve through the bounding box of the positions
+  std::vector<size_t> MortonOrder () const
+  {
+    size_t n = masses.size();
+    if (n == 0) return { };
+    Vec<D> lo = masses[0].pos, hi = masses[0].pos;
+    for (auto & m : masses)
+      for (int k = 0; k < D; k++)
+        {
+          lo(k) = std::min(lo(k), m.pos(k));
+          hi(k) = std::max(hi(k), m.pos(k));
+        }
+    const int bits = 63 / D;
+    std::vector<uint64_t> code(n, 0);
+    for (size_t i = 0; i < n; i++)
+      for (int k = 0; k < D; k++)
+        {
+          double rel = (hi(k) > lo(k)) ? (masses[i].pos(k)-lo(k)) / (hi(k)-lo(k)) : 0;
+          uint64_t q = uint64_t(rel * double((uint64_t(1) << bits) - 1));
+          for (int b = 0; b < bits; b++)
+            code[i] |= ((q >> b) & 1) << (D*b+k);
+        }
+    std::vector<size_t> perm(n);
+    std::iota (perm.begin(), perm.end(), 0);
+    std::stable_sort (perm.begin(), perm.end(), [&](size_t a, size_t b) { return code[a] < code[b]; });
+    return perm;
+  }
+
+  void Activate (size_t nr)
+  {
+    activepos[nr] = active.size();
+    active.push_back (nr);
+    auto [c1,c2] = springs[nr].connections;
+    if (c1.type == Connector::MASS && c2.type == Connector::MASS)
+      {
+        Couple (c1.nr, c2.nr, 1);
+        Couple (c2.nr, c1.nr, 1);
+      }
+  }
+  
 public:
   void SetGravity (Vec<D> _gravity) { gravity = _gravity; }
   Vec<D> Gravity() const { return gravity; }
+
+  // optional penalty contact with obstacles and between masses
+  void SetContact (std::shared_ptr<ContactModel<D>> _contact) { contact = _contact; }
+  const std::shared_ptr<ContactModel<D>> & Contact() const { return contact; }
   
   Connector AddFix (Fix<D> p)
   {
@@ -74,21 +252,149 @@ public:
   Connector AddMass (Mass<D> m)
   {
     masses.push_back (m);
+    coupling.emplace_back();
+    order.push_back (masses.size()-1);
+    rowof.push_back (masses.size()-1);
     return { Connector::MASS, masses.size()-1 };
   }
   
   size_t AddSpring (Spring s) // double length, double stiffness, Connector c1, Connector c2)
   {
     springs.push_back (s); // Spring{length, stiffness, { c1, c2 } });
+    activepos.push_back (-1);
+    if (!s.broken) Activate (springs.size()-1);
+    topologyversion++;
     return springs.size()-1;
   }
 
+  size_t AddBendingSpring (BendingSpring b)
+  {
+    bendings.push_back (b);
+    topologyversion++;
+    return bendings.size()-1;
+  }
+
+  bool HasDamping () const
+  {
+    for (size_t nr : active)
+      if (springs[nr].damping != 0) return true;
+    return false;
+  }
+  
+  // removes the spring from the active list, O(1) plus the degree of its masses
+  void BreakSpring (size_t nr)
+  {
+    Spring & s = springs[nr];
+    if (s.broken) return;
+    s.broken = true;
+
+    size_t pos = activepos[nr];
+    active[pos] = active.back();
+    activepos[active[pos]] = pos;
+    active.pop_back();
+    activepos[nr] = -1;
+    
+    auto [c1,c2] = s.connections;
+    if (c1.type == Connector::MASS && c2.type == Connector::MASS)
+      {
+        Couple (c1.nr, c2.nr, -1);
+        Couple (c2.nr, c1.nr, -1);
+      }
+    topologyversion++;
+  }
+
+  // breaks all springs stretched beyond their break strain at positions x,
+  // returns the number of broken springs
+  size_t CheckBreakage (VectorView<> x)
+  {
+    auto xmat = x.AsMatrix(masses.size(), D);
+    size_t nbroken = 0;
+    for (size_t k = active.size(); k-- > 0; )
+      {
+        const Spring & s = springs[active[k]];
+        if (s.breakstrain <= 0) continue;
+        auto [c1,c2] = s.connections;
+        Vec<D> p1 = (c1.type == Connector::FIX) ? fixes[c1.nr].pos : Vec<D>(xmat.Row(rowof[c1.nr]));
+        Vec<D> p2 = (c2.type == Connector::FIX) ? fixes[c2.nr].pos : Vec<D>(xmat.Row(rowof[c2.nr]));
+        if (L2Norm(p1-p2) > (1+s.breakstrain)*s.length)
+          {
+            BreakSpring (active[k]);
+            nbroken++;
+          }
+      }
+    return nbroken;
+  }
+
+  // rebuilds the topology after direct modifications of Masses() or Springs()
+  void UpdateTopology ()
+  {
+    active.clear();
+    activepos.assign (springs.size(), -1);
+    coupling.assign (masses.size(), { });
+    for (size_t i = 0; i < springs.size(); i++)
+      if (!springs[i].broken) Activate (i);
+    if (order.size() != masses.size())
+      SetStateOrder ({ });
+    topologyversion++;
+  }
+
+  // renumbers the rows of the masses in state vectors, for local memory
+  // access in the force loops and a small Jacobian bandwidth. States taken
+  // before are invalid, Connectors remain valid.
+  void Renumber (MSS_ORDERING ordering = ORDER_RCM)
+  {
+    switch (ordering)
+      {
+      case ORDER_INSERTION: SetStateOrder ({ }); break;
+      case ORDER_RCM: SetStateOrder (RCMOrder()); break;
+      case ORDER_MORTON: SetStateOrder (MortonOrder()); break;
+      }
+  }
+
+  // row k of state vectors holds mass _order[k], empty for insertion order
+  void SetStateOrder (std::vector<size_t> _order)
+  {
+    if (_order.empty())
+      {
+        _order.resize (masses.size());
+        std::iota (_order.begin(), _order.end(), 0);
+      }
+    if (_order.size() != masses.size())
+      throw std::invalid_argument("state order needs one entry per mass");
+    rowof.assign (masses.size(), size_t(-1));
+    for (size_t k = 0; k < _order.size(); k++)
+      {
+        if (_order[k] >= masses.size() || rowof[_order[k]] != size_t(-1))
+          throw std::invalid_argument("state order is no permutation");
+        rowof[_order[k]] = k;
+      }
+    order = std::move(_order);
+    topologyversion++;
+  }
 
+  const std::vector<size_t> & StateOrder() const { return order; }
+  // row of a mass in state vectors
+  size_t StateRow (size_t mass) const { return rowof[mass]; }
 
+  // largest distance of coupled masses in state rows, the half bandwidth
+  // of the Jacobian in blocks
+  size_t Bandwidth () const
+  {
+    size_t bw = 0;
+    auto nb = Neighbours();
+    for (size_t i = 0; i < nb.size(); i++)
+      for (size_t j : nb[i])
+        bw = std::max(bw, rowof[i] > rowof[j] ? rowof[i]-rowof[j] : rowof[j]-rowof[i]);
+    return bw;
+  }
   
   auto & Fixes() { return fixes; } 
   auto & Masses() { return masses; } 
   auto & Springs() { return springs; }
+  auto & BendingSprings() { return bendings; }
+  const std::vector<size_t> & ActiveSprings() const { return active; }
+  const auto & Coupling (size_t mass) const { return coupling[mass]; }
+  size_t TopologyVersion() const { return topologyversion; }
 
   void GetState (VectorView<> values, VectorView<> dvalues, VectorView<> ddvalues)
   {
@@ -98,9 +404,9 @@ public:
 
     for (size_t i = 0; i < Masses().size(); i++)
       {
-        valmat.Row(i) = Masses()[i].pos;
-        dvalmat.Row(i) = Masses()[i].vel;
-        ddvalmat.Row(i) = Masses()[i].acc;
+        valmat.Row(rowof[i]) = Masses()[i].pos;
+        dvalmat.Row(rowof[i]) = Masses()[i].vel;
+        ddvalmat.Row(rowof[i]) = Masses()[i].acc;
       }
   }
   
@@ -112,9 +418,9 @@ public:
 
     for (size_t i = 0; i < Masses().size(); i++)
       {
-        Masses()[i].pos = valmat.Row(i);
-        Masses()[i].vel = dvalmat.Row(i);
-        Masses()[i].acc = ddvalmat.Row(i);        
+        Masses()[i].pos = valmat.Row(rowof[i]);
+        Masses()[i].vel = dvalmat.Row(rowof[i]);
+        Masses()[i].acc = ddvalmat.Row(rowof[i]);        
       }
   }
 };
@@ -139,69 +445,594 @@ std::ostream & operator<< (std::ostream & ost, MassSpringSystem<D> & mss)
 }
 
 
+// The forces of the active springs, split into homogeneous batches of
+// flat arrays. Point indices refer to [masses in state order, fixes], such
+// that the inner loops need no branches on the connector types. Springs are
+// sorted by their first point, which walks through the state in order.
 template <int D>
-class MSS_Function : public NonlinearFunction
+class ForceBatches
+{
+public:
+  size_t version = size_t(-1);
+
+  // elastic springs, k e + k3 e^3 along the spring, snr the spring numbers
+  std::vector<size_t> si1, si2, snr;
+  std::vector<double> slength, sstiffness, sstiffness3;
+
+  // dashpots, the subset of springs with damping
+  std::vector<size_t> di1, di2;
+  std::vector<double> ddamping;
+
+  // bending springs
+  std::vector<size_t> bi1, bi2, bi3;
+  std::vector<double> bstiffness;
+
+  void Build (MassSpringSystem<D> & mss)
+  {
+    size_t nmass = mss.Masses().size();
+    auto point = [&mss,nmass](Connector c) { return c.type == Connector::MASS ? mss.StateRow(c.nr) : nmass + c.nr; };
+    
+    si1.clear(); si2.clear(); snr.clear(); slength.clear(); sstiffness.clear(); sstiffness3.clear();
+    di1.clear(); di2.clear(); ddamping.clear();
+    bi1.clear(); bi2.clear(); bi3.clear(); bstiffness.clear();
+
+    // the forces are symmetric in the two points, the smaller one goes first
+    struct Entry { size_t p1, p2, nr; };
+    std::vector<Entry> entries;
+    for (size_t nr : mss.ActiveSprings())
+      {
+        const Spring & s = mss.Springs()[nr];
+        size_t p1 = point(s.connections[0]), p2 = point(s.connections[1]);
+        entries.push_back ({ std::min(p1,p2), std::max(p1,p2), nr });
+      }
+    std::sort (entries.begin(), entries.end(), [](const Entry & a, const Entry & b)
+               { return a.p1 < b.p1 || (a.p1 == b.p1 && a.p2 < b.p2); });
+    
+    for (auto & e : entries)
+      {
+        const Spring & s = mss.Springs()[e.nr];
+        si1.push_back (e.p1);
+        si2.push_back (e.p2);
+        snr.push_back (e.nr);
+        slength.push_back (s.length);
+        sstiffness.push_back (s.stiffness);
+        sstiffness3.push_back (s.stiffness3);
+        if (s.damping != 0)
+          {
+            di1.push_back (e.p1);
+            di2.push_back (e.p2);
+            ddamping.push_back (s.damping);
+          }
+      }
+
+    std::vector<size_t> bend(mss.BendingSprings().size());
+    std::iota (bend.begin(), bend.end(), 0);
+    auto middle = [&](size_t nr) { return point(mss.BendingSprings()[nr].connections[1]); };
+    std::sort (bend.begin(), bend.end(), [&](size_t a, size_t b) { return middle(a) < middle(b); });
+    for (size_t nr : bend)
+      {
+        auto & b = mss.BendingSprings()[nr];
+        bi1.push_back (point(b.connections[0]));
+        bi2.push_back (point(b.connections[1]));
+        bi3.push_back (point(b.connections[2]));
+        bstiffness.push_back (b.stiffness);
+      }
+    version = mss.TopologyVersion();
+  }
+};
+
+
+// forces g(l)/l (p2-p1), g = k e + k3 e^3, of n springs on their first
+// points, into f[D*s ... D*s+D-1]. The points p are gathered by index, the
+// scatter into the masses is left to the caller, such that the loop has no
+// write conflicts and vectorizes.
+template <int D>
+NEO_ODE_INLINE void SpringForceBody (std::integral_constant<int,D>, size_t n,
+                                     const size_t * i1, const size_t * i2, const double * length,
+                                     const double * k, const double * k3,
+                                     const double * __restrict p, double * __restrict f)
+{
+  for (size_t s = 0; s < n; s++)
+    {
+      const double * p1 = p + D*i1[s];
+      const double * p2 = p + D*i2[s];
+      double d[D], l2 = 0;
+      for (int j = 0; j < D; j++)
+        {
+          d[j] = p2[j]-p1[j];
+          l2 += d[j]*d[j];
+        }
+      double l = std::sqrt(l2);
+      double e = l - length[s];
+      double g = (k[s] + k3[s]*e*e) * e / l;
+      for (int j = 0; j < D; j++)
+        f[D*s+j] = g*d[j];
+    }
+}
+
+NEO_ODE_MULTIVERSION (SpringForce, SpringForceBody)
+
+
+// acceleration of the masses, a function of the positions x, or of
+// (x, v) if the springs are damped. Its parameters are the stiffnesses of
+// all springs followed by all masses, in insertion order.
+template <int D>
+class MSS_Function : public ParametricFunction
 {
   MassSpringSystem<D> & mss;
+  bool withvelocity;
+  mutable ForceBatches<D> batches;
+  mutable std::mutex batchlock;   // a task graph may evaluate concurrently
+
+  const ForceBatches<D> & Batches() const
+  {
+    std::lock_guard<std::mutex> guard(batchlock);
+    if (batches.version != mss.TopologyVersion())
+      batches.Build (mss);
+    return batches;
+  }
+
+  // scratch arrays per thread, such that evaluation does not allocate and
+  // concurrent evaluations in a task graph do not share them. They keep
+  // the capacity of the largest system evaluated by the thread.
+  struct Scratch
+  {
+    std::vector<double> p, v, fp, sf;   // Evaluate and EvaluateDeriv
+    std::vector<double> xv, f;          // Energy
+  };
+  static Scratch & Workspace()
+  {
+    static thread_local Scratch scratch;
+    return scratch;
+  }
+
+  // positions (or velocities) of masses and fixes as one flat array
+  void GatherPoints (VectorView<double> x, std::vector<double> & p, bool fixvalues) const
+  {
+    size_t nmass = mss.Masses().size();
+    p.resize (D*(nmass+mss.Fixes().size()));
+    for (size_t i = 0; i < D*nmass; i++)
+      p[i] = x(i);
+    for (size_t i = 0; i < mss.Fixes().size(); i++)
+      for (int k = 0; k < D; k++)
+        p[D*(nmass+i)+k] = fixvalues ? mss.Fixes()[i].pos(k) : 0.0;
+  }
+  
 public:
+  MSS_Function (MassSpringSystem<D> & _mss, bool _withvelocity)
+    : mss(_mss), withvelocity(_withvelocity) { }
   MSS_Function (MassSpringSystem<D> & _mss)
-    : mss(_mss) { }
+    : MSS_Function(_mss, _mss.HasDamping()) { }
 
-  virtual size_t DimX() const { return D*mss.Masses().size(); }
+  virtual size_t DimX() const { return (withvelocity ? 2 : 1) * D*mss.Masses().size(); }
   virtual size_t DimF() const { return D*mss.Masses().size(); }
   
   virtual void Evaluate (VectorView<double> x, VectorView<double> f) const
   {
-    f = 0.0;
-    
-    auto xmat = x.AsMatrix(mss.Masses().size(), D);
-    auto fmat = f.AsMatrix(mss.Masses().size(), D);
-    
-    for (size_t i = 0; i < mss.Masses().size(); i++)
-      fmat.Row(i) = mss.Masses()[i].mass*mss.Gravity();
+    size_t nmass = mss.Masses().size();
+    size_t n = D*nmass;
+    const ForceBatches<D> & b = Batches();
+    auto & order = mss.StateOrder();
     
-    for (auto spring : mss.Springs())
-      {
-        auto [c1,c2] = spring.connections;
-        Vec<D> p1, p2;
-        if (c1.type == Connector::FIX)
-          p1 = mss.Fixes()[c1.nr].pos;
-        else
-          p1 = xmat.Row(c1.nr);
-        if (c2.type == Connector::FIX)
-          p2 = mss.Fixes()[c2.nr].pos;
-        else
-          p2 = xmat.Row(c2.nr);
-
-        double force = spring.stiffness * (L2Norm(p1-p2)-spring.length);
-        Vec<D> dir12 = 1.0/L2Norm(p1-p2) * (p2-p1);
-        if (c1.type == Connector::MASS)
-          fmat.Row(c1.nr) += force*dir12;
-        if (c2.type == Connector::MASS)
-          fmat.Row(c2.nr) -= force*dir12;
-      }
-
-    for (size_t i = 0; i < mss.Masses().size(); i++)
-      fmat.Row(i) /= mss.Masses()[i].mass;
+    Scratch & w = Workspace();
+    std::vector<double> & p = w.p, & v = w.v, & fp = w.fp, & sf = w.sf;
+    fp.assign (D*(nmass+mss.Fixes().size()), 0.0);
+    GatherPoints (x.Range(0, n), p, true);
+
+    size_t nsprings = b.si1.size();
+    sf.resize (D*nsprings);
+    SpringForce (std::integral_constant<int,D>(), nsprings, b.si1.data(), b.si2.data(),
+                 b.slength.data(), b.sstiffness.data(), b.sstiffness3.data(), p.data(), sf.data());
+    for (size_t s = 0; s < nsprings; s++)
+      for (int k = 0; k < D; k++)
+        {
+          fp[D*b.si1[s]+k] += sf[D*s+k];
+          fp[D*b.si2[s]+k] -= sf[D*s+k];
+        }
+
+    if (withvelocity)
+      {
+        GatherPoints (x.Range(n, 2*n), v, false);
+        for (size_t s = 0; s < b.di1.size(); s++)
+          {
+            const double * p1 = &p[D*b.di1[s]];
+            const double * p2 = &p[D*b.di2[s]];
+            const double * v1 = &v[D*b.di1[s]];
+            const double * v2 = &v[D*b.di2[s]];
+            double d[D], l2 = 0, dvd = 0;
+            for (int k = 0; k < D; k++)
+              {
+                d[k] = p2[k]-p1[k];
+                l2 += d[k]*d[k];
+                dvd += (v2[k]-v1[k])*d[k];
+              }
+            double force = b.ddamping[s] * dvd / l2;
+            for (int k = 0; k < D; k++)
+              {
+                fp[D*b.di1[s]+k] += force*d[k];
+                fp[D*b.di2[s]+k] -= force*d[k];
+              }
+          }
+      }
+
+    for (size_t s = 0; s < b.bi1.size(); s++)
+      for (int k = 0; k < D; k++)
+        {
+          double kb = b.bstiffness[s] * (p[D*b.bi1[s]+k] - 2*p[D*b.bi2[s]+k] + p[D*b.bi3[s]+k]);
+          fp[D*b.bi1[s]+k] -= kb;
+          fp[D*b.bi2[s]+k] += 2*kb;
+          fp[D*b.bi3[s]+k] -= kb;
+        }
+
+    auto xmat = x.Range(0, n).AsMatrix(nmass, D);
+    auto fmat = f.AsMatrix(nmass, D);
+    for (size_t i = 0; i < nmass; i++)
+      for (int k = 0; k < D; k++)
+        fmat(i,k) = mss.Masses()[order[i]].mass*mss.Gravity()(k) + fp[D*i+k];
+
+    if (mss.Contact())
+      mss.Contact()->AddForces (xmat, fmat);
+
+    for (size_t i = 0; i < nmass; i++)
+      fmat.Row(i) /= mss.Masses()[order[i]].mass;
   }
-  
+
+  // exact derivative. The spring force g(l) n, g = k e + k3 e^3, has the
+  // derivative g' n n^T + g/l (I - n n^T) with respect to p2, the dashpot
+  // force c (dv.n) n the derivatives c/l (n dv^T + (dv.n) I) (I - n n^T)
+  // and c n n^T with respect to p2 and v2.
   virtual void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const
   {
-    // TODO: exact differentiation
-    double eps = 1e-8;
-    Vector<> xl(DimX()), xr(DimX()), fl(DimF()), fr(DimF());
-    for (size_t i = 0; i < DimX(); i++)
+    df = 0.0;
+    size_t nmass = mss.Masses().size();
+    size_t n = D*nmass;
+    auto & order = mss.StateOrder();
+
+    // without velocity, dfdv is not used
+    AddForceDeriv (x, df.Cols(0, n), df.Cols(withvelocity ? n : 0, withvelocity ? 2*n : n));
+
+    for (size_t i = 0; i < nmass; i++)
+      for (int j = 0; j < D; j++)
+        df.Row(D*i+j) *= 1.0/mss.Masses()[order[i]].mass;
+  }
+
+  // adds the derivatives dF/dx and dF/dv of the forces, the accelerations
+  // times the masses, to matrices with operator()(i,j). Only the entries of
+  // springs and contacts are visited, such that matrices holding just the
+  // band, of half width D*(Bandwidth()+1)-1 without contact, can be assembled
+  // in linear time.
+  template <typename TX, typename TV>
+  void AddForceDeriv (VectorView<double> x, TX && dfdx, TV && dfdv) const
+  {
+    size_t nmass = mss.Masses().size();
+    size_t n = D*nmass;
+    const ForceBatches<D> & b = Batches();
+
+    std::vector<double> & p = Workspace().p, & v = Workspace().v;
+    GatherPoints (x.Range(0, n), p, true);
+    if (withvelocity)
+      GatherPoints (x.Range(n, 2*n), v, false);
+
+    // adds -K to the blocks (i1,i1), (i2,i2) and K to (i1,i2), (i2,i1),
+    // rows and columns of fixes are skipped
+    auto addblocks = [nmass](auto & df, size_t i1, size_t i2, const double (&K)[D][D])
+    {
+      size_t ind[2] = { i1, i2 };
+      for (int a = 0; a < 2; a++)
+        for (int c = 0; c < 2; c++)
+          if (ind[a] < nmass && ind[c] < nmass)
+            for (int k = 0; k < D; k++)
+              for (int l = 0; l < D; l++)
+                df(D*ind[a]+k, D*ind[c]+l) += (a == c ? -1 : 1) * K[k][l];
+    };
+
+    double K[D][D];
+    for (size_t s = 0; s < b.si1.size(); s++)
+      {
+        double d[D], l2 = 0;
+        for (int k = 0; k < D; k++)
+          {
+            d[k] = p[D*b.si2[s]+k]-p[D*b.si1[s]+k];
+            l2 += d[k]*d[k];
+          }
+        double l = std::sqrt(l2);
+        double e = l - b.slength[s];
+        double g = b.sstiffness[s]*e + b.sstiffness3[s]*e*e*e;
+        double dg = b.sstiffness[s] + 3*b.sstiffness3[s]*e*e;
+        for (int k = 0; k < D; k++)
+          for (int j = 0; j < D; j++)
+            K[k][j] = (dg - g/l) * d[k]*d[j]/l2 + (k == j ? g/l : 0);
+        addblocks (dfdx, b.si1[s], b.si2[s], K);
+      }
+
+    if (withvelocity)
+      for (size_t s = 0; s < b.di1.size(); s++)
+        {
+          double nv[D], dv[D], l2 = 0, dvn = 0;
+          for (int k = 0; k < D; k++)
+            {
+              nv[k] = p[D*b.di2[s]+k]-p[D*b.di1[s]+k];
+              dv[k] = v[D*b.di2[s]+k]-v[D*b.di1[s]+k];
+              l2 += nv[k]*nv[k];
+            }
+          double l = std::sqrt(l2);
+          for (int k = 0; k < D; k++)
+            {
+              nv[k] /= l;
+              dvn += dv[k]*nv[k];
+            }
+          double c = b.ddamping[s];
+
+          double dvp[D];    // dv^T (I - n n^T)
+          for (int j = 0; j < D; j++)
+            dvp[j] = dv[j] - dvn*nv[j];
+          for (int k = 0; k < D; k++)
+            for (int j = 0; j < D; j++)
+              K[k][j] = c/l * (nv[k]*dvp[j] + dvn * ((k == j ? 1 : 0) - nv[k]*nv[j]));
+          addblocks (dfdx, b.di1[s], b.di2[s], K);
+
+          for (int k = 0; k < D; k++)
+            for (int j = 0; j < D; j++)
+              K[k][j] = c * nv[k]*nv[j];
+          addblocks (dfdv, b.di1[s], b.di2[s], K);
+        }
+
+    for (size_t s = 0; s < b.bi1.size(); s++)
+      {
+        size_t ind[3] = { b.bi1[s], b.bi2[s], b.bi3[s] };
+        double w[3] = { 1, -2, 1 };
+        for (int a = 0; a < 3; a++)
+          for (int c = 0; c < 3; c++)
+            if (ind[a] < nmass && ind[c] < nmass)
+              for (int k = 0; k < D; k++)
+                dfdx(D*ind[a]+k, D*ind[c]+k) -= b.bstiffness[s] * w[a]*w[c];
+      }
+
+    if (mss.Contact())
+      mss.Contact()->AddJacobian (x.Range(0, n).AsMatrix(nmass, D), dfdx);
+  }
+
+  // potential energy at positions x: springs k/2 e^2 + k3/4 e^4, bending
+  // springs, gravity and contact. Its gradient, the negative force, is
+  // written into grad.
+  double Energy (VectorView<double> x, VectorView<double> grad) const
+  {
+    size_t nmass = mss.Masses().size();
+    size_t n = D*nmass;
+    const ForceBatches<D> & b = Batches();
+    auto & order = mss.StateOrder();
+
+    Scratch & w = Workspace();
+    std::vector<double> & p = w.p;
+    GatherPoints (x.Range(0, n), p, true);
+    double energy = 0;
+    for (size_t s = 0; s < b.si1.size(); s++)
+      {
+        double l2 = 0;
+        for (int k = 0; k < D; k++)
+          {
+            double d = p[D*b.si2[s]+k]-p[D*b.si1[s]+k];
+            l2 += d*d;
+          }
+        double e = std::sqrt(l2) - b.slength[s];
+        energy += b.sstiffness[s]/2 * e*e + b.sstiffness3[s]/4 * e*e*e*e;
+      }
+    for (size_t s = 0; s < b.bi1.size(); s++)
+      for (int k = 0; k < D; k++)
+        {
+          double c = p[D*b.bi1[s]+k] - 2*p[D*b.bi2[s]+k] + p[D*b.bi3[s]+k];
+          energy += b.bstiffness[s]/2 * c*c;
+        }
+    for (size_t i = 0; i < nmass; i++)
+      for (int k = 0; k < D; k++)
+        energy -= mss.Masses()[order[i]].mass * mss.Gravity()(k) * x(D*i+k);
+    if (mss.Contact())
+      energy += mss.Contact()->Energy (x.Range(0, n).AsMatrix(nmass, D));
+
+    // the force, Evaluate reuses the arrays above
+    w.f.resize (n);
+    VectorView<double> f(n, w.f.data());
+    if (withvelocity)
+      {
+        w.xv.assign (2*n, 0.0);
+        VectorView<double> xv(2*n, w.xv.data());
+        xv.Range(0, n) = x.Range(0, n);
+        Evaluate (xv, f);
+      }
+    else
+      Evaluate (x.Range(0, n), f);
+    for (size_t i = 0; i < nmass; i++)
+      for (int k = 0; k < D; k++)
+        grad(D*i+k) = -mss.Masses()[order[i]].mass * f(D*i+k);
+    return energy;
+  }
+
+  virtual size_t NumParameters() const
+  {
+    return mss.Springs().size() + mss.Masses().size();
+  }
+
+  // the force of spring s is linear in its stiffness k, with derivative
+  // e/l d. The acceleration F/m - g of mass i has the derivative
+  // -(F/m - g)/m with respect to m.
+  virtual void EvaluateParameterDeriv (VectorView<double> x, MatrixView<double> dfdp) const
+  {
+    dfdp = 0.0;
+    size_t nmass = mss.Masses().size();
+    size_t nspring = mss.Springs().size();
+    size_t n = D*nmass;
+    const ForceBatches<D> & b = Batches();
+    auto & order = mss.StateOrder();
+
+    std::vector<double> p;
+    GatherPoints (x.Range(0, n), p, true);
+    for (size_t s = 0; s < b.si1.size(); s++)
       {
-        xl = x;
-        xl(i) -= eps;
-        xr = x;
-        xr(i) += eps;
-        Evaluate (xl, fl);
-        Evaluate (xr, fr);
-        df.Col(i) = 1/(2*eps) * (fr-fl);
+        double d[D], l2 = 0;
+        for (int k = 0; k < D; k++)
+          {
+            d[k] = p[D*b.si2[s]+k]-p[D*b.si1[s]+k];
+            l2 += d[k]*d[k];
+          }
+        double l = std::sqrt(l2);
+        double el = (l - b.slength[s]) / l;
+        for (int k = 0; k < D; k++)
+          {
+            if (b.si1[s] < nmass)
+              dfdp(D*b.si1[s]+k, b.snr[s]) += el*d[k] / mss.Masses()[order[b.si1[s]]].mass;
+            if (b.si2[s] < nmass)
+              dfdp(D*b.si2[s]+k, b.snr[s]) -= el*d[k] / mss.Masses()[order[b.si2[s]]].mass;
+          }
+      }
+
+    Vector<> f(n);
+    Evaluate (x, f);
+    for (size_t i = 0; i < nmass; i++)
+      {
+        double m = mss.Masses()[order[i]].mass;
+        for (int k = 0; k < D; k++)
+          dfdp(D*i+k, nspring+order[i]) = -(f(D*i+k) - mss.Gravity()(k)) / m;
       }
   }
   
 };
 
+
+
+// first order form y = (x, v), y' = (v, a(x, v)) of a mass-spring system,
+// restricted to the components 'indices' of y, e.g. the fast or the slow
+// group of a multirate partition. The derivative visits only the springs,
+// its rows of other components are skipped.
+template <int D>
+class MSS_FirstOrderFunction : public NonlinearFunction
+{
+  MassSpringSystem<D> & mss;
+  MSS_Function<D> func;
+  bool withvelocity;
+  std::vector<size_t> indices;
+  std::vector<long> rowof;     // row of component i of y, -1 if not selected
+
+  // the selected rows of dF/dx or dF/dv, as a matrix for AddForceDeriv
+  struct SelectedRows
+  {
+    MatrixView<double> df;
+    const long * rowof;
+    size_t coloffset;
+    double dummy = 0;
+    double & operator() (size_t i, size_t j)
+    {
+      return rowof[i] < 0 ? dummy : df(rowof[i], coloffset+j);
+    }
+  };
+
+public:
+  MSS_FirstOrderFunction (MassSpringSystem<D> & _mss, std::vector<size_t> _indices)
+    : mss(_mss), func(_mss), withvelocity(_mss.HasDamping()), indices(_indices),
+      rowof(2*D*_mss.Masses().size(), -1)
+  {
+    for (size_t i = 0; i < indices.size(); i++)
+      {
+        if (indices[i] >= rowof.size())
+          throw std::invalid_argument("component index out of range");
+        rowof[indices[i]] = i;
+      }
+  }
+
+  // all components
+  MSS_FirstOrderFunction (MassSpringSystem<D> & _mss)
+    : MSS_FirstOrderFunction(_mss, [&_mss]()
+      {
+        std::vector<size_t> all(2*D*_mss.Masses().size());
+        std::iota (all.begin(), all.end(), 0);
+        return all;
+      }()) { }
+
+  size_t DimX() const override { return 2*D*mss.Masses().size(); }
+  size_t DimF() const override { return indices.size(); }
+
+  void Evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    size_t n = D*mss.Masses().size();
+    Vector<> a(n);
+    func.Evaluate (withvelocity ? y : y.Range(0, n), a);
+    for (size_t i = 0; i < indices.size(); i++)
+      f(i) = indices[i] < n ? y(n+indices[i]) : a(indices[i]-n);
+  }
+
+  void EvaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    df = 0.0;
+    size_t n = D*mss.Masses().size();
+    for (size_t i = 0; i < indices.size(); i++)
+      if (indices[i] < n)
+        df(i, n+indices[i]) = 1;
+
+    // the acceleration rows are those of the velocities, scaled by 1/m
+    func.AddForceDeriv (withvelocity ? y : y.Range(0, n),
+                        SelectedRows { df, rowof.data()+n, 0 },
+                        SelectedRows { df, rowof.data()+n, n });
+    auto & order = mss.StateOrder();
+    for (size_t i = 0; i < indices.size(); i++)
+      if (indices[i] >= n)
+        df.Row(i) *= 1.0/mss.Masses()[order[(indices[i]-n)/D]].mass;
+  }
+};
+
+
+// steppable simulation of a mass-spring system with the generalized-alpha
+// method. The integrator, with its residual trees and Newton workspace,
+// lives as long as the simulator; the state is written back to the masses.
+template <int D>
+class MSS_Simulator
+{
+  MassSpringSystem<D> & mss;
+  shared_ptr<MSS_Function<D>> rhs;
+  AlphaIntegrator integrator;
+public:
+  MSS_Simulator (MassSpringSystem<D> & _mss, double dt, double rhoinf = 0.8)
+    : mss(_mss), rhs(make_shared<MSS_Function<D>>(_mss)),
+      integrator(rhs,
+                 make_shared<IdentityFunction>(D*_mss.Masses().size()), dt, rhoinf)
+  {
+    Vector<> x(D*mss.Masses().size());
+    Vector<> dx(D*mss.Masses().size());
+    Vector<> ddx(D*mss.Masses().size());
+    mss.GetState (x, dx, ddx);
+    integrator.SetState (0, x, dx, ddx);
+  }
+
+  AlphaIntegrator & Integrator() { return integrator; }
+  MassSpringSystem<D> & System() { return mss; }
+  double Time() const { return integrator.Time(); }
+
+  // one step, then springs stretched beyond their break strain are
+  // removed. The integration continues from the same positions and
+  // velocities, with the acceleration of the new topology.
+  void Step (double h)
+  {
+    integrator.Step (h);
+    if (mss.CheckBreakage (integrator.X()))
+      {
+        Vector<> a(integrator.A().Size());
+        integrator.EvaluateRhs (integrator.X(), integrator.V(), a);
+        integrator.SetState (integrator.Time(), integrator.X(), integrator.V(), a);
+        integrator.InvalidateJacobian();
+      }
+    mss.SetState (integrator.X(), integrator.V(), integrator.A());
+  }
+
+  void Step () { Step (integrator.TimeStep()); }
+
+  void Advance (double tend)
+  {
+    double dt = integrator.TimeStep();
+    while (tend - integrator.Time() > 1e-10*dt)
+      {
+        double h = std::min(dt, tend-integrator.Time());
+        if (dt - h < 1e-8*dt) h = dt;
+        Step (h);
+      }
+  }
+};
+
 #endif
@@ -0,0 +1,337 @@
+#ifndef MODAL_H
+#define MODAL_H
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include <lanczos.h>
+
+#include "mass_spring.h"
+
+
+// Linear vibrations of a mass-spring system about positions x0 at rest,
+//   M u'' + C u' + K u = r,   u = x - x0,
+// with the lumped masses M, the stiffness K = -M da/dx and the damping
+// C = -M da/dv from the Jacobian of the accelerations a of MSS_Function,
+// and the residual force r = M a(x0), which is zero in equilibrium (see
+// SolveEquilibrium). K includes the geometric stiffness of prestressed
+// springs. The lowest modes K phi = lam M phi come from shift-invert Lanczos,
+// their natural frequencies are sqrt(lam) / 2pi. K and C are stored and
+// assembled in their band, the half bandwidth of the renumbered springs,
+// which keeps memory and time linear in the number of masses. Contact
+// couples any masses, then the band is the full matrix.
+class ModalAnalysis
+{
+  size_t n;
+  Vector<> x0, mass, residual;
+  BandMatrix<double> stiffness, damping;
+  bool withdamping;
+  Vector<> lam, modaldamping, modalforce;
+  Matrix<> modes;
+  size_t krylovdim = 0;
+
+  template <int D>
+  void Linearize (MassSpringSystem<D> & mss)
+  {
+    Vector<> v(n), a(n);
+    mss.GetState (x0, v, a);
+    for (size_t i = 0; i < mss.Masses().size(); i++)
+      for (int k = 0; k < D; k++)
+        mass(D*i+k) = mss.Masses()[mss.StateOrder()[i]].mass;
+
+    MSS_Function<D> func(mss, withdamping);
+    Vector<> xv(func.DimX());
+    xv = 0.0;
+    xv.Range(0, n) = x0;
+    func.Evaluate (xv, residual);
+    for (size_t i = 0; i < n; i++)
+      residual(i) *= mass(i);
+
+    // K = -dF/dx and C = -dF/dv of the forces F = M a, symmetrized such
+    // that the Lanczos vectors stay M-orthogonal
+    size_t bw = mss.Contact() ? n : D*(mss.Bandwidth()+1)-1;
+    stiffness = BandMatrix<double>(n, bw);
+    damping = BandMatrix<double>(withdamping ? n : 0, bw);
+    func.AddForceDeriv (xv, stiffness, damping);
+    for (auto mat : { &stiffness, &damping })
+      {
+        bw = mat->Bandwidth();
+        for (size_t i = 0; i < mat->height(); i++)
+          for (size_t j = (i > bw) ? i-bw : 0; j <= i; j++)
+            {
+              double s = -0.5 * ((*mat)(i,j) + (*mat)(j,i));
+              (*mat)(i,j) = s;
+              (*mat)(j,i) = s;
+            }
+      }
+  }
+
+  void Solve (LanczosParameters params)
+  {
+    size_t k = lam.Size();
+    size_t bw = stiffness.Bandwidth();
+    if (params.bandwidth < 0)
+      params.bandwidth = bw;
+    krylovdim = SolveGeneralizedEigen (stiffness, mass, k, lam, modes, params);
+
+    // modal damping phi_i^T C phi_i = 2 zeta_i omega_i, the coupling
+    // phi_i^T C phi_j of the modes is neglected, and modal loads phi_i^T r
+    for (size_t i = 0; i < k; i++)
+      {
+        auto phi = modes.Row(i);
+        double c = 0, f = 0;
+        if (withdamping)
+          for (size_t r = 0; r < n; r++)
+            {
+              double sum = 0;
+              for (size_t s = (r > bw) ? r-bw : 0; s < std::min(n, r+bw+1); s++)
+                sum += damping(r,s) * phi(s);
+              c += phi(r) * sum;
+            }
+        for (size_t r = 0; r < n; r++)
+          f += phi(r) * residual(r);
+        modaldamping(i) = c;
+        modalforce(i) = f;
+      }
+  }
+
+public:
+  // the k modes closest to params.shift, of the linearization about the
+  // current positions of the masses, in state order
+  template <int D>
+  ModalAnalysis (MassSpringSystem<D> & mss, size_t k, LanczosParameters params)
+    : n(D*mss.Masses().size()), x0(n), mass(n), residual(n),
+      withdamping(mss.HasDamping()), lam(k), modaldamping(k), modalforce(k), modes(k, n)
+  {
+    Linearize (mss);
+    Solve (params);
+  }
+
+  // the k lowest modes. The shift slightly below zero keeps free systems,
+  // with rigid body modes lam = 0, solvable.
+  template <int D>
+  ModalAnalysis (MassSpringSystem<D> & mss, size_t k)
+    : n(D*mss.Masses().size()), x0(n), mass(n), residual(n),
+      withdamping(mss.HasDamping()), lam(k), modaldamping(k), modalforce(k), modes(k, n)
+  {
+    Linearize (mss);
+    LanczosParameters params;
+    double maxratio = 0;
+    for (size_t i = 0; i < n; i++)
+      maxratio = std::max(maxratio, std::abs(stiffness(i,i)) / mass(i));
+    params.shift = -1e-6 * maxratio;
+    Solve (params);
+  }
+
+  size_t Dim() const { return n; }
+  size_t NumModes() const { return lam.Size(); }
+  size_t KrylovDim() const { return krylovdim; }
+
+  VectorView<double> X0() { return x0; }
+  VectorView<double> Mass() { return mass; }
+  const BandMatrix<double> & Stiffness() const { return stiffness; }
+  // eigenvalues lam = omega^2, ascending. Negative ones are unstable modes,
+  // e.g. of springs under compression.
+  VectorView<double> Eigenvalues() { return lam; }
+  // M-orthonormal mode shapes, one per row
+  MatrixView<double> Modes() { return modes; }
+  VectorView<double> ModalDamping() { return modaldamping; }
+  VectorView<double> ModalForce() { return modalforce; }
+
+  // natural frequency sqrt(lam) / 2pi of mode i, zero for rigid body and
+  // unstable modes
+  double Frequency (size_t i) const
+  {
+    return std::sqrt(std::max(lam(i), 0.0)) / (2*std::acos(-1.0));
+  }
+
+  // damping ratio zeta = c / (2 omega) of mode i
+  double DampingRatio (size_t i) const
+  {
+    double omega = std::sqrt(std::max(lam(i), 0.0));
+    return omega > 0 ? modaldamping(i) / (2*omega) : 0;
+  }
+};
+
+
+
+// exact propagator of the mode q'' + c q' + lam q = p over a step h:
+// (q, q') <- P (q, q') + p b
+inline void ModePropagator (double lam, double c, double h, double (&P)[2][2], double (&b)[2])
+{
+  if (std::abs(lam)*h*h >= 1e-3)
+    {
+      // e^{Ah} = e^{-ch/2} (cosh(sqrt(delta) h) I + sinh(sqrt(delta) h)/sqrt(delta) N)
+      // with A = [[0,1],[-lam,-c]], N = A + c/2 I and N^2 = delta I
+      double delta = c*c/4 - lam;
+      double x = delta*h*h;
+      double ec, es;
+      if (std::abs(x) < 1e-8)
+        {
+          double e = std::exp(-c*h/2);
+          ec = e * (1 + x/2);
+          es = e * h * (1 + x/6);
+        }
+      else if (delta < 0)
+        {
+          double e = std::exp(-c*h/2);
+          double wd = std::sqrt(-delta);
+          ec = e * std::cos(wd*h);
+          es = e * std::sin(wd*h) / wd;
+        }
+      else
+        {
+          // overdamped or unstable, sqrt(delta) - c/2 = -lam / (sqrt(delta) + c/2)
+          double kappa = std::sqrt(delta);
+          double ep = std::exp(-lam / (kappa + c/2) * h);
+          double em = std::exp((-kappa - c/2) * h);
+          ec = (ep + em) / 2;
+          es = (ep - em) / (2*kappa);
+        }
+      P[0][0] = ec + c/2 * es;
+      P[0][1] = es;
+      P[1][0] = -lam * es;
+      P[1][1] = ec - c/2 * es;
+      // particular solution p/lam
+      b[0] = (1 - P[0][0]) / lam;
+      b[1] = es;
+      return;
+    }
+
+  // nearly rigid modes: e^{Bh} of the augmented B = [[0,1,0],[-lam,-c,1],[0,0,0]]
+  // by scaling and squaring of the Taylor series, without division by lam
+  double norm = h * std::max(1.0, std::abs(lam) + std::abs(c) + 1);
+  int squarings = std::max(0, int(std::ceil(std::log2(norm))) + 1);
+  double hs = std::ldexp(h, -squarings);
+  double B[3][3] = { { 0, hs, 0 }, { -lam*hs, -c*hs, hs }, { 0, 0, 0 } };
+  double E[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+  double T[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+  for (int j = 1; j <= 18; j++)
+    {
+      double Tn[3][3] = { };
+      for (int r = 0; r < 3; r++)
+        for (int s = 0; s < 3; s++)
+          for (int l = 0; l < 3; l++)
+            Tn[r][s] += T[r][l] * B[l][s] / j;
+      for (int r = 0; r < 3; r++)
+        for (int s = 0; s < 3; s++)
+          {
+            T[r][s] = Tn[r][s];
+            E[r][s] += T[r][s];
+          }
+    }
+  for (int it = 0; it < squarings; it++)
+    {
+      double E2[3][3] = { };
+      for (int r = 0; r < 3; r++)
+        for (int s = 0; s < 3; s++)
+          for (int l = 0; l < 3; l++)
+            E2[r][s] += E[r][l] * E[l][s];
+      std::copy (&E2[0][0], &E2[0][0]+9, &E[0][0]);
+    }
+  P[0][0] = E[0][0];
+  P[0][1] = E[0][1];
+  P[1][0] = E[1][0];
+  P[1][1] = E[1][1];
+  b[0] = E[0][2];
+  b[1] = E[1][2];
+}
+
+
+// time stepping of the linearized dynamics in the basis of the modes,
+//   q_i'' + c_i q_i' + lam_i q_i = phi_i^T r,   x = x0 + sum_i q_i phi_i.
+// Every mode is advanced by its exact propagator, such that steps of any
+// size are stable and exact for the reduced system, at O(k n) per step for
+// the projection and the reconstruction of the state only. Components of
+// the initial state outside the span of the modes are dropped. The modal
+// analysis has to live as long as the integrator.
+class ModalIntegrator
+{
+  ModalAnalysis & modal;
+  Vector<> q, dq;
+  double t = 0;
+  double hprop = -1;
+  std::vector<double> prop;    // P and b of every mode, for the step hprop
+
+public:
+  ModalIntegrator (ModalAnalysis & _modal)
+    : modal(_modal), q(_modal.NumModes()), dq(_modal.NumModes())
+  {
+    q = 0.0;
+    dq = 0.0;
+  }
+
+  // modal coordinates q = Phi^T M (x - x0), q' = Phi^T M v
+  void SetState (double _t, VectorView<double> x, VectorView<double> v)
+  {
+    t = _t;
+    auto modes = modal.Modes();
+    auto x0 = modal.X0();
+    auto mass = modal.Mass();
+    for (size_t i = 0; i < q.Size(); i++)
+      {
+        double qi = 0, dqi = 0;
+        for (size_t r = 0; r < modal.Dim(); r++)
+          {
+            qi += modes(i,r) * mass(r) * (x(r) - x0(r));
+            dqi += modes(i,r) * mass(r) * v(r);
+          }
+        q(i) = qi;
+        dq(i) = dqi;
+      }
+  }
+
+  void Step (double h)
+  {
+    size_t k = q.Size();
+    if (h != hprop)
+      {
+        prop.resize (6*k);
+        for (size_t i = 0; i < k; i++)
+          {
+            double P[2][2], b[2];
+            ModePropagator (modal.Eigenvalues()(i), modal.ModalDamping()(i), h, P, b);
+            double * pi = &prop[6*i];
+            pi[0] = P[0][0]; pi[1] = P[0][1]; pi[2] = P[1][0]; pi[3] = P[1][1];
+            pi[4] = b[0]; pi[5] = b[1];
+          }
+        hprop = h;
+      }
+    auto force = modal.ModalForce();
+    for (size_t i = 0; i < k; i++)
+      {
+        const double * pi = &prop[6*i];
+        double qi = pi[0]*q(i) + pi[1]*dq(i) + pi[4]*force(i);
+        double dqi = pi[2]*q(i) + pi[3]*dq(i) + pi[5]*force(i);
+        q(i) = qi;
+        dq(i) = dqi;
+      }
+    t += h;
+  }
+
+  double Time() const { return t; }
+  VectorView<double> Q() { return q; }
+  VectorView<double> DQ() { return dq; }
+
+  // positions x0 + Phi^T q, velocities Phi^T q' and accelerations Phi^T q''
+  void GetState (VectorView<double> x, VectorView<double> v, VectorView<double> a) const
+  {
+    auto modes = modal.Modes();
+    x = modal.X0();
+    v = 0.0;
+    a = 0.0;
+    for (size_t i = 0; i < q.Size(); i++)
+      {
+        double ddq = modal.ModalForce()(i) - modal.ModalDamping()(i)*dq(i) - modal.Eigenvalues()(i)*q(i);
+        for (size_t r = 0; r < modal.Dim(); r++)
+          {
+            x(r) += q(i) * modes(i,r);
+            v(r) += dq(i) * modes(i,r);
+            a(r) += ddq * modes(i,r);
+          }
+      }
+  }
+};
+
+#endif
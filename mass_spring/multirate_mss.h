@@ -0,0 +1,116 @@
+#ifndef MULTIRATE_MSS_H
+#define MULTIRATE_MSS_H
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include <multirate.h>
+
+#include "mass_spring.h"
+
+
+// Multirate integration of mass-spring systems with stiff parts, e.g. a
+// chain with a few hard springs: the masses are split by their local
+// frequency omega_i^2 = K_ii / m_i, with K_ii the sum of the stiffnesses
+// of the attached springs and bending springs (the diagonal of the
+// linear stiffness matrix). Masses above the threshold form the fast
+// group, both their position and velocity components of y = (x, v).
+template <int D>
+void PartitionByFrequency (MassSpringSystem<D> & mss, double omega,
+                           std::vector<size_t> & fastindices, std::vector<size_t> & slowindices)
+{
+  size_t nmass = mss.Masses().size();
+  size_t n = D*nmass;
+  std::vector<double> kdiag(nmass, 0.0);
+  auto add = [&](Connector c, double k) { if (c.type == Connector::MASS) kdiag[c.nr] += k; };
+  for (size_t nr : mss.ActiveSprings())
+    for (auto c : mss.Springs()[nr].connections)
+      add (c, mss.Springs()[nr].stiffness);
+  for (auto & b : mss.BendingSprings())
+    {
+      add (b.connections[0], b.stiffness);
+      add (b.connections[1], 4*b.stiffness);
+      add (b.connections[2], b.stiffness);
+    }
+
+  fastindices.clear();
+  slowindices.clear();
+  for (size_t i = 0; i < nmass; i++)
+    {
+      auto & group = kdiag[i] > omega*omega*mss.Masses()[i].mass ? fastindices : slowindices;
+      for (int k = 0; k < D; k++)
+        group.push_back (D*mss.StateRow(i)+k);
+    }
+  size_t nfast = fastindices.size(), nslow = slowindices.size();
+  for (size_t i = 0; i < nfast; i++)
+    fastindices.push_back (n+fastindices[i]);
+  for (size_t i = 0; i < nslow; i++)
+    slowindices.push_back (n+slowindices[i]);
+  std::sort (fastindices.begin(), fastindices.end());
+  std::sort (slowindices.begin(), slowindices.end());
+
+  if (fastindices.empty() || slowindices.empty())
+    throw std::invalid_argument("frequency threshold leaves the fast or the slow group empty");
+}
+
+
+// steppable multirate simulation, see MultirateIntegrator: the fast group
+// of PartitionByFrequency is advanced in 'substeps' substeps of every macro
+// step. The state is written back to the masses.
+template <int D>
+class MSS_MultirateSimulator
+{
+  MassSpringSystem<D> & mss;
+  std::vector<size_t> fastindices, slowindices;
+  MSS_Function<D> func;
+  std::unique_ptr<MultirateIntegrator> integrator;
+
+  void WriteBack ()
+  {
+    size_t n = D*mss.Masses().size();
+    auto y = integrator->Y();
+    Vector<> a(n);
+    func.Evaluate (mss.HasDamping() ? y : y.Range(0, n), a);
+    mss.SetState (y.Range(0, n), y.Range(n, 2*n), a);
+  }
+
+public:
+  MSS_MultirateSimulator (MassSpringSystem<D> & _mss, double dt, double omega, int substeps,
+                          NewtonParameters params = NewtonParameters())
+    : mss(_mss), func(_mss)
+  {
+    PartitionByFrequency (mss, omega, fastindices, slowindices);
+    integrator = std::make_unique<MultirateIntegrator>
+      (make_shared<MSS_FirstOrderFunction<D>>(mss, fastindices), fastindices,
+       make_shared<MSS_FirstOrderFunction<D>>(mss, slowindices), slowindices,
+       dt, substeps, params);
+
+    size_t n = D*mss.Masses().size();
+    Vector<> y(2*n), a(n);
+    mss.GetState (y.Range(0, n), y.Range(n, 2*n), a);
+    integrator->SetState (0, y);
+  }
+
+  MultirateIntegrator & Integrator() { return *integrator; }
+  MassSpringSystem<D> & System() { return mss; }
+  const std::vector<size_t> & FastIndices() const { return fastindices; }
+  const std::vector<size_t> & SlowIndices() const { return slowindices; }
+  double Time() const { return integrator->Time(); }
+
+  void Step (double h)
+  {
+    integrator->Step (h);
+    WriteBack();
+  }
+
+  void Step () { Step (integrator->TimeStep()); }
+
+  void Advance (double tend)
+  {
+    integrator->Advance (tend);
+    WriteBack();
+  }
+};
+
+#endif
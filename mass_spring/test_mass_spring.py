@@ -31,3 +31,75 @@ mss.masses[0].mass = 5
 
 for m in mss.masses:
     print (m.mass, m.pos)
+
+
+# steppable simulation, keeps the integrator alive between calls
+sim = Simulator (mss, dt=0.01)
+for i in range(10):
+    sim.Advance (sim.time + 0.05)
+    print ("t = ", sim.time, "state = ", mss.GetState())
+print ("steps =", sim.statistics.steps, ", Newton its =", sim.statistics.newtonits)
+
+
+# checkpoint of the system and the integrator: a simulation restarted from
+# it continues exactly as the one which wrote it
+sim.Save ("mass_spring.ckpt")
+tend = sim.time + 0.1
+sim.Advance (tend)
+
+restarted = MassSpringSystem3d()
+restarted.Load ("mass_spring.ckpt")       # topology, gravity and state
+resim = Simulator (restarted, dt=sim.dt)
+resim.Load ("mass_spring.ckpt")           # time and integrator state
+resim.Advance (tend)
+x, y = mss.GetState(), restarted.GetState()
+assert resim.time == sim.time and all(x[i] == y[i] for i in range(len(x)))
+print ("continued and restarted runs agree at t =", resim.time)
+
+
+# contact with the floor z = -1
+mss.contact = Contact (radius=0.05, stiffness=1e4)
+mss.contact.AddPlane ((0,0,1), -1)
+sim.Advance (sim.time + 1)
+print ("with contact, state = ", mss.GetState())
+
+
+# renumbered state for a small Jacobian bandwidth, connectors stay valid
+mss.Renumber (Ordering.rcm)
+print ("bandwidth =", mss.bandwidth, ", row of mA =", mss.StateRow(mA))
+
+
+# compressed recording of the states, within 1e-6 per component
+traj = Trajectory (dim=len(mss.GetState()), tolerance=1e-6)
+for i in range(100):
+    sim.Step()
+    traj.Append (sim.time, mss.GetState())
+print ("stored", len(traj), "states in", traj.nbytes, "bytes")
+t, y = traj[50]
+for t, y in traj:      # streaming decompression
+    pass
+
+
+# gradient of the misfit to measured positions (here the recorded ones)
+# with respect to all stiffnesses and masses, by one backward sweep
+import numpy as np
+data = np.array([traj[i][1] for i in range(20)])
+misfit, dstiffness, dmass = MisfitGradient (mss, tend=20*sim.dt, steps=20, data=data)
+print ("misfit =", misfit, ", d/dstiffness =", dstiffness, ", d/dmass =", dmass)
+
+
+# static hanging shape, a good initial state for dynamics
+stats = SolveEquilibrium (mss, method=EquilibriumMethod.lbfgs_newton)
+print ("equilibrium after", stats.newtonits, "Newton iterations:", mss.GetState())
+
+
+# natural frequencies of small vibrations about the hanging shape, and the
+# linearized dynamics stepped exactly in the basis of the lowest modes
+modal = ModalAnalysis (mss, k=4)
+print ("frequencies =", modal.frequencies, "Hz, damping ratios =", modal.damping)
+linear = ModalIntegrator (modal)
+linear.SetState (mss)
+for i in range(10):
+    linear.Step (0.05)
+linear.WriteState (mss)
+print ("t =", linear.time, ", linearized state =", mss.GetState())
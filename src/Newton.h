@@ -1,41 +1,443 @@
 #ifndef Newton_h
 #define Newton_h
 
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <memory>
+
 #include "nonlinfunc.h"
+#include "banded.h"
 #include "matrix.h"
 
 namespace Neo_ODE
 {
 
-  void NewtonSolver (shared_ptr<NonlinearFunction> func, VectorView<double> x,
+  // globalization strategy of the Newton solver
+  enum NEWTON_MODE { FULLSTEP=0, LINESEARCH=1, TRUSTREGION=2 };
+
+  
+  // Residuals, Jacobian, its factors and the trial vectors of Newton's method.
+  // Time integrators keep one workspace alive, such that repeated solves of
+  // the same size do not allocate. With reusejacobian, the factored Jacobian
+  // of the previous solve is used for simplified Newton steps as long as
+  // they contract well.
+  // In mixed precision, the Jacobian is factored in float and the Newton
+  // corrections are computed by iterative refinement with residuals in T.
+  // Banded Jacobians, e.g. block tridiagonal ones of chains, are factored
+  // in their band, others by a dense LU. The bandwidth is detected from
+  // every Jacobian unless it is declared.
+  template <typename T>
+  class NewtonWorkspaceT
+  {
+    size_t dimx, dimf;
+    Vector<T> res, restrial, jacdx;
+    Vector<T> dx, dxn, dxc, grad, xtrial;
+    Matrix<T> fprime;
+    DenseLU<T> dense;
+    bool validinverse = false;
+
+    int bandwidth = -1;
+    bool useband = false;
+    BandedLU<T> band;
+
+    bool mixedprecision = false;
+    int maxrefinements = 10;
+    std::unique_ptr<DenseLU<float>> denselow;
+    std::unique_ptr<Vector<float>> rlow, dlow;
+    std::unique_ptr<Vector<T>> refres;
+    std::unique_ptr<BandedLU<float>> bandlow;
+
+    void Invert ()
+    {
+      size_t lower = bandwidth, upper = bandwidth;
+      if (bandwidth < 0) Bandwidth (fprime, lower, upper);
+      // the dense LU is cheaper for wide bands
+      useband = dimx == dimf && 2*(lower+upper) < dimx;
+      
+      if (useband)
+        {
+          if (!mixedprecision)
+            band.Factor (fprime, lower, upper);
+          else
+            bandlow->Factor (fprime, lower, upper);
+        }
+      else if (!mixedprecision)
+        dense.Factor (fprime);
+      else
+        denselow->Factor (fprime);
+      validinverse = true;
+    }
+
+    // d = fprime^{-1} r
+    void ApplyInverse (VectorView<T> r, VectorView<T> d)
+    {
+      if (!mixedprecision)
+        {
+          d = r;
+          if (useband)
+            band.Solve (d);
+          else
+            dense.Solve (d);
+          return;
+        }
+
+      // refinement d += B (r - fprime d), with the float solver B
+      d = 0.0;
+      Vector<T> & rk = *refres;
+      rk = r;
+      double norm0 = L2Norm(r);
+      for (int k = 0; k <= maxrefinements; k++)
+        {
+          for (size_t i = 0; i < dimf; i++)
+            (*rlow)(i) = float(rk(i));
+          *dlow = *rlow;
+          if (useband)
+            bandlow->Solve (*dlow);
+          else
+            denselow->Solve (*dlow);
+          for (size_t i = 0; i < dimx; i++)
+            d(i) += (*dlow)(i);
+
+          rk = fprime*d;
+          rk = r - rk;
+          if (L2Norm(rk) <= 4*std::numeric_limits<T>::epsilon()*norm0) break;
+        }
+    }
+
+    void CheckDims (shared_ptr<NonlinearFunctionT<T>> func) const
+    {
+      if (func->DimX() != dimx || func->DimF() != dimf)
+        throw std::invalid_argument("Newton workspace does not fit the function dimensions");
+    }
+    
+  public:
+    NewtonWorkspaceT (size_t _dimx, size_t _dimf)
+      : dimx(_dimx), dimf(_dimf),
+        res(_dimf), restrial(_dimf), jacdx(_dimf),
+        dx(_dimx), dxn(_dimx), dxc(_dimx), grad(_dimx), xtrial(_dimx),
+        fprime(_dimf, _dimx) { }
+
+    // the stored inverse belongs to a different equation, e.g. after a change of the step size
+    void InvalidateJacobian () { validinverse = false; }
+
+    void SetMixedPrecision (bool _mixedprecision, int _maxrefinements = 10)
+    {
+      mixedprecision = _mixedprecision;
+      maxrefinements = _maxrefinements;
+      if (mixedprecision && !denselow)
+        {
+          denselow = std::make_unique<DenseLU<float>>();
+          rlow = std::make_unique<Vector<float>>(dimf);
+          dlow = std::make_unique<Vector<float>>(dimx);
+          refres = std::make_unique<Vector<T>>(dimf);
+          bandlow = std::make_unique<BandedLU<float>>();
+        }
+      validinverse = false;
+    }
+
+    // half bandwidth of the Jacobians to come, entries outside the band are
+    // ignored. -1 detects the bandwidth of every Jacobian.
+    void SetBandwidth (int _bandwidth)
+    {
+      bandwidth = _bandwidth;
+      validinverse = false;
+    }
+    
+    void SolveFullStep (shared_ptr<NonlinearFunctionT<T>> func, VectorView<T> x,
+                        double tol = 1e-10, int maxsteps = 10,
+                        std::function<void(int,double,VectorView<T>)> callback = nullptr,
+                        bool reusejacobian = false)
+    {
+      CheckDims (func);
+      double errold = 0;
+      // std::cout << "x = " << x << std::endl;
+      for (int i = 0; i < maxsteps; i++)
+        {
+          func->Evaluate(x, res);
+          // std::cout << "res = " << res << std::endl;
+          double err= L2Norm(res);
+
+          bool fresh = !reusejacobian || !validinverse;
+          if (fresh)
+            {
+              func->EvaluateDeriv(x, fprime);
+              // std::cout << "fprime = " << fprime << std::endl;
+              Invert();
+            }
+          ApplyInverse (res, dx);
+          x -= dx;
+          // std::cout << "new x = " << x << std::endl;
+
+          if (callback)
+            callback(i, err, x);
+          if (err < tol) return;
+
+          // slow contraction of simplified Newton: refresh the Jacobian
+          if (!fresh && i > 0 && err > 0.25*errold)
+            validinverse = false;
+          errold = err;
+        }
+
+      validinverse = false;
+      throw std::domain_error("Newton did not converge");
+    }
+
+
+    // Newton's method with Armijo backtracking on the merit function phi = |f(x)|^2/2:
+    // x -= alpha*dx is accepted if phi(x-alpha*dx) <= (1-2*c*alpha) phi(x),
+    // otherwise alpha is reduced by safeguarded quadratic interpolation
+    void SolveLineSearch (shared_ptr<NonlinearFunctionT<T>> func, VectorView<T> x,
+                          double tol = 1e-10, int maxsteps = 10,
+                          std::function<void(int,double,VectorView<T>)> callback = nullptr)
+    {
+      CheckDims (func);
+      const double c = 1e-4;
+      const double alphamin = 1e-4;
+    
+      validinverse = false;
+      func->Evaluate(x, res);
+      for (int i = 0; i < maxsteps; i++)
+        {
+          func->EvaluateDeriv(x, fprime);
+          Invert();
+          ApplyInverse (res, dx);
+        
+          double err = L2Norm(res);
+          if (err < tol)
+            {
+              x -= dx;
+              if (callback) callback(i, err, x);
+              return;
+            }
+
+          double phi0 = err*err;
+          double alpha = 1;
+          while (true)
+            {
+              xtrial = x - T(alpha)*dx;
+              func->Evaluate(xtrial, restrial);
+              double phi = L2Norm(restrial)*L2Norm(restrial);
+              if (phi <= (1-2*c*alpha)*phi0) break;
+              if (alpha < alphamin)
+                throw std::domain_error("Newton line search failed");
+              // minimizer of the quadratic through phi(0), phi'(0) = -2 phi(0), phi(alpha)
+              double alphaq = phi0*alpha*alpha / (phi - phi0 + 2*alpha*phi0);
+              alpha = std::max(0.1*alpha, std::min(0.5*alpha, alphaq));
+            }
+        
+          x = xtrial;
+          res = restrial;
+          if (callback)
+            callback(i, err, x);
+        }
+
+      throw std::domain_error("Newton did not converge");
+    }
+
+
+    // Newton's method in a trust region of radius delta, using Powell's dogleg
+    // between the Cauchy point of |f|^2/2 and the Newton step. Steps with a poor ratio
+    // of actual to predicted reduction are rejected and the region is shrunk.
+    // At a singular Jacobian, the Cauchy step clipped to the region is taken
+    // until the Jacobian factors again.
+    void SolveTrustRegion (shared_ptr<NonlinearFunctionT<T>> func, VectorView<T> x,
+                           double tol = 1e-10, int maxsteps = 10,
+                           std::function<void(int,double,VectorView<T>)> callback = nullptr)
+    {
+      CheckDims (func);
+      size_t n = dimx;
+      double delta = -1;
+      bool newjacobian = true;
+      
+      bool singular = false;
+      
+      validinverse = false;
+      func->Evaluate(x, res);
+    
+      for (int i = 0; i < maxsteps; i++)
+        {
+          double err = L2Norm(res);
+          if (newjacobian)
+            {
+              func->EvaluateDeriv(x, fprime);
+              try
+                {
+                  Invert();
+                  ApplyInverse (res, dxn);
+                  singular = false;
+                }
+              catch (std::domain_error & e)
+                {
+                  validinverse = false;
+                  singular = true;
+                }
+
+              if (err < tol)
+                {
+                  if (!singular) x -= dxn;
+                  if (callback) callback(i, err, x);
+                  return;
+                }
+
+              // steepest descent direction of |f|^2/2 is -fprime^T res
+              for (size_t j = 0; j < n; j++)
+                {
+                  double sum = 0;
+                  for (size_t k = 0; k < dimf; k++)
+                    sum += fprime(k,j)*res(k);
+                  grad(j) = sum;
+                }
+              jacdx = fprime*grad;
+              double normjg = L2Norm(jacdx);
+              if (normjg == 0)
+                throw std::domain_error("Newton trust region at a stationary point of the residual");
+              dxc = T(L2Norm(grad)*L2Norm(grad)/(normjg*normjg)) * grad;
+
+              if (delta < 0) delta = L2Norm(singular ? dxc : dxn);
+              newjacobian = false;
+            }
+
+          // dogleg step, we update x -= dx
+          double normn = singular ? 0 : L2Norm(dxn);
+          double normc = L2Norm(dxc);
+          if (singular && normc <= delta)
+            dx = dxc;
+          else if (singular)
+            dx = T(delta/L2Norm(grad)) * grad;
+          else if (normn <= delta)
+            dx = dxn;
+          else if (normc >= delta)
+            dx = T(delta/L2Norm(grad)) * grad;
+          else
+            {
+              // |dxc + tau (dxn-dxc)| = delta
+              double a = 0, b = 0;
+              for (size_t j = 0; j < n; j++)
+                {
+                  double d = dxn(j)-dxc(j);
+                  a += d*d;
+                  b += 2*d*dxc(j);
+                }
+              double cc = normc*normc - delta*delta;
+              double tau = (-b + std::sqrt(b*b-4*a*cc)) / (2*a);
+              dx = dxc + T(tau)*(dxn-dxc);
+            }
+
+          // reduction predicted by the linear model |res - fprime dx|^2/2 
+          jacdx = fprime*dx;
+          jacdx = res - jacdx;
+          double pred = 0.5*(err*err - L2Norm(jacdx)*L2Norm(jacdx));
+
+          xtrial = x - dx;
+          func->Evaluate(xtrial, restrial);
+          double errtrial = L2Norm(restrial);
+          double actual = 0.5*(err*err - errtrial*errtrial);
+          double rho = (pred > 0) ? actual/pred : -1;
+
+          double normdx = L2Norm(dx);
+          if (rho < 0.25)
+            delta = 0.25*normdx;
+          else if (rho > 0.75 && normdx > 0.99*delta)
+            delta *= 2;
+
+          if (rho > 1e-4)
+            {
+              x = xtrial;
+              res = restrial;
+              newjacobian = true;
+            }
+          else if (delta < 1e-14*(1+L2Norm(x)))
+            throw std::domain_error("Newton trust region collapsed");
+
+          if (callback)
+            callback(i, err, x);
+        }
+
+      throw std::domain_error("Newton did not converge");
+    }
+
+
+    void Solve (shared_ptr<NonlinearFunctionT<T>> func, VectorView<T> x,
+                NEWTON_MODE mode, double tol = 1e-10, int maxsteps = 10,
+                std::function<void(int,double,VectorView<T>)> callback = nullptr,
+                bool reusejacobian = false)
+    {
+      switch (mode)
+        {
+        case FULLSTEP:
+          SolveFullStep (func, x, tol, maxsteps, callback, reusejacobian); break;
+        case LINESEARCH:
+          SolveLineSearch (func, x, tol, maxsteps, callback); break;
+        case TRUSTREGION:
+          SolveTrustRegion (func, x, tol, maxsteps, callback); break;
+        }
+    }
+  };
+
+  
+  using NewtonWorkspace = NewtonWorkspaceT<double>;
+
+  
+  template <typename F>
+  void NewtonSolver (shared_ptr<F> func, VectorView<typename F::scalar_type> x,
                      double tol = 1e-10, int maxsteps = 10,
-                     std::function<void(int,double,VectorView<double>)> callback = nullptr)
+                     std::function<void(int,double,VectorView<typename F::scalar_type>)> callback = nullptr)
   {
-    Vector<> res(func->DimF());
-    Matrix<> fprime(func->DimF(), func->DimX());
-
-    // std::cout << "x = " << x << std::endl;
-    for (int i = 0; i < maxsteps; i++)
-      {
-        func->Evaluate(x, res);
-        // std::cout << "res = " << res << std::endl;
-        // cout << "|res| = " << L2Norm(res) << endl;
-        func->EvaluateDeriv(x, fprime);
-        // std::cout << "fprime = " << fprime << std::endl;
-        fprime = Inverse(fprime);
-        // std::cout << "inv fprime = " << fprime << std::endl;
-        x -= fprime*res;
-        // std::cout << "new x = " << x << std::endl;
-
-        double err= L2Norm(res);
-        if (callback)
-          callback(i, err, x);
-        if (err < tol) return;
-      }
-
-    throw std::domain_error("Newton did not converge");
+    NewtonWorkspaceT<typename F::scalar_type> ws(func->DimX(), func->DimF());
+    ws.SolveFullStep (func, x, tol, maxsteps, callback);
   }
 
+  template <typename F>
+  void NewtonSolverLineSearch (shared_ptr<F> func, VectorView<typename F::scalar_type> x,
+                               double tol = 1e-10, int maxsteps = 10,
+                               std::function<void(int,double,VectorView<typename F::scalar_type>)> callback = nullptr)
+  {
+    NewtonWorkspaceT<typename F::scalar_type> ws(func->DimX(), func->DimF());
+    ws.SolveLineSearch (func, x, tol, maxsteps, callback);
+  }
+
+  template <typename F>
+  void NewtonSolverTrustRegion (shared_ptr<F> func, VectorView<typename F::scalar_type> x,
+                                double tol = 1e-10, int maxsteps = 10,
+                                std::function<void(int,double,VectorView<typename F::scalar_type>)> callback = nullptr)
+  {
+    NewtonWorkspaceT<typename F::scalar_type> ws(func->DimX(), func->DimF());
+    ws.SolveTrustRegion (func, x, tol, maxsteps, callback);
+  }
+
+  template <typename F>
+  void NewtonSolver (shared_ptr<F> func, VectorView<typename F::scalar_type> x,
+                     NEWTON_MODE mode, double tol = 1e-10, int maxsteps = 10,
+                     std::function<void(int,double,VectorView<typename F::scalar_type>)> callback = nullptr)
+  {
+    NewtonWorkspaceT<typename F::scalar_type> ws(func->DimX(), func->DimF());
+    ws.Solve (func, x, mode, tol, maxsteps, callback);
+  }
+
+
+  // settings for the Newton solves inside the implicit time steppers
+  struct NewtonParameters
+  {
+    NEWTON_MODE mode = LINESEARCH;
+    double tol = 1e-10;
+    int maxsteps = 10;
+    // a time step whose Newton solve fails is repeated as two halved steps,
+    // at most maxhalvings times
+    int maxhalvings = 6;
+    // simplified Newton with the Jacobian of earlier solves, full step mode only
+    bool reusejacobian = false;
+    // Jacobian inverted in float, corrections refined in double
+    bool mixedprecision = false;
+    // half bandwidth of the Jacobian, -1 to detect it in every Newton step
+    int bandwidth = -1;
+  };
+
+
+#ifdef NEO_ODE_EXTERN_TEMPLATES
+  extern template class NewtonWorkspaceT<double>;
+#endif
+  
 }
 
 #endif
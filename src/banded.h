@@ -0,0 +1,222 @@
+#ifndef BANDED_H
+#define BANDED_H
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <vector.h>
+#include "simd.h"
+
+namespace Neo_ODE
+{
+  using namespace Neo_CLA;
+
+  // lower and upper bandwidth of a square matrix: A(i,j) = 0 for
+  // j < i-lower and j > i+upper
+  template <typename TM>
+  void Bandwidth (const TM & a, size_t & lower, size_t & upper)
+  {
+    lower = upper = 0;
+    size_t n = a.height();
+    for (size_t i = 0; i < n; i++)
+      {
+        for (size_t j = 0; j + lower < i; j++)
+          if (a(i,j) != 0)
+            {
+              lower = i-j;
+              break;
+            }
+        for (size_t j = n; j-- > i + upper + 1; )
+          if (a(i,j) != 0)
+            {
+              upper = j-i;
+              break;
+            }
+      }
+  }
+
+
+  // square matrix with lower and upper bandwidth bw, row i holds the
+  // columns i-bw ... i+bw. Reads outside the band give zero, writes have to
+  // stay inside.
+  template <typename T>
+  class BandMatrix
+  {
+    size_t n = 0, bw = 0, w = 1;
+    std::vector<T> band;
+  public:
+    BandMatrix () = default;
+    BandMatrix (size_t _n, size_t _bw)
+      : n(_n), bw(std::min(_bw, _n ? _n-1 : 0)), w(2*bw+1), band(n*w, T(0)) { }
+
+    size_t height() const { return n; }
+    size_t width() const { return n; }
+    size_t Bandwidth() const { return bw; }
+
+    T & operator() (size_t i, size_t j) { return band[i*w + j + bw - i]; }
+    T operator() (size_t i, size_t j) const
+    {
+      return (j+bw < i || i+bw < j) ? T(0) : band[i*w + j + bw - i];
+    }
+  };
+
+
+  // LU factorization with partial pivoting of a banded matrix, in O(n kl (kl+ku))
+  // time and O(n (2 kl + ku)) memory. Row interchanges widen the upper band
+  // of U to kl+ku. Block tridiagonal matrices with blocks of size b are
+  // banded with kl = ku = 2b-1.
+  template <typename T>
+  class BandedLU
+  {
+    size_t n = 0, kl = 0, ku = 0, w = 1;
+    std::vector<T> band;     // row i holds the columns i-kl ... i+kl+ku
+    std::vector<size_t> piv;
+
+    T & At (size_t i, size_t j) { return band[i*w + j + kl - i]; }
+    T At (size_t i, size_t j) const { return band[i*w + j + kl - i]; }
+
+  public:
+    size_t Lower() const { return kl; }
+    size_t Upper() const { return ku; }
+
+    // factors the band of a, entries outside are ignored
+    template <typename TM>
+    void Factor (const TM & a, size_t _kl, size_t _ku)
+    {
+      n = a.height();
+      kl = _kl;
+      ku = _ku;
+      w = 2*kl+ku+1;
+      band.assign (n*w, T(0));
+      piv.resize (n);
+      for (size_t i = 0; i < n; i++)
+        for (size_t j = (i > kl) ? i-kl : 0; j <= std::min(n-1, i+ku); j++)
+          At(i,j) = T(a(i,j));
+
+      for (size_t k = 0; k < n; k++)
+        {
+          size_t last = std::min(n-1, k+kl);
+          size_t p = k;
+          for (size_t r = k+1; r <= last; r++)
+            if (std::abs(At(r,k)) > std::abs(At(p,k))) p = r;
+          if (At(p,k) == T(0))
+            throw std::domain_error("banded matrix is singular");
+          piv[k] = p;
+
+          size_t lastcol = std::min(n-1, k+kl+ku);
+          if (p != k)
+            for (size_t j = k; j <= lastcol; j++)
+              std::swap (At(k,j), At(p,j));
+
+          T invpivot = T(1) / At(k,k);
+          for (size_t r = k+1; r <= last; r++)
+            {
+              T l = At(r,k) * invpivot;
+              At(r,k) = l;
+              if (l == T(0)) continue;
+              simd::SubAx (lastcol-k, l, &At(k,k+1), &At(r,k+1));
+            }
+        }
+    }
+
+    // b = A^{-1} b
+    void Solve (VectorView<T> b) const
+    {
+      for (size_t k = 0; k < n; k++)
+        {
+          if (piv[k] != k) std::swap (b(k), b(piv[k]));
+          for (size_t r = k+1; r <= std::min(n-1, k+kl); r++)
+            b(r) -= At(r,k) * b(k);
+        }
+      for (size_t i = n; i-- > 0; )
+        {
+          T sum = b(i);
+          for (size_t j = i+1; j <= std::min(n-1, i+kl+ku); j++)
+            sum -= At(i,j) * b(j);
+          b(i) = sum / At(i,i);
+        }
+    }
+  };
+
+
+  // LU factorization with partial pivoting of a dense matrix, in 2/3 n^3
+  // operations, a third of an inversion. The row operations are dispatched
+  // to the vector instructions of the CPU.
+  template <typename T>
+  class DenseLU
+  {
+    size_t n = 0;
+    std::vector<T> lu;       // row major, L below the diagonal
+    std::vector<size_t> piv;
+
+    T & At (size_t i, size_t j) { return lu[i*n + j]; }
+    T At (size_t i, size_t j) const { return lu[i*n + j]; }
+
+  public:
+    template <typename TM>
+    void Factor (const TM & a)
+    {
+      n = a.height();
+      lu.resize (n*n);
+      piv.resize (n);
+      for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < n; j++)
+          At(i,j) = T(a(i,j));
+
+      for (size_t k = 0; k < n; k++)
+        {
+          size_t p = k;
+          for (size_t r = k+1; r < n; r++)
+            if (std::abs(At(r,k)) > std::abs(At(p,k))) p = r;
+          if (At(p,k) == T(0))
+            throw std::domain_error("matrix is singular");
+          piv[k] = p;
+          if (p != k)
+            std::swap_ranges (&At(k,0), &At(k,0)+n, &At(p,0));
+
+          T invpivot = T(1) / At(k,k);
+          for (size_t r = k+1; r < n; r++)
+            {
+              T l = At(r,k) * invpivot;
+              At(r,k) = l;
+              if (l == T(0)) continue;
+              simd::SubAx (n-k-1, l, &At(k,k+1), &At(r,k+1));
+            }
+        }
+    }
+
+    // b = A^{-1} b
+    void Solve (VectorView<T> b) const
+    {
+      for (size_t k = 0; k < n; k++)
+        if (piv[k] != k) std::swap (b(k), b(piv[k]));
+      for (size_t i = 1; i < n; i++)
+        {
+          T sum = b(i);
+          for (size_t j = 0; j < i; j++)
+            sum -= At(i,j) * b(j);
+          b(i) = sum;
+        }
+      for (size_t i = n; i-- > 0; )
+        {
+          T sum = b(i);
+          for (size_t j = i+1; j < n; j++)
+            sum -= At(i,j) * b(j);
+          b(i) = sum / At(i,i);
+        }
+    }
+  };
+
+
+#ifdef NEO_ODE_EXTERN_TEMPLATES
+  extern template class BandedLU<double>;
+  extern template class BandedLU<float>;
+  extern template class DenseLU<double>;
+  extern template class DenseLU<float>;
+#endif
+
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "ode.h"
+
+namespace Neo_ODE
+{
+
+  enum EVENT_ACTION { TERMINATE=0, CONTINUE=1, MODIFY=2 };
+
+  // An event happens when g(t, u) changes sign, where u is the complete
+  // state of the integrator (y, or (x, v, a) for second order systems).
+  // direction +1 detects only rising, -1 only falling crossings, 0 both.
+  // TERMINATE stops the integration at the event, CONTINUE only reports it,
+  // MODIFY lets 'modify' change the state at the event and restarts there.
+  struct Event
+  {
+    std::function<double(double, VectorView<double>)> g;
+    int direction = 0;
+    EVENT_ACTION action = TERMINATE;
+    std::function<void(double, VectorView<double>)> modify = nullptr;
+  };
+
+  
+  // Illinois variant of regula falsi for g(s, u(s)) = 0 in [a, b], where
+  // u(s) comes from the dense output of the last step
+  inline double LocateEvent (const TimeIntegrator & integrator, const Event & event,
+                             double a, double ga, double b, double gb,
+                             VectorView<double> u, int maxits = 60)
+  {
+    double tol = 1e-12 * (1 + std::abs(b)) + 1e-14*(b-a);
+    double c = b;
+    int side = 0;
+    for (int i = 0; i < maxits && b-a > tol; i++)
+      {
+        c = (a*gb - b*ga) / (gb - ga);
+        integrator.InterpolateFullState (c, u);
+        double gc = event.g(c, u);
+        if (gc == 0) return c;
+        if (gc*gb > 0)
+          {
+            b = c;
+            gb = gc;
+            if (side == -1) ga /= 2;
+            side = -1;
+          }
+        else
+          {
+            a = c;
+            ga = gc;
+            if (side == +1) gb /= 2;
+            side = +1;
+          }
+      }
+    return c;
+  }
+
+  inline bool EventTriggered (const Event & event, double gold, double gnew)
+  {
+    bool rising = gold < 0 && gnew >= 0;
+    bool falling = gold > 0 && gnew <= 0;
+    return (rising && event.direction >= 0) || (falling && event.direction <= 0);
+  }
+
+  
+  // Integrates up to tend and checks the event functions after every step.
+  // Sign changes are located on the dense output, reported in time order
+  // by onevent(index, t, state), and handled by their action. Returns the
+  // time where integration stopped: tend, or the time of a terminal event,
+  // at which the integrator's state is set.
+  inline double AdvanceWithEvents (TimeIntegrator & integrator, double tend,
+                            const std::vector<Event> & events,
+                            std::function<void(size_t, double, VectorView<double>)> onevent = nullptr,
+                            std::function<void(double, VectorView<double>)> callback = nullptr)
+  {
+    bool wasdense = integrator.DenseOutput();
+    integrator.SetDenseOutput (true);
+
+    Vector<> u(integrator.StateSize());
+    std::vector<double> gold(events.size()), gnew(events.size());
+    std::vector<std::pair<double, size_t>> occurred;
+
+    auto evaluate_all = [&](std::vector<double> & g)
+    {
+      integrator.GetFullState (u);
+      for (size_t i = 0; i < events.size(); i++)
+        g[i] = events[i].g(integrator.Time(), u);
+    };
+    evaluate_all (gold);
+
+    double dt = integrator.TimeStep();
+    bool stop = false;
+    while (!stop && tend - integrator.Time() > 1e-10*dt)
+      {
+        double h = std::min(dt, tend-integrator.Time());
+        if (dt - h < 1e-8*dt) h = dt;
+        integrator.Step (h);
+        evaluate_all (gnew);
+
+        double t0 = integrator.PreviousTime();
+        double t1 = integrator.Time();
+        occurred.clear();
+        for (size_t i = 0; i < events.size(); i++)
+          if (EventTriggered (events[i], gold[i], gnew[i]))
+            occurred.emplace_back (LocateEvent (integrator, events[i], t0, gold[i], t1, gnew[i], u), i);
+        std::sort (occurred.begin(), occurred.end());
+
+        for (auto [te, i] : occurred)
+          {
+            integrator.InterpolateFullState (te, u);
+            if (onevent) onevent (i, te, u);
+            if (events[i].action == CONTINUE) continue;
+
+            // restart from the state at the event
+            if (events[i].action == MODIFY && events[i].modify)
+              events[i].modify (te, u);
+            integrator.SetFullState (te, u);
+            if (events[i].action == TERMINATE) stop = true;
+            break;
+          }
+
+        if (callback) callback (integrator.Time(), integrator.Solution());
+        evaluate_all (gold);
+      }
+
+    integrator.SetDenseOutput (wasdense);
+    return integrator.Time();
+  }
+
+}
+
+#endif
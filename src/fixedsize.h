@@ -0,0 +1,326 @@
+#ifndef FIXEDSIZE_H
+#define FIXEDSIZE_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+
+#include "nonlinfunc.h"
+#include "Newton.h"
+
+namespace Neo_ODE
+{
+
+  // Small systems with dimensions known at compile time. Vectors and
+  // Jacobians live on the stack, all loops have constant bounds and are
+  // unrolled by the compiler, and the stepping loops call the function
+  // without virtual dispatch.
+
+  template <size_t N, typename T = double>
+  using FixedVector = std::array<T,N>;
+
+  template <size_t H, size_t W, typename T = double>
+  using FixedMatrix = std::array<std::array<T,W>,H>;
+
+
+  // Base for functions of fixed size, DERIVED provides
+  //   void EvaluateFixed (const FixedVector<NX,T> & x, FixedVector<NF,T> & f) const;
+  //   void EvaluateDerivFixed (const FixedVector<NX,T> & x, FixedMatrix<NF,NX,T> & df) const;
+  // It is a NonlinearFunction as well, and can be used in any tree.
+  template <typename DERIVED, size_t NX, size_t NF = NX, typename T = double>
+  class FixedFunction : public NonlinearFunctionT<T>
+  {
+  public:
+    static constexpr size_t dimx = NX;
+    static constexpr size_t dimf = NF;
+
+    size_t DimX() const override { return NX; }
+    size_t DimF() const override { return NF; }
+
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
+    {
+      FixedVector<NX,T> xf;
+      FixedVector<NF,T> ff;
+      for (size_t i = 0; i < NX; i++) xf[i] = x(i);
+      static_cast<const DERIVED&>(*this).EvaluateFixed (xf, ff);
+      for (size_t i = 0; i < NF; i++) f(i) = ff[i];
+    }
+
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
+    {
+      FixedVector<NX,T> xf;
+      FixedMatrix<NF,NX,T> dff;
+      for (size_t i = 0; i < NX; i++) xf[i] = x(i);
+      static_cast<const DERIVED&>(*this).EvaluateDerivFixed (xf, dff);
+      for (size_t i = 0; i < NF; i++)
+        for (size_t j = 0; j < NX; j++)
+          df(i,j) = dff[i][j];
+    }
+  };
+
+
+  // solves a x = b by LU with partial pivoting, x overwrites b. Returns
+  // false if a is singular.
+  template <size_t N, typename T>
+  bool TrySolveFixed (FixedMatrix<N,N,T> a, FixedVector<N,T> & b)
+  {
+    for (size_t k = 0; k < N; k++)
+      {
+        size_t p = k;
+        for (size_t r = k+1; r < N; r++)
+          if (std::abs(a[r][k]) > std::abs(a[p][k])) p = r;
+        if (a[p][k] == T(0))
+          return false;
+        if (p != k)
+          {
+            std::swap (a[p], a[k]);
+            std::swap (b[p], b[k]);
+          }
+        T inv = T(1) / a[k][k];
+        for (size_t r = k+1; r < N; r++)
+          {
+            T l = a[r][k] * inv;
+            for (size_t j = k+1; j < N; j++)
+              a[r][j] -= l * a[k][j];
+            b[r] -= l * b[k];
+          }
+      }
+    for (size_t i = N; i-- > 0; )
+      {
+        T sum = b[i];
+        for (size_t j = i+1; j < N; j++)
+          sum -= a[i][j] * b[j];
+        b[i] = sum / a[i][i];
+      }
+    return true;
+  }
+
+  template <size_t N, typename T>
+  void SolveFixed (const FixedMatrix<N,N,T> & a, FixedVector<N,T> & b)
+  {
+    if (!TrySolveFixed<N,T> (a, b))
+      throw std::domain_error("fixed size matrix is singular");
+  }
+
+  // Newton's method for residual(x, r) and jacobian(x, J). With LINESEARCH,
+  // the steps are damped by backtracking as in NewtonWorkspace::SolveLineSearch.
+  // Returns false if it fails, the time steppers then halve the step.
+  template <size_t N, bool LINESEARCH = false, typename T, typename RES, typename JAC>
+  NEO_ODE_INLINE bool TryNewtonFixed (RES residual, JAC jacobian, FixedVector<N,T> & x,
+                                     double tol = 1e-10, int maxsteps = 10)
+  {
+    const double c = 1e-4;
+    const double alphamin = 1e-4;
+    FixedVector<N,T> r, dx, xtrial, rtrial;
+    FixedMatrix<N,N,T> jac;
+    auto norm2 = [](const FixedVector<N,T> & v)
+    {
+      double sum = 0;
+      for (size_t k = 0; k < N; k++) sum += v[k]*v[k];
+      return sum;
+    };
+
+    residual (x, r);
+    for (int i = 0; i < maxsteps; i++)
+      {
+        double phi0 = norm2(r);
+        jacobian (x, jac);
+        dx = r;
+        if (!TrySolveFixed<N,T> (jac, dx)) return false;
+        if (std::sqrt(phi0) < tol)
+          {
+            for (size_t k = 0; k < N; k++) x[k] -= dx[k];
+            return true;
+          }
+
+        double alpha = 1;
+        while (true)
+          {
+            for (size_t k = 0; k < N; k++) xtrial[k] = x[k] - T(alpha)*dx[k];
+            residual (xtrial, rtrial);
+            if (!LINESEARCH) break;
+            double phi = norm2(rtrial);
+            if (phi <= (1-2*c*alpha)*phi0) break;
+            if (alpha < alphamin) return false;
+            double alphaq = phi0*alpha*alpha / (phi - phi0 + 2*alpha*phi0);
+            alpha = std::max(0.1*alpha, std::min(0.5*alpha, alphaq));
+          }
+        x = xtrial;
+        r = rtrial;
+      }
+    return false;
+  }
+
+  // Newton's method with full steps
+  template <size_t N, typename T, typename RES, typename JAC>
+  void NewtonFixed (RES residual, JAC jacobian, FixedVector<N,T> & x,
+                    double tol = 1e-10, int maxsteps = 10)
+  {
+    if (!TryNewtonFixed<N> (residual, jacobian, x, tol, maxsteps))
+      throw std::domain_error("Newton did not converge");
+  }
+
+  template <typename F>
+  void NewtonSolver (const F & func, FixedVector<F::dimx, typename F::scalar_type> & x,
+                     double tol = 1e-10, int maxsteps = 10)
+  {
+    static_assert (F::dimx == F::dimf, "Newton needs a square system");
+    NewtonFixed<F::dimx> ([&func](auto & x, auto & r) { func.EvaluateFixed (x, r); },
+                          [&func](auto & x, auto & jac) { func.EvaluateDerivFixed (x, jac); },
+                          x, tol, maxsteps);
+  }
+
+
+  // the fixed step solvers for y' = rhs(y) of fixed size. The implicit ones
+  // follow NewtonParameters: steps whose Newton solve fails are halved, and
+  // all modes but FULLSTEP use the line search (there is no trust region).
+  template <typename F, size_t N = F::dimx>
+  void SolveODE_EE (double tend, int steps, FixedVector<N> & y, const F & rhs,
+                    std::function<void(double,const FixedVector<N>&)> callback = nullptr)
+  {
+    double dt = tend/steps;
+    FixedVector<N> f;
+    for (int i = 0; i < steps; i++)
+      {
+        rhs.EvaluateFixed (y, f);
+        for (size_t k = 0; k < N; k++) y[k] += dt*f[k];
+        if (callback) callback((i+1)*dt, y);
+      }
+  }
+
+  // one implicit Euler step of size h, false if Newton fails
+  template <bool LINESEARCH, typename F, size_t N>
+  bool StepFixed_IE (const F & rhs, double h, FixedVector<N> & y, const NewtonParameters & params)
+  {
+    FixedVector<N> yold = y;
+    // ynew - yold - h rhs(ynew)
+    auto residual = [&](const FixedVector<N> & x, FixedVector<N> & r)
+    {
+      rhs.EvaluateFixed (x, r);
+      for (size_t k = 0; k < N; k++) r[k] = x[k] - yold[k] - h*r[k];
+    };
+    auto jacobian = [&](const FixedVector<N> & x, FixedMatrix<N,N> & jac)
+    {
+      rhs.EvaluateDerivFixed (x, jac);
+      for (size_t k = 0; k < N; k++)
+        for (size_t j = 0; j < N; j++)
+          jac[k][j] = (k == j ? 1 : 0) - h*jac[k][j];
+    };
+    return TryNewtonFixed<N,LINESEARCH> (residual, jacobian, y, params.tol, params.maxsteps);
+  }
+
+  // one Crank-Nicolson step of size h, false if Newton fails
+  template <bool LINESEARCH, typename F, size_t N>
+  bool StepFixed_CN (const F & rhs, double h, FixedVector<N> & y, const NewtonParameters & params)
+  {
+    FixedVector<N> yold = y, fold;
+    rhs.EvaluateFixed (yold, fold);
+    // ynew - yold - h/2 (rhs(ynew) + rhs(yold))
+    auto residual = [&](const FixedVector<N> & x, FixedVector<N> & r)
+    {
+      rhs.EvaluateFixed (x, r);
+      for (size_t k = 0; k < N; k++) r[k] = x[k] - yold[k] - 0.5*h*(r[k]+fold[k]);
+    };
+    auto jacobian = [&](const FixedVector<N> & x, FixedMatrix<N,N> & jac)
+    {
+      rhs.EvaluateDerivFixed (x, jac);
+      for (size_t k = 0; k < N; k++)
+        for (size_t j = 0; j < N; j++)
+          jac[k][j] = (k == j ? 1 : 0) - 0.5*h*jac[k][j];
+    };
+    return TryNewtonFixed<N,LINESEARCH> (residual, jacobian, y, params.tol, params.maxsteps);
+  }
+
+  // the steps of size h/2 replacing a failed step of size h, at most
+  // maxhalvings times halved, as StepWithRejection. The recursion is
+  // unrolled into a loop over the substeps of the finest level.
+  template <size_t N>
+  void FixedHalvedSteps (double h, int maxhalvings, FixedVector<N> & y,
+                         const std::function<bool(double,FixedVector<N>&)> & step)
+  {
+    if (maxhalvings <= 0)
+      throw std::domain_error("Newton did not converge");
+    int level = 1;                        // current step size hl = h/2^level
+    double hl = h/2;
+    unsigned long done = 0, total = 2;    // steps done of this size
+    while (done < total)
+      {
+        FixedVector<N> ystart = y;
+        if (!step(hl, y))
+          {
+            if (level >= maxhalvings)
+              throw std::domain_error("Newton did not converge");
+            y = ystart;
+            level++;
+            hl /= 2;
+            done *= 2;
+            total *= 2;
+            continue;
+          }
+        done++;
+        // both halves done, back to the larger step
+        while (level > 1 && done % 2 == 0)
+          {
+            level--;
+            hl *= 2;
+            done /= 2;
+            total /= 2;
+          }
+      }
+  }
+
+  // steps of size tend/steps by step(h, y), failed ones are halved
+  template <size_t N, typename STEP>
+  void FixedStepsWithRejection (double tend, int steps, FixedVector<N> & y, STEP step,
+                                int maxhalvings,
+                                const std::function<void(double,const FixedVector<N>&)> & callback)
+  {
+    double dt = tend/steps;
+    for (int i = 0; i < steps; i++)
+      {
+        FixedVector<N> ystart = y;
+        if (!step(dt, y))
+          {
+            y = ystart;
+            FixedHalvedSteps<N> (dt, maxhalvings, y, step);
+          }
+        if (callback) callback((i+1)*dt, y);
+      }
+  }
+
+  template <typename F, size_t N = F::dimx>
+  void SolveODE_IE (double tend, int steps, FixedVector<N> & y, const F & rhs,
+                    std::function<void(double,const FixedVector<N>&)> callback = nullptr,
+                    NewtonParameters params = NewtonParameters())
+  {
+    if (params.mode == FULLSTEP)
+      FixedStepsWithRejection (tend, steps, y, [&](double h, FixedVector<N> & y)
+                               { return StepFixed_IE<false> (rhs, h, y, params); },
+                               params.maxhalvings, callback);
+    else
+      FixedStepsWithRejection (tend, steps, y, [&](double h, FixedVector<N> & y)
+                               { return StepFixed_IE<true> (rhs, h, y, params); },
+                               params.maxhalvings, callback);
+  }
+
+  template <typename F, size_t N = F::dimx>
+  void SolveODE_CN (double tend, int steps, FixedVector<N> & y, const F & rhs,
+                    std::function<void(double,const FixedVector<N>&)> callback = nullptr,
+                    NewtonParameters params = NewtonParameters())
+  {
+    if (params.mode == FULLSTEP)
+      FixedStepsWithRejection (tend, steps, y, [&](double h, FixedVector<N> & y)
+                               { return StepFixed_CN<false> (rhs, h, y, params); },
+                               params.maxhalvings, callback);
+    else
+      FixedStepsWithRejection (tend, steps, y, [&](double h, FixedVector<N> & y)
+                               { return StepFixed_CN<true> (rhs, h, y, params); },
+                               params.maxhalvings, callback);
+  }
+
+}
+
+#endif
@@ -0,0 +1,401 @@
+#ifndef LANCZOS_H
+#define LANCZOS_H
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "banded.h"
+#include "matrix.h"
+
+namespace Neo_ODE
+{
+  using namespace Neo_CLA;
+
+  // eigenvalues d and eigenvectors of the symmetric n x n matrix a (row
+  // major, overwritten) by Householder reduction to tridiagonal form and the
+  // implicit QL method, in O(n^3). Eigenvector i is column i of the row
+  // major matrix z.
+  inline void SymmetricEigen (size_t n, std::vector<double> & a,
+                              std::vector<double> & d, std::vector<double> & z)
+  {
+    d.assign (n, 0.0);
+    std::vector<double> e(n, 0.0);
+    z = a;
+    auto Z = [&z,n](size_t i, size_t j) -> double & { return z[i*n+j]; };
+    if (n == 0) return;
+
+    // Householder reduction, the transformations are accumulated in z
+    for (size_t j = 0; j < n; j++)
+      d[j] = Z(n-1,j);
+    for (size_t i = n-1; i > 0; i--)
+      {
+        double scale = 0, h = 0;
+        for (size_t k = 0; k < i; k++)
+          scale += std::abs(d[k]);
+        if (scale == 0)
+          {
+            e[i] = d[i-1];
+            for (size_t j = 0; j < i; j++)
+              {
+                d[j] = Z(i-1,j);
+                Z(i,j) = 0;
+                Z(j,i) = 0;
+              }
+          }
+        else
+          {
+            for (size_t k = 0; k < i; k++)
+              {
+                d[k] /= scale;
+                h += d[k]*d[k];
+              }
+            double f = d[i-1];
+            double g = std::sqrt(h);
+            if (f > 0) g = -g;
+            e[i] = scale * g;
+            h -= f * g;
+            d[i-1] = f - g;
+            for (size_t j = 0; j < i; j++)
+              e[j] = 0;
+            for (size_t j = 0; j < i; j++)
+              {
+                f = d[j];
+                Z(j,i) = f;
+                g = e[j] + Z(j,j) * f;
+                for (size_t k = j+1; k < i; k++)
+                  {
+                    g += Z(k,j) * d[k];
+                    e[k] += Z(k,j) * f;
+                  }
+                e[j] = g;
+              }
+            f = 0;
+            for (size_t j = 0; j < i; j++)
+              {
+                e[j] /= h;
+                f += e[j] * d[j];
+              }
+            double hh = f / (h+h);
+            for (size_t j = 0; j < i; j++)
+              e[j] -= hh * d[j];
+            for (size_t j = 0; j < i; j++)
+              {
+                f = d[j];
+                g = e[j];
+                for (size_t k = j; k < i; k++)
+                  Z(k,j) -= f * e[k] + g * d[k];
+                d[j] = Z(i-1,j);
+                Z(i,j) = 0;
+              }
+          }
+        d[i] = h;
+      }
+
+    for (size_t i = 0; i+1 < n; i++)
+      {
+        Z(n-1,i) = Z(i,i);
+        Z(i,i) = 1;
+        double h = d[i+1];
+        if (h != 0)
+          {
+            for (size_t k = 0; k <= i; k++)
+              d[k] = Z(k,i+1) / h;
+            for (size_t j = 0; j <= i; j++)
+              {
+                double g = 0;
+                for (size_t k = 0; k <= i; k++)
+                  g += Z(k,i+1) * Z(k,j);
+                for (size_t k = 0; k <= i; k++)
+                  Z(k,j) -= g * d[k];
+              }
+          }
+        for (size_t k = 0; k <= i; k++)
+          Z(k,i+1) = 0;
+      }
+    for (size_t j = 0; j < n; j++)
+      {
+        d[j] = Z(n-1,j);
+        Z(n-1,j) = 0;
+      }
+    Z(n-1,n-1) = 1;
+
+    // implicit QL on the tridiagonal matrix, off-diagonal e(0 ... n-2)
+    for (size_t i = 1; i < n; i++)
+      e[i-1] = e[i];
+    e[n-1] = 0;
+
+    const double eps = std::numeric_limits<double>::epsilon();
+    double shift = 0, tst = 0;
+    for (size_t l = 0; l < n; l++)
+      {
+        tst = std::max(tst, std::abs(d[l]) + std::abs(e[l]));
+        size_t m = l;
+        while (m < n-1 && std::abs(e[m]) > eps*tst) m++;
+
+        for (int it = 0; m > l && std::abs(e[l]) > eps*tst; it++)
+          {
+            if (it == 50)
+              throw std::domain_error("symmetric eigenvalues did not converge");
+
+            // Wilkinson shift from the leading 2x2 block
+            double g = d[l];
+            double p = (d[l+1] - g) / (2*e[l]);
+            double r = std::hypot(p, 1.0);
+            if (p < 0) r = -r;
+            d[l] = e[l] / (p+r);
+            d[l+1] = e[l] * (p+r);
+            double dl1 = d[l+1];
+            double h = g - d[l];
+            for (size_t i = l+2; i < n; i++)
+              d[i] -= h;
+            shift += h;
+
+            // chase the bulge by Givens rotations from m up to l
+            p = d[m];
+            double c = 1, c2 = 1, c3 = 1, s = 0, s2 = 0;
+            double el1 = e[l+1];
+            for (size_t i = m; i-- > l; )
+              {
+                c3 = c2;
+                c2 = c;
+                s2 = s;
+                g = c * e[i];
+                h = c * p;
+                r = std::hypot(p, e[i]);
+                e[i+1] = s * r;
+                s = e[i] / r;
+                c = p / r;
+                p = c * d[i] - s * g;
+                d[i+1] = h + s * (c * g + s * d[i]);
+                for (size_t k = 0; k < n; k++)
+                  {
+                    double zk = Z(k,i+1);
+                    Z(k,i+1) = s * Z(k,i) + c * zk;
+                    Z(k,i) = c * Z(k,i) - s * zk;
+                  }
+              }
+            p = -s * s2 * c3 * el1 * e[l] / dl1;
+            e[l] = s * p;
+            d[l] = c * p;
+          }
+        d[l] += shift;
+        e[l] = 0;
+      }
+  }
+
+
+  struct LanczosParameters
+  {
+    double shift = 0;       // the eigenvalues closest to the shift are computed
+    double tol = 1e-10;     // residual of the Ritz pairs, relative to the norm of the inverse
+    size_t blocksize = 6;   // resolves eigenvalues up to this multiplicity, e.g. rigid body modes
+    size_t maxdim = 0;      // of the Krylov space, 0 for the dimension of the problem
+    int bandwidth = -1;     // half bandwidth of K, -1 to detect it
+  };
+
+
+  // The k eigenpairs K x = lam M x closest to params.shift, of a symmetric
+  // matrix K and a diagonal positive mass matrix M = diag(mass), by block
+  // Lanczos with shift-invert: K - shift M is factored once, in its band if
+  // it is banded as in Newton, and the Krylov space of (K - shift M)^{-1} M
+  // is built block by block, M-orthogonal with full reorthogonalization.
+  // Its largest eigenvalues 1/(lam-shift) converge first, in a few
+  // multiples of k vectors. A shift below the spectrum gives the lowest
+  // eigenvalues, a small negative one keeps K - shift M regular for free
+  // systems. The eigenvalues come in ascending order, the eigenvectors are
+  // the M-orthonormal rows of modes. Returns the dimension of the Krylov space.
+  template <typename TM>
+  size_t SolveGeneralizedEigen (const TM & K, VectorView<double> mass, size_t k,
+                                VectorView<double> lam, MatrixView<double> modes,
+                                LanczosParameters params = LanczosParameters())
+  {
+    size_t n = mass.Size();
+    size_t maxdim = params.maxdim ? std::min(params.maxdim, n) : n;
+    size_t p = std::max<size_t>(1, std::min(params.blocksize, k));
+    if (k == 0 || k > maxdim)
+      throw std::invalid_argument("number of eigenvalues must be between 1 and the Krylov dimension");
+
+    // K - shift M, read by the factorizations without a copy of K
+    struct ShiftedMatrix
+    {
+      const TM & K;
+      VectorView<double> mass;
+      double shift;
+      size_t height() const { return mass.Size(); }
+      size_t width() const { return mass.Size(); }
+      double operator() (size_t i, size_t j) const { return i == j ? K(i,j) - shift*mass(i) : K(i,j); }
+    } a { K, mass, params.shift };
+
+    size_t lower = params.bandwidth, upper = params.bandwidth;
+    if (params.bandwidth < 0) Bandwidth (a, lower, upper);
+    bool useband = 2*(lower+upper) < n;
+    BandedLU<double> band;
+    DenseLU<double> dense;
+    if (useband)
+      band.Factor (a, lower, upper);
+    else
+      dense.Factor (a);
+
+    std::vector<double> m(n);
+    for (size_t i = 0; i < n; i++)
+      m[i] = mass(i);
+    auto dotm = [&m,n](const double * x, const double * y)
+    {
+      double sum[4] = { 0, 0, 0, 0 };
+      size_t i = 0;
+      for ( ; i+4 <= n; i += 4)
+        for (int l = 0; l < 4; l++)
+          sum[l] += m[i+l] * x[i+l] * y[i+l];
+      for ( ; i < n; i++)
+        sum[0] += m[i] * x[i] * y[i];
+      return (sum[0]+sum[1]) + (sum[2]+sum[3]);
+    };
+
+    // the basis q, its images w = (K - shift M)^{-1} M q and the columns
+    // h(i,j) = q_i^T M w_j, i <= j, of the projected operator, which are
+    // the coefficients of the orthogonalization of w
+    std::vector<std::vector<double>> q, w, h;
+    double scale = 0;
+    auto add = [&](const std::vector<double> & x, double norm)
+    {
+      q.emplace_back (n);
+      w.emplace_back (n);
+      double * qj = q.back().data();
+      double * wj = w.back().data();
+      for (size_t i = 0; i < n; i++)
+        {
+          qj[i] = x[i] / norm;
+          wj[i] = m[i] * qj[i];
+        }
+      VectorView<double> wv(n, wj);
+      if (useband)
+        band.Solve (wv);
+      else
+        dense.Solve (wv);
+    };
+
+    // against q_first, q_first+1 ..., twice is enough (Kahan, Parlett).
+    // The coefficients are summed up in coefs.
+    auto orthogonalize = [&](std::vector<double> & x, size_t first, double * coefs = nullptr)
+    {
+      for (int pass = 0; pass < 2; pass++)
+        for (size_t i = first; i < q.size(); i++)
+          {
+            double c = dotm(q[i].data(), x.data());
+            simd::SubAx (n, c, q[i].data(), x.data());
+            if (coefs) coefs[i] += c;
+          }
+      return std::sqrt(dotm(x.data(), x.data()));
+    };
+
+    // random directions start the blocks, and replace the dependent ones
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<double> dist(-1, 1);
+    std::vector<double> x(n);
+    auto newdirection = [&]()
+    {
+      for (int tries = 0; tries < 10; tries++)
+        {
+          for (size_t i = 0; i < n; i++)
+            x[i] = dist(gen);
+          double norm0 = std::sqrt(dotm(x.data(), x.data()));
+          double norm = orthogonalize (x, 0);
+          if (norm > 1e-8 * norm0)
+            {
+              add (x, norm);
+              return;
+            }
+        }
+      throw std::domain_error("Lanczos found no new direction");
+    };
+
+    for (size_t i = 0; i < p; i++)
+      newdirection();
+    size_t blockstart = 0;
+    size_t nextcheck = std::max(k, p);
+    std::vector<std::vector<double>> f;
+    std::vector<double> hm, d, z, r(n);
+    while (true)
+      {
+        // the images of the last block leave the span of q by f = (I - Q Q^T M) w,
+        // the residual of a Ritz pair (theta, Q s) is sum_j s_j f_j over the block
+        size_t dim = q.size();
+        f.assign (w.begin()+blockstart, w.end());
+        for (size_t j = blockstart; j < dim; j++)
+          {
+            std::vector<double> coefs(dim, 0.0);
+            orthogonalize (f[j-blockstart], 0, coefs.data());
+            coefs.resize (j+1);
+            h.push_back (coefs);
+            scale = std::max(scale, std::abs(coefs[j]));
+          }
+
+        if (dim >= nextcheck || dim == maxdim)
+          {
+            // Ritz pairs, the k largest in modulus are the wanted ones
+            hm.assign (dim*dim, 0.0);
+            for (size_t j = 0; j < dim; j++)
+              for (size_t i = 0; i <= j; i++)
+                hm[i*dim+j] = hm[j*dim+i] = h[j][i];
+            SymmetricEigen (dim, hm, d, z);
+            std::vector<size_t> idx(dim);
+            std::iota (idx.begin(), idx.end(), 0);
+            std::partial_sort (idx.begin(), idx.begin()+k, idx.end(),
+                               [&d](size_t i1, size_t i2) { return std::abs(d[i1]) > std::abs(d[i2]); });
+
+            // residuals relative to the largest Ritz value, the norm of the
+            // operator, which bounds the rounding errors of the solves
+            double thetamax = std::abs(d[idx[0]]);
+            bool converged = true;
+            for (size_t s = 0; s < k && converged; s++)
+              {
+                std::fill (r.begin(), r.end(), 0.0);
+                for (size_t j = blockstart; j < dim; j++)
+                  simd::SubAx (n, -z[j*dim+idx[s]], f[j-blockstart].data(), r.data());
+                if (std::sqrt(dotm(r.data(), r.data())) > params.tol * thetamax)
+                  converged = false;
+              }
+
+            if (converged)
+              {
+                idx.resize (k);
+                std::sort (idx.begin(), idx.end(),
+                           [&d](size_t i1, size_t i2) { return 1/d[i1] < 1/d[i2]; });
+                for (size_t s = 0; s < k; s++)
+                  {
+                    lam(s) = params.shift + 1/d[idx[s]];
+                    std::fill (r.begin(), r.end(), 0.0);
+                    for (size_t l = 0; l < dim; l++)
+                      simd::SubAx (n, -z[l*dim+idx[s]], q[l].data(), r.data());
+                    for (size_t i = 0; i < n; i++)
+                      modes(s,i) = r[i];
+                  }
+                return dim;
+              }
+            if (dim == maxdim)
+              throw std::domain_error("Lanczos did not converge, increase maxdim");
+            // geometric growth, such that the checks cost a fraction of the iteration
+            nextcheck = std::max(dim+p, dim+dim/4);
+          }
+
+        // the next block, orthogonal to the vectors added before in the block
+        for (auto & fj : f)
+          {
+            if (q.size() == maxdim) break;
+            double norm = orthogonalize (fj, dim);
+            if (norm > 1e-12 * scale)
+              add (fj, norm);
+            else
+              newdirection();
+          }
+        blockstart = dim;
+      }
+  }
+}
+
+#endif
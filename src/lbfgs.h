@@ -0,0 +1,130 @@
+#ifndef LBFGS_H
+#define LBFGS_H
+
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include <vector.h>
+
+namespace Neo_ODE
+{
+  using namespace Neo_CLA;
+
+  struct LBFGSParameters
+  {
+    int memory = 10;        // number of stored correction pairs
+    double tol = 1e-8;      // on the gradient norm, relative to the initial one
+    int maxsteps = 1000;
+  };
+
+
+  // Minimizes energy(x, grad), which returns the value at x and writes the
+  // gradient. The limited memory BFGS directions come from the two-loop
+  // recursion with the last 'memory' pairs s = x_{k+1}-x_k, y = g_{k+1}-g_k,
+  // steps are backtracked until the Armijo condition holds. Pairs with
+  // s.y <= 0 are skipped, such that the directions stay descent directions.
+  // Returns the number of iterations.
+  inline int MinimizeLBFGS (const std::function<double(VectorView<double>, VectorView<double>)> & energy,
+                            VectorView<double> x, LBFGSParameters params = LBFGSParameters())
+  {
+    const double c = 1e-4;
+    size_t n = x.Size();
+    auto dot = [n](VectorView<double> a, VectorView<double> b)
+    {
+      double sum = 0;
+      for (size_t i = 0; i < n; i++) sum += a(i)*b(i);
+      return sum;
+    };
+
+    std::vector<Vector<>> s, y;
+    std::vector<double> rho;
+    size_t first = 0;       // oldest pair in the ring buffer
+    std::vector<double> alpha(params.memory);
+
+    Vector<> g(n), gtrial(n), d(n), xtrial(n);
+    double f = energy (x, g);
+    double tol = params.tol * std::max(1.0, L2Norm(g));
+
+    for (int k = 0; k < params.maxsteps; k++)
+      {
+        if (L2Norm(g) <= tol) return k;
+
+        // d = -H g by the two-loop recursion
+        d = -1.0 * g;
+        size_t m = s.size();
+        for (size_t j = m; j-- > 0; )
+          {
+            size_t i = (first+j) % m;
+            alpha[j] = rho[i] * dot(s[i], d);
+            d -= alpha[j] * y[i];
+          }
+        if (m > 0)
+          {
+            size_t last = (first+m-1) % m;
+            d *= dot(s[last], y[last]) / dot(y[last], y[last]);
+          }
+        else
+          d *= 1.0 / std::max(1.0, L2Norm(g));
+        for (size_t j = 0; j < m; j++)
+          {
+            size_t i = (first+j) % m;
+            double beta = rho[i] * dot(y[i], d);
+            d += (alpha[j]-beta) * s[i];
+          }
+
+        double slope = dot(g, d);
+        if (slope >= 0)
+          {
+            // lost descent by roundoff: restart with steepest descent
+            s.clear(); y.clear(); rho.clear(); first = 0;
+            d = (-1.0 / std::max(1.0, L2Norm(g))) * g;
+            slope = dot(g, d);
+          }
+
+        double step = 1;
+        double ftrial;
+        while (true)
+          {
+            xtrial = x + step*d;
+            ftrial = energy (xtrial, gtrial);
+            if (ftrial <= f + c*step*slope) break;
+            if (step < 1e-12)
+              throw std::domain_error("L-BFGS line search failed");
+            // minimizer of the quadratic through f(0), f'(0) and f(step)
+            double stepq = -slope*step*step / (2*(ftrial - f - slope*step));
+            step = std::max(0.1*step, std::min(0.5*step, stepq));
+          }
+
+        Vector<> snew(n), ynew(n);
+        snew = step*d;
+        ynew = gtrial - g;
+        double sy = dot(snew, ynew);
+        if (sy > 1e-12 * L2Norm(snew) * L2Norm(ynew))
+          {
+            if (int(s.size()) < params.memory)
+              {
+                s.push_back (snew);
+                y.push_back (ynew);
+                rho.push_back (1/sy);
+              }
+            else
+              {
+                s[first] = snew;
+                y[first] = ynew;
+                rho[first] = 1/sy;
+                first = (first+1) % s.size();
+              }
+          }
+        x = xtrial;
+        g = gtrial;
+        f = ftrial;
+      }
+    throw std::domain_error("L-BFGS did not converge");
+  }
+
+}
+
+#endif
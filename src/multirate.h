@@ -0,0 +1,156 @@
+#ifndef MULTIRATE_H
+#define MULTIRATE_H
+
+#include <vector>
+#include <algorithm>
+
+#include "ode.h"
+
+namespace Neo_ODE
+{
+
+  // Multirate implicit Euler for dy/dt = f(y) with the components split
+  // into a fast and a slow group: fast(y) is the derivative of
+  // y(fastindices), slow(y) the one of y(slowindices), both depend on the
+  // whole state. A macro step of size h first advances the slow group
+  // with the fast group frozen, then the fast group in 'substeps' steps of
+  // size h/substeps with the slow group interpolated linearly (slowest
+  // first). The slow rhs is evaluated only in the macro steps.
+  class MultirateIntegrator : public FirstOrderIntegrator
+  {
+    shared_ptr<NonlinearFunction> fast, slow;
+    std::vector<size_t> fastindices, slowindices;
+    int substeps;
+
+    shared_ptr<ScatterFunction> fastscatter, slowscatter;
+    shared_ptr<ConstantFunction> fastold, slowold;
+    shared_ptr<IdentityFunction> fastnew, slownew;
+    StepEquations<std::function<shared_ptr<NonlinearFunction>(double)>> fastequs;
+    NewtonWorkspace fastnewton, slownewton;
+    double lastfasth = 0, lastslowh = 0;
+    Vector<> yfast, yslow, yslowold, base;
+
+    static shared_ptr<NonlinearFunction> FullRhs (shared_ptr<NonlinearFunction> fast,
+                                                  shared_ptr<NonlinearFunction> slow,
+                                                  std::vector<size_t> fastindices,
+                                                  std::vector<size_t> slowindices)
+    {
+      size_t n = fast->DimX();
+      return Compose(make_shared<ScatterFunction>(fastindices, n), fast)
+        + Compose(make_shared<ScatterFunction>(slowindices, n), slow);
+    }
+
+    // the equation of the slow group for the macro step h
+    shared_ptr<NonlinearFunction> BuildEquation (double h) override
+    {
+      return slownew - slowold - h * Compose(slow, slowscatter);
+    }
+    
+    shared_ptr<NonlinearFunction> BuildFastEquation (double h)
+    {
+      return fastnew - fastold - h * Compose(fast, fastscatter);
+    }
+
+    void SolveGroup (NewtonWorkspace & ws, double & lasth, shared_ptr<NonlinearFunction> equ,
+                     VectorView<double> u, double h)
+    {
+      if (h != lasth) ws.InvalidateJacobian();
+      lasth = h;
+      if (wrapequation) equ = wrapequation(equ);
+      ws.Solve (equ, u, params.mode, params.tol, params.maxsteps,
+                [this](int, double, VectorView<double>) { stats.newtonits++; },
+                params.reusejacobian);
+    }
+    
+    void DoStep (double h) override
+    {
+      // slow group, with the fast group at the old values
+      for (size_t i = 0; i < slowindices.size(); i++)
+        yslowold(i) = y(slowindices[i]);
+      yslow = yslowold;
+      slowold->Set (yslowold);
+      slowscatter->SetBase (y);
+      SolveGroup (slownewton, lastslowh, equs(h), yslow, h);
+
+      // fast group in substeps, with the slow group interpolated
+      base = y;
+      for (size_t i = 0; i < fastindices.size(); i++)
+        yfast(i) = y(fastindices[i]);
+      double hf = h/substeps;
+      auto fastequ = fastequs(hf);
+      for (int k = 1; k <= substeps; k++)
+        {
+          double theta = double(k)/substeps;
+          for (size_t i = 0; i < slowindices.size(); i++)
+            base(slowindices[i]) = (1-theta)*yslowold(i) + theta*yslow(i);
+          fastscatter->SetBase (base);
+          fastold->Set (yfast);
+          SolveGroup (fastnewton, lastfasth, fastequ, yfast, hf);
+        }
+
+      for (size_t i = 0; i < fastindices.size(); i++)
+        y(fastindices[i]) = yfast(i);
+      for (size_t i = 0; i < slowindices.size(); i++)
+        y(slowindices[i]) = yslow(i);
+      yold->Set(y);
+    }
+    
+  public:
+    MultirateIntegrator (shared_ptr<NonlinearFunction> _fast, std::vector<size_t> _fastindices,
+                         shared_ptr<NonlinearFunction> _slow, std::vector<size_t> _slowindices,
+                         double _dt, int _substeps,
+                         NewtonParameters _params = NewtonParameters())
+      : FirstOrderIntegrator(FullRhs(_fast, _slow, _fastindices, _slowindices), _dt, _params),
+        fast(_fast), slow(_slow), fastindices(_fastindices), slowindices(_slowindices),
+        substeps(_substeps),
+        fastequs([this](double h) { return BuildFastEquation(h); }),
+        fastnewton(_fastindices.size(), _fastindices.size()),
+        slownewton(_slowindices.size(), _slowindices.size()),
+        yfast(_fastindices.size()), yslow(_slowindices.size()),
+        yslowold(_slowindices.size()), base(_fast->DimX())
+    {
+      size_t n = _fast->DimX();
+      std::vector<int> count(n, 0);
+      for (size_t i : fastindices) if (i < n) count[i]++;
+      for (size_t i : slowindices) if (i < n) count[i]++;
+      if (_slow->DimX() != n || _fast->DimF() != fastindices.size() || _slow->DimF() != slowindices.size()
+          || std::any_of (count.begin(), count.end(), [](int c) { return c != 1; }))
+        throw std::invalid_argument("fast and slow indices must partition the state");
+      if (substeps < 1)
+        throw std::invalid_argument("multirate needs at least one substep");
+
+      fastscatter = make_shared<ScatterFunction>(fastindices, n);
+      slowscatter = make_shared<ScatterFunction>(slowindices, n);
+      yfast = 0.0;
+      yslow = 0.0;
+      fastold = make_shared<ConstantFunction>(yfast);
+      slowold = make_shared<ConstantFunction>(yslow);
+      fastnew = make_shared<IdentityFunction>(fastindices.size());
+      slownew = make_shared<IdentityFunction>(slowindices.size());
+      if (params.mixedprecision)
+        {
+          fastnewton.SetMixedPrecision (true);
+          slownewton.SetMixedPrecision (true);
+        }
+    }
+
+    int Substeps() const { return substeps; }
+  };
+
+
+  // multirate implicit Euler, see MultirateIntegrator
+  inline void SolveODE_Multirate (double tend, int steps, int substeps, VectorView<double> y,
+                                  shared_ptr<NonlinearFunction> fast, std::vector<size_t> fastindices,
+                                  shared_ptr<NonlinearFunction> slow, std::vector<size_t> slowindices,
+                                  std::function<void(double,VectorView<double>)> callback = nullptr,
+                                  NewtonParameters params = NewtonParameters())
+  {
+    MultirateIntegrator integrator(fast, fastindices, slow, slowindices, tend/steps, substeps, params);
+    integrator.SetState (0, y);
+    integrator.Advance (tend, callback);
+    y = integrator.Y();
+  }
+  
+}
+
+#endif
@@ -0,0 +1,30 @@
+// The neo_ode library: the double precision function trees, Newton
+// workspaces and factorizations are instantiated once here. Targets linking
+// neo_ode see them as extern templates (NEO_ODE_EXTERN_TEMPLATES), the
+// headers alone remain usable without the library.
+
+#include <nonlinfunc.h>
+#include <banded.h>
+#include <Newton.h>
+#include <ode.h>
+#include <taskgraph.h>
+
+namespace Neo_ODE
+{
+  template class IdentityFunctionT<double>;
+  template class ConstantFunctionT<double>;
+  template class SumFunctionT<double>;
+  template class ScaleFunctionT<double>;
+  template class ComposeFunctionT<double>;
+  template class StackFunctionT<double>;
+  template class ProjectorT<double>;
+  template class ScatterFunctionT<double>;
+
+  template class BandedLU<double>;
+  template class BandedLU<float>;
+  template class DenseLU<double>;
+  template class DenseLU<float>;
+
+  template class NewtonWorkspaceT<double>;
+  template class FunctionGraphT<double>;
+}
@@ -3,9 +3,11 @@
 
 #include <memory>
 #include <functional>
+#include <vector>
 
 #include <vector.h>
 #include <matrix.h>
+#include "simd.h"
 
 
 namespace Neo_ODE
@@ -15,181 +17,365 @@ namespace Neo_ODE
   using std::shared_ptr;
   using std::make_shared;
 
-  class NonlinearFunction
+  // Functions f: R^DimX -> R^DimF with Jacobian, for the scalar type T.
+  // The combinators build expression trees of them.
+  template <typename T> class FunctionGraphT;
+  
+  template <typename T>
+  class NonlinearFunctionT
   {
   public:
-    virtual ~NonlinearFunction() = default;
+    using scalar_type = T;
+    virtual ~NonlinearFunctionT() = default;
     virtual size_t DimX() const = 0;
     virtual size_t DimF() const = 0;
-    virtual void Evaluate (VectorView<double> x, VectorView<double> f) const = 0;
-    virtual void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const = 0;
+    virtual void Evaluate (VectorView<T> x, VectorView<T> f) const = 0;
+    virtual void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const = 0;
+
+    // true if the value does not depend on x, e.g. rhs(xold) in a residual
+    virtual bool IsConstant() const { return false; }
+    // changes whenever the value of a constant function changes
+    virtual size_t Version() const { return 0; }
+    // true if the Jacobian is a column of blocks facs[k] * I of size DimX,
+    // as for the affine functions of the new values in the integrators,
+    // e.g. xold + h*anew or Stack(xnew, vnew). Composition then needs no
+    // matrix product.
+    virtual bool IdentityBlocks (std::vector<T> & facs) const { return false; }
   };
 
 
-  class IdentityFunction : public NonlinearFunction
+  template <typename T>
+  class IdentityFunctionT : public NonlinearFunctionT<T>
   {
     size_t n;
   public:
-    IdentityFunction (size_t _n) : n(_n) { } 
+    IdentityFunctionT (size_t _n) : n(_n) { } 
     size_t DimX() const override { return n; }
     size_t DimF() const override { return n; }
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
       f = x;
     }
     
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
     {
       df = 0.0;
       df.Diag() = 1.0;
     }
+    bool IdentityBlocks (std::vector<T> & facs) const override
+    {
+      facs.assign (1, T(1));
+      return true;
+    }
   };
 
 
 
-  class ConstantFunction : public NonlinearFunction
+  template <typename T>
+  class ConstantFunctionT : public NonlinearFunctionT<T>
   {
-    Vector<> val;
+    Vector<T> val;
+    size_t version = 1;
   public:
-    ConstantFunction (VectorView<double> _val) : val(_val) { }
-    ConstantFunction (double _val, int dim = 1) : val(dim) { val = _val; }
-    void Set(VectorView<double> _val) { val = _val; }
-    VectorView<double> Get() const { return val.View(); }
+    ConstantFunctionT (VectorView<T> _val) : val(_val) { }
+    ConstantFunctionT (T _val, int dim = 1) : val(dim) { val = _val; }
+    void Set(VectorView<T> _val) { val = _val; version++; }
+    VectorView<T> Get() const { return val.View(); }
     size_t DimX() const override { return val.Size(); }
     size_t DimF() const override { return val.Size(); }
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
       f = val;
     }
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
     {
       df = 0.0;
     }
+    bool IsConstant() const override { return true; }
+    size_t Version() const override { return version; }
+    bool IdentityBlocks (std::vector<T> & facs) const override
+    {
+      facs.assign (1, T(0));
+      return true;
+    }
   };
 
   
   
-  class SumFunction : public NonlinearFunction
+  template <typename T>
+  class SumFunctionT : public NonlinearFunctionT<T>
   {
-    shared_ptr<NonlinearFunction> fa, fb;
-    double faca, facb;
+    shared_ptr<NonlinearFunctionT<T>> fa, fb;
+    T faca, facb;
+    friend class FunctionGraphT<T>;
   public:
-    SumFunction (shared_ptr<NonlinearFunction> _fa,
-                 shared_ptr<NonlinearFunction> _fb,
-                 double _faca, double _facb)
+    SumFunctionT (shared_ptr<NonlinearFunctionT<T>> _fa,
+                  shared_ptr<NonlinearFunctionT<T>> _fb,
+                  T _faca, T _facb)
       : fa(_fa), fb(_fb), faca(_faca), facb(_facb) { } 
     
     size_t DimX() const override { return fa->DimX(); }
     size_t DimF() const override { return fa->DimF(); }
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
       fa->Evaluate(x, f);
-      f *= faca;
-      Vector<> tmp(DimF());
+      Vector<T> tmp(DimF());
       fb->Evaluate(x, tmp);
-      f += facb*tmp;
+      // the SIMD kernel needs contiguous f, e.g. not a column of a matrix
+      if (f.Dist() == 1)
+        simd::LinComb (DimF(), faca, f.Data(), facb, tmp.Data(), f.Data());
+      else
+        {
+          f *= faca;
+          f += facb*tmp;
+        }
     }
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
     {
-      fa->EvaluateDeriv(x, df);
-      Matrix<> tmp(DimF(), DimX());
-      tmp *= faca;
+      // constant terms do not contribute
+      if (fa->IsConstant())
+        df = 0.0;
+      else
+        fa->EvaluateDeriv(x, df);
+      if (fb->IsConstant())
+        {
+          df *= faca;
+          return;
+        }
+      Matrix<T> tmp(DimF(), DimX());
       fb->EvaluateDeriv(x, tmp);
-      df += facb*tmp;
+      for (size_t i = 0; i < DimF(); i++)
+        simd::LinComb (DimX(), faca, &df(i,0), facb, &tmp(i,0), &df(i,0));
+    }
+    bool IsConstant() const override { return fa->IsConstant() && fb->IsConstant(); }
+    size_t Version() const override { return fa->Version() + fb->Version(); }
+    bool IdentityBlocks (std::vector<T> & facs) const override
+    {
+      std::vector<T> facsb;
+      if (!fa->IdentityBlocks(facs) || !fb->IdentityBlocks(facsb) || facs.size() != facsb.size())
+        return false;
+      for (size_t k = 0; k < facs.size(); k++)
+        facs[k] = faca*facs[k] + facb*facsb[k];
+      return true;
     }
   };
 
 
-  inline auto operator- (shared_ptr<NonlinearFunction> fa, shared_ptr<NonlinearFunction> fb)
+  // The combinators accept any function types, the scalar type is taken
+  // from the first one.
+  template <typename FA, typename FB, typename T = typename FA::scalar_type>
+  inline auto operator- (shared_ptr<FA> fa, shared_ptr<FB> fb)
   {
-    return make_shared<SumFunction>(fa, fb, 1, -1);
+    return make_shared<SumFunctionT<T>>(fa, fb, 1, -1);
   }
 
-  inline auto operator+ (shared_ptr<NonlinearFunction> fa, shared_ptr<NonlinearFunction> fb)
+  template <typename FA, typename FB, typename T = typename FA::scalar_type>
+  inline auto operator+ (shared_ptr<FA> fa, shared_ptr<FB> fb)
   {
-    return make_shared<SumFunction>(fa, fb, 1, 1);
+    return make_shared<SumFunctionT<T>>(fa, fb, 1, 1);
   }
 
   
-  class ScaleFunction : public NonlinearFunction
+  template <typename T>
+  class ScaleFunctionT : public NonlinearFunctionT<T>
   {
-    shared_ptr<NonlinearFunction> fa;
-    double fac;
+    shared_ptr<NonlinearFunctionT<T>> fa;
+    T fac;
+    friend class FunctionGraphT<T>;
   public:
-    ScaleFunction (shared_ptr<NonlinearFunction> _fa,
-                   double _fac)
+    ScaleFunctionT (shared_ptr<NonlinearFunctionT<T>> _fa,
+                    T _fac)
       : fa(_fa), fac(_fac) { } 
     
     size_t DimX() const override { return fa->DimX(); }
     size_t DimF() const override { return fa->DimF(); }
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
       fa->Evaluate(x, f);
       f *= fac;
 
     }
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
     {
       fa->EvaluateDeriv(x, df);
       df *= fac;
     }
+    bool IsConstant() const override { return fa->IsConstant(); }
+    size_t Version() const override { return fa->Version(); }
+    bool IdentityBlocks (std::vector<T> & facs) const override
+    {
+      if (!fa->IdentityBlocks(facs)) return false;
+      for (auto & f : facs) f *= fac;
+      return true;
+    }
   };
 
-  inline auto operator* (double a, shared_ptr<NonlinearFunction> f)
+  template <typename F, typename T = typename F::scalar_type>
+  inline auto operator* (double a, shared_ptr<F> f)
   {
-    return make_shared<ScaleFunction>(f, a);
+    return make_shared<ScaleFunctionT<T>>(f, T(a));
   }
 
 
 
 
-  // fa(fb)
-  class ComposeFunction : public NonlinearFunction
+  // fa(fb). A constant composition, e.g. rhs(xold), is evaluated once
+  // per change of its constants and then taken from the cache.
+  template <typename T>
+  class ComposeFunctionT : public NonlinearFunctionT<T>
   {
-    shared_ptr<NonlinearFunction> fa, fb;
+    shared_ptr<NonlinearFunctionT<T>> fa, fb;
+    bool constant;
+    mutable Vector<T> cache;
+    mutable size_t cacheversion = size_t(-1);
+    friend class FunctionGraphT<T>;
   public:
-    ComposeFunction (shared_ptr<NonlinearFunction> _fa,
-                     shared_ptr<NonlinearFunction> _fb)
-      : fa(_fa), fb(_fb) { } 
+    ComposeFunctionT (shared_ptr<NonlinearFunctionT<T>> _fa,
+                      shared_ptr<NonlinearFunctionT<T>> _fb)
+      : fa(_fa), fb(_fb), constant(_fa->IsConstant() || _fb->IsConstant()),
+        cache(constant ? _fa->DimF() : 0) { } 
     
     size_t DimX() const override { return fb->DimX(); }
     size_t DimF() const override { return fa->DimF(); }
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
-      Vector<> tmp(fb->DimF());
+      if (constant && cacheversion == Version())
+        {
+          f = cache;
+          return;
+        }
+      Vector<T> tmp(fb->DimF());
       fb->Evaluate (x, tmp);
       fa->Evaluate (tmp, f);
+      if (constant)
+        {
+          cache = f;
+          cacheversion = Version();
+        }
     }
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
     {
-      Vector<> tmp(fb->DimF());
+      if (constant)
+        {
+          df = 0.0;
+          return;
+        }
+      Vector<T> tmp(fb->DimF());
       fb->Evaluate (x, tmp);
       
-      Matrix<> jaca(fa->DimF(), fa->DimX());
-      Matrix<> jacb(fb->DimF(), fb->DimX());
+      // fb = (facs[0] x, facs[1] x, ...) + const, as rhs(xnew) in the
+      // residuals: df is a combination of the column blocks of dfa
+      std::vector<T> facs;
+      if (fb->IdentityBlocks (facs))
+        {
+          if (facs.size() == 1)
+            {
+              fa->EvaluateDeriv(tmp, df);
+              df *= facs[0];
+              return;
+            }
+          Matrix<T> jaca(fa->DimF(), fa->DimX());
+          fa->EvaluateDeriv(tmp, jaca);
+          size_t n = DimX();
+          df = 0.0;
+          for (size_t k = 0; k < facs.size(); k++)
+            for (size_t i = 0; i < DimF(); i++)
+              simd::LinComb (n, T(1), &df(i,0), facs[k], &jaca(i,k*n), &df(i,0));
+          return;
+        }
+
+      Matrix<T> jaca(fa->DimF(), fa->DimX());
+      Matrix<T> jacb(fb->DimF(), fb->DimX());
       
       fb->EvaluateDeriv(x, jacb);
       fa->EvaluateDeriv(tmp, jaca);
 
       df = jaca*jacb;
     }
+    bool IsConstant() const override { return constant; }
+    size_t Version() const override { return fa->Version() + fb->Version(); }
+    bool IdentityBlocks (std::vector<T> & facs) const override
+    {
+      if (constant)
+        {
+          if (DimF() % DimX() != 0) return false;
+          facs.assign (DimF()/DimX(), T(0));
+          return true;
+        }
+      // fa = fac*I
+      std::vector<T> facsa;
+      if (!fa->IdentityBlocks(facsa) || facsa.size() != 1 || !fb->IdentityBlocks(facs))
+        return false;
+      for (auto & f : facs) f *= facsa[0];
+      return true;
+    }
   };
   
   
-  inline auto Compose (shared_ptr<NonlinearFunction> fa, shared_ptr<NonlinearFunction> fb)
+  template <typename FA, typename FB, typename T = typename FA::scalar_type>
+  inline auto Compose (shared_ptr<FA> fa, shared_ptr<FB> fb)
   {
-    return make_shared<ComposeFunction> (fa, fb);
+    return make_shared<ComposeFunctionT<T>> (fa, fb);
+  }
+
+
+  // (fa(x), fb(x)), e.g. the input (x, v) of a velocity dependent force
+  template <typename T>
+  class StackFunctionT : public NonlinearFunctionT<T>
+  {
+    shared_ptr<NonlinearFunctionT<T>> fa, fb;
+    friend class FunctionGraphT<T>;
+  public:
+    StackFunctionT (shared_ptr<NonlinearFunctionT<T>> _fa,
+                    shared_ptr<NonlinearFunctionT<T>> _fb)
+      : fa(_fa), fb(_fb) { }
+
+    size_t DimX() const override { return fa->DimX(); }
+    size_t DimF() const override { return fa->DimF()+fb->DimF(); }
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
+    {
+      fa->Evaluate (x, f.Range(0, fa->DimF()));
+      fb->Evaluate (x, f.Range(fa->DimF(), DimF()));
+    }
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
+    {
+      Matrix<T> jaca(fa->DimF(), fa->DimX());
+      Matrix<T> jacb(fb->DimF(), fb->DimX());
+      fa->EvaluateDeriv(x, jaca);
+      fb->EvaluateDeriv(x, jacb);
+      for (size_t i = 0; i < fa->DimF(); i++)
+        df.Row(i) = jaca.Row(i);
+      for (size_t i = 0; i < fb->DimF(); i++)
+        df.Row(fa->DimF()+i) = jacb.Row(i);
+    }
+    bool IsConstant() const override { return fa->IsConstant() && fb->IsConstant(); }
+    size_t Version() const override { return fa->Version() + fb->Version(); }
+    bool IdentityBlocks (std::vector<T> & facs) const override
+    {
+      std::vector<T> facsb;
+      if (!fa->IdentityBlocks(facs) || !fb->IdentityBlocks(facsb))
+        return false;
+      facs.insert (facs.end(), facsb.begin(), facsb.end());
+      return true;
+    }
+  };
+
+  template <typename FA, typename FB, typename T = typename FA::scalar_type>
+  inline auto Stack (shared_ptr<FA> fa, shared_ptr<FB> fb)
+  {
+    return make_shared<StackFunctionT<T>> (fa, fb);
   }
   
-  class EmbedFunction : public NonlinearFunction
+  template <typename T>
+  class EmbedFunctionT : public NonlinearFunctionT<T>
   {
-    shared_ptr<NonlinearFunction> fa;
+    shared_ptr<NonlinearFunctionT<T>> fa;
     size_t firstx, dimx, firstf, dimf;
     size_t nextx, nextf;
   public:
-    EmbedFunction (shared_ptr<NonlinearFunction> _fa,
-                   size_t _firstx, size_t _dimx,
-                   size_t _firstf, size_t _dimf)
+    EmbedFunctionT (shared_ptr<NonlinearFunctionT<T>> _fa,
+                    size_t _firstx, size_t _dimx,
+                    size_t _firstf, size_t _dimf)
       : fa(_fa),
         firstx(_firstx), dimx(_dimx), firstf(_firstf), dimf(_dimf),
         nextx(_firstx+_fa->DimX()), nextf(_firstf+_fa->DimF())
@@ -197,12 +383,12 @@ namespace Neo_ODE
     
     size_t DimX() const override { return dimx; }
     size_t DimF() const override { return dimf; }
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
       f = 0.0;
       fa->Evaluate(x.Range(firstx, nextx), f.Range(firstf, nextf));
     }
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
     {
       df = 0;
       fa->EvaluateDeriv(x.Range(firstx, nextx),
@@ -211,22 +397,23 @@ namespace Neo_ODE
   };
 
   
-  class Projector : public NonlinearFunction
+  template <typename T>
+  class ProjectorT : public NonlinearFunctionT<T>
   {
     size_t size, first, next;
   public:
-    Projector (size_t _size, 
-               size_t _first, size_t _next)
+    ProjectorT (size_t _size, 
+                size_t _first, size_t _next)
       : size(_size), first(_first), next(_next) { }
     
     size_t DimX() const override { return size; }
     size_t DimF() const override { return size; }
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
       f = 0.0;
       f.Range(first, next) = x.Range(first, next);
     }
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
     {
       df = 0.0;
       df.Diag().Range(first, next) = 1;
@@ -235,27 +422,28 @@ namespace Neo_ODE
 
 
   // broadcasts n-dimensional input to n*s-dimensional output
-  class BlockFunction : public NonlinearFunction
+  template <typename T>
+  class BlockFunctionT : public NonlinearFunctionT<T>
   {
-    shared_ptr<NonlinearFunction> comp_;
+    shared_ptr<NonlinearFunctionT<T>> comp_;
     size_t size_;
     size_t cdimx;
     size_t cdimf;
     
    public:
-    BlockFunction(shared_ptr<NonlinearFunction> component, size_t size)
+    BlockFunctionT (shared_ptr<NonlinearFunctionT<T>> component, size_t size)
       : comp_(component), size_(size), cdimx(comp_->DimX()), cdimf(comp_->DimF()) {}
 
     size_t DimX() const override {return cdimx;}
     size_t DimF() const override {return size_*cdimf;}
 
-    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
     {
       for (size_t j=0; j < size_; j++){
         comp_->Evaluate(x, f.Range(j*(cdimf), (j + 1)*(cdimf)));
       }
     }
-    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df)
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df)
     {
       comp_->EvaluateDeriv(x, df.Cols(0, cdimx));
       for (size_t j=1; j < size_; j++){
@@ -265,6 +453,111 @@ namespace Neo_ODE
   };
 
 
+  // x -> y with y(indices[i]) = x(i), the other components of y are taken
+  // from a base vector. Selects the unknowns of a partition of the state.
+  template <typename T>
+  class ScatterFunctionT : public NonlinearFunctionT<T>
+  {
+    std::vector<size_t> indices;
+    Vector<T> base;
+  public:
+    ScatterFunctionT (std::vector<size_t> _indices, size_t n)
+      : indices(_indices), base(n) { base = 0.0; }
+
+    void SetBase (VectorView<T> _base) { base = _base; }
+    size_t DimX() const override { return indices.size(); }
+    size_t DimF() const override { return base.Size(); }
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
+    {
+      f = base;
+      for (size_t i = 0; i < indices.size(); i++)
+        f(indices[i]) = x(i);
+    }
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
+    {
+      df = 0.0;
+      for (size_t i = 0; i < indices.size(); i++)
+        df(indices[i], i) = 1;
+    }
+  };
+
+  
+  // the double precision functions used throughout
+  using NonlinearFunction = NonlinearFunctionT<double>;
+  using IdentityFunction = IdentityFunctionT<double>;
+  using ConstantFunction = ConstantFunctionT<double>;
+  using SumFunction = SumFunctionT<double>;
+  using ScaleFunction = ScaleFunctionT<double>;
+  using ComposeFunction = ComposeFunctionT<double>;
+  using StackFunction = StackFunctionT<double>;
+  using EmbedFunction = EmbedFunctionT<double>;
+  using Projector = ProjectorT<double>;
+  using BlockFunction = BlockFunctionT<double>;
+  using ScatterFunction = ScatterFunctionT<double>;
+
+#ifdef NEO_ODE_EXTERN_TEMPLATES
+  // instantiated once in the neo_ode library (neo_ode.cc)
+  extern template class IdentityFunctionT<double>;
+  extern template class ConstantFunctionT<double>;
+  extern template class SumFunctionT<double>;
+  extern template class ScaleFunctionT<double>;
+  extern template class ComposeFunctionT<double>;
+  extern template class StackFunctionT<double>;
+  extern template class ProjectorT<double>;
+  extern template class ScatterFunctionT<double>;
+#endif
+
+
+  // a function f(x; p) of model parameters p, e.g. stiffnesses and masses,
+  // which also provides the derivative df/dp, of size DimF x NumParameters
+  class ParametricFunction : public NonlinearFunction
+  {
+  public:
+    virtual size_t NumParameters() const = 0;
+    virtual void EvaluateParameterDeriv (VectorView<double> x, MatrixView<double> dfdp) const = 0;
+  };
+
+
+  // the same function g of dim-dimensional states applied to 'members'
+  // states at once, f(x_1, ..., x_m) = (g(x_1), ..., g(x_m)), e.g. the
+  // members of an ensemble integrated as one system. Implementations see
+  // all members in one call, one member per row, which amortizes the call
+  // overhead of interpreted functions. The Jacobian is block diagonal,
+  // Newton factors it in its band.
+  class BatchFunction : public NonlinearFunction
+  {
+  protected:
+    size_t members, dim;
+  public:
+    BatchFunction (size_t _members, size_t _dim)
+      : members(_members), dim(_dim) { }
+
+    size_t Members() const { return members; }
+    size_t Dim() const { return dim; }
+    size_t DimX() const override { return members*dim; }
+    size_t DimF() const override { return members*dim; }
+
+    virtual void EvaluateBatch (MatrixView<double> x, MatrixView<double> f) const = 0;
+    // row i of df is the Jacobian dg/dx(x_i), dim x dim in row major order
+    virtual void EvaluateDerivBatch (MatrixView<double> x, MatrixView<double> df) const = 0;
+
+    void Evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      EvaluateBatch (x.AsMatrix(members, dim), f.AsMatrix(members, dim));
+    }
+    void EvaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      Matrix<double> blocks(members, dim*dim);
+      EvaluateDerivBatch (x.AsMatrix(members, dim), blocks);
+      df = 0.0;
+      for (size_t i = 0; i < members; i++)
+        for (size_t k = 0; k < dim; k++)
+          for (size_t l = 0; l < dim; l++)
+            df(i*dim+k, i*dim+l) = blocks(i, k*dim+l);
+    }
+  };
+
+
   /*  
   class BlockMatVec : public NonlinearFunction
   {
@@ -3,69 +3,562 @@
 
 #include <functional>
 #include <exception>
+#include <stdexcept>
 #include <memory>
+#include <vector>
+#include <type_traits>
+#include <tuple>
+#include <cstdint>
+#include <iostream>
+#include <cmath>
 
 #include "Newton.h"
 
 
 namespace Neo_ODE
 {
+
+  // the residual trees of an implicit method depend on the step size.
+  // StepEquations builds them on demand for the nominal step size and the
+  // reduced step sizes needed after a rejected step or at the end of an
+  // Advance, and keeps the nominal one plus a few recent ones for reuse
+  template <typename TBUILD>
+  class StepEquations
+  {
+    TBUILD build;
+    std::vector<std::pair<double, std::invoke_result_t<TBUILD,double>>> equs;
+    static constexpr size_t maxentries = 8;
+  public:
+    StepEquations (TBUILD _build) : build(_build) { }
+    auto operator() (double h)
+    {
+      for (auto & [hi, equ] : equs)
+        if (hi == h) return equ;
+      if (equs.size() == maxentries)
+        equs.erase(equs.begin()+1);
+      equs.emplace_back(h, build(h));
+      return equs.back().second;
+    }
+    void Clear () { equs.clear(); }
+  };
+
+  // performs a time step of size h by calling step(h). If the Newton solver fails,
+  // restore() resets the unknown to the beginning of the step, and the step
+  // is repeated as two steps of size h/2, at most maxhalvings times
+  inline void StepWithRejection (double h, int maxhalvings,
+                                 const std::function<void(double)> & step,
+                                 const std::function<void()> & restore)
+  {
+    try
+      {
+        step(h);
+      }
+    catch (std::domain_error & e)
+      {
+        if (maxhalvings <= 0) throw;
+        restore();
+        StepWithRejection (h/2, maxhalvings-1, step, restore);
+        StepWithRejection (h/2, maxhalvings-1, step, restore);
+      }
+  }
+
+
+  // raw binary i/o of solver states, native endianness
+  template <typename T>
+  void WriteBinary (std::ostream & ost, const T & val)
+  {
+    ost.write (reinterpret_cast<const char*>(&val), sizeof(T));
+  }
+
+  template <typename T>
+  void ReadBinary (std::istream & ist, T & val)
+  {
+    ist.read (reinterpret_cast<char*>(&val), sizeof(T));
+    if (!ist) throw std::runtime_error("unexpected end of binary stream");
+  }
+
+  inline void WriteBinary (std::ostream & ost, const Vector<double> & vec)
+  {
+    ost.write (reinterpret_cast<const char*>(vec.Data()), vec.Size()*sizeof(double));
+  }
+
+  inline void ReadBinary (std::istream & ist, Vector<double> & vec)
+  {
+    ist.read (reinterpret_cast<char*>(vec.Data()), vec.Size()*sizeof(double));
+    if (!ist) throw std::runtime_error("unexpected end of binary stream");
+  }
+  
+
+  // statistics of a time integration, stored with the solver state
+  struct SolverStatistics
+  {
+    uint64_t steps = 0;       // accepted time steps
+    uint64_t newtonits = 0;   // Newton iterations, including those of rejected steps
+    uint64_t rejected = 0;    // steps which were repeated with halved step size
+  };
+
+
+  // cubic Hermite interpolation at time s in [t0, t1] from the values
+  // u0, u1 and the time derivatives du0, du1 at both ends
+  inline void HermiteInterpolate (double t0, double t1, double s,
+                                  VectorView<double> u0, VectorView<double> du0,
+                                  VectorView<double> u1, VectorView<double> du1,
+                                  VectorView<double> u)
+  {
+    double h = t1-t0;
+    double th = (s-t0)/h;
+    double h00 = (1+2*th)*(1-th)*(1-th);
+    double h10 = th*(1-th)*(1-th);
+    double h01 = th*th*(3-2*th);
+    double h11 = th*th*(th-1);
+    for (size_t i = 0; i < u.Size(); i++)
+      u(i) = h00*u0(i) + h*h10*du0(i) + h01*u1(i) + h*h11*du1(i);
+  }
+
+  
+  // Common part of the steppable implicit time integrators. An integrator
+  // keeps its residual trees, Newton workspace and state vectors alive
+  // between calls, such that many short Advance calls (e.g. in animation
+  // loops) cost no more than one long run. Time, step size, statistics and
+  // the method's history form its state, which can be saved and restored.
+  class TimeIntegrator
+  {
+  protected:
+    double t = 0;
+    double dt;
+    NewtonParameters params;
+    SolverStatistics stats;
+    NewtonWorkspace newton;
+    double lasth = 0;
+    bool denseoutput = false;
+    double tprev = 0;
+    // optional replacement of the residual trees, e.g. by a task graph evaluator
+    std::function<shared_ptr<NonlinearFunction>(shared_ptr<NonlinearFunction>)> wrapequation;
+
+    // one step of size h starting from the old-value constants
+    virtual void DoStep (double h) = 0;
+    // resets the Newton unknown to the beginning of a failed step
+    virtual void Restore () = 0;
+    virtual void SaveState (std::ostream & ost) const = 0;
+    virtual void LoadState (std::istream & ist) = 0;
+    // keep the data for interpolation at the beginning / end of a step
+    virtual void BeginDenseStep () = 0;
+    virtual void EndDenseStep () = 0;
+
+    void Solve (shared_ptr<NonlinearFunction> equ, VectorView<double> u, double h)
+    {
+      if (h != lasth) newton.InvalidateJacobian();
+      lasth = h;
+      if (wrapequation) equ = wrapequation(equ);
+      newton.Solve (equ, u, params.mode, params.tol, params.maxsteps,
+                    [this](int, double, VectorView<double>) { stats.newtonits++; },
+                    params.reusejacobian);
+    }
+    
+  public:
+    TimeIntegrator (size_t dim, double _dt, NewtonParameters _params)
+      : dt(_dt), params(_params), newton(dim, dim)
+    {
+      if (params.mixedprecision)
+        newton.SetMixedPrecision (true);
+      newton.SetBandwidth (params.bandwidth);
+    }
+    virtual ~TimeIntegrator() = default;
+    
+    TimeIntegrator (const TimeIntegrator &) = delete;
+    TimeIntegrator & operator= (const TimeIntegrator &) = delete;
+
+    double Time() const { return t; }
+    double TimeStep() const { return dt; }
+    void SetTimeStep (double _dt) { dt = _dt; }
+    const SolverStatistics & Statistics() const { return stats; }
+
+    // after a change of the right hand side, e.g. of its topology
+    void InvalidateJacobian () { newton.InvalidateJacobian(); }
+
+    // the wrapper is called with the residual tree before every Newton solve,
+    // and has to return a function of the same dimensions
+    void SetEquationWrapper (std::function<shared_ptr<NonlinearFunction>(shared_ptr<NonlinearFunction>)> wrap)
+    { wrapequation = wrap; }
+
+    // the solution handed to callbacks: y for first order, x for second order systems
+    virtual VectorView<double> Solution() const = 0;
+
+    // the complete state: y for first order, (x, v, a) for second order systems
+    virtual size_t StateSize() const = 0;
+    virtual void GetFullState (VectorView<double> u) const = 0;
+    virtual void SetFullState (double _t, VectorView<double> u) = 0;
+    // complete state at time s of the last step, needs dense output
+    virtual void InterpolateFullState (double s, VectorView<double> u) const = 0;
+    
+  protected:
+    virtual void DoInterpolate (double s, VectorView<double> u) const = 0;
+
+  public:
+
+    // one time step of size dt, repeated with halved steps if Newton fails
+    void Step () { Step (dt); }
+    
+    void Step (double h)
+    {
+      if (denseoutput) BeginDenseStep();
+      StepWithRejection (h, params.maxhalvings,
+                         [this](double hi) { DoStep(hi); },
+                         [this]() { Restore(); stats.rejected++; });
+      tprev = t;
+      t += h;
+      stats.steps++;
+      if (denseoutput) EndDenseStep();
+    }
+
+    // Dense output: the integrator keeps values and derivatives at both
+    // ends of the last step, and Interpolate evaluates the solution at any
+    // time s in [PreviousTime(), Time()] by cubic Hermite interpolation.
+    // For first order systems this costs one rhs evaluation per step.
+    void SetDenseOutput (bool enable) { denseoutput = enable; tprev = t; }
+    bool DenseOutput() const { return denseoutput; }
+    double PreviousTime() const { return tprev; }
+    
+    void Interpolate (double s, VectorView<double> u) const
+    {
+      if (!denseoutput)
+        throw std::logic_error("dense output is not enabled");
+      double eps = 1e-10*dt;
+      if (s < tprev-eps || s > t+eps)
+        throw std::invalid_argument("interpolation time outside the last step");
+      if (t == tprev)
+        u = Solution();
+      else
+        DoInterpolate (std::min(t, std::max(tprev, s)), u);
+    }
+
+    // integrates up to tend and writes the solution at the ascending output
+    // times (within the current time and tend) into the rows of out
+    void AdvanceDense (double tend, VectorView<double> times, MatrixView<> out)
+    {
+      if (out.height() != times.Size() || out.width() != Solution().Size())
+        throw std::invalid_argument("output matrix does not fit times and solution size");
+      bool wasdense = denseoutput;
+      SetDenseOutput (true);
+      size_t next = 0;
+      while (next < times.Size() && times(next) <= t)
+        out.Row(next++) = Solution();
+      Advance (tend, [&](double, VectorView<double>)
+      {
+        while (next < times.Size() && times(next) <= t + 1e-10*dt)
+          {
+            Interpolate (times(next), out.Row(next));
+            next++;
+          }
+      });
+      SetDenseOutput (wasdense);
+    }
+
+    // steps of size dt up to time tend, the last one shortened to end at tend
+    void Advance (double tend, std::function<void(double,VectorView<double>)> callback = nullptr)
+    {
+      while (tend - t > 1e-10*dt)
+        {
+          double h = std::min(dt, tend-t);
+          if (dt - h < 1e-8*dt) h = dt;
+          Step (h);
+          if (callback) callback(t, Solution());
+        }
+    }
+
+    void Save (std::ostream & ost) const
+    {
+      WriteBinary (ost, uint64_t(Solution().Size()));
+      WriteBinary (ost, t);
+      WriteBinary (ost, dt);
+      WriteBinary (ost, stats);
+      SaveState (ost);
+    }
+
+    void Load (std::istream & ist)
+    {
+      uint64_t n;
+      ReadBinary (ist, n);
+      if (n != Solution().Size())
+        throw std::invalid_argument("saved integrator state has wrong dimension");
+      ReadBinary (ist, t);
+      ReadBinary (ist, dt);
+      ReadBinary (ist, stats);
+      LoadState (ist);
+    }
+  };
+
+
+  
+  // one step implicit methods for dy/dt = rhs(y), the derived classes
+  // provide the residual tree of one step
+  class FirstOrderIntegrator : public TimeIntegrator
+  {
+  protected:
+    shared_ptr<NonlinearFunction> rhs;
+    Vector<> y;
+    shared_ptr<ConstantFunction> yold; // y_i
+    shared_ptr<IdentityFunction> ynew; // y_{i+1}
+    StepEquations<std::function<shared_ptr<NonlinearFunction>(double)>> equs;
+
+    // y and rhs(y) at both ends of the last step, for dense output
+    Vector<> yprev, fprev, f;
+    bool fvalid = false;
+
+    virtual shared_ptr<NonlinearFunction> BuildEquation (double h) = 0;
+    
+    void DoStep (double h) override
+    {
+      // solve equation
+      Solve (equs(h), y, h);
+      yold->Set(y);
+    }
+    void Restore () override { y = yold->Get(); }
+    void SaveState (std::ostream & ost) const override { WriteBinary (ost, y); }
+    void LoadState (std::istream & ist) override { ReadBinary (ist, y); SetState (t, y); }
+
+    void BeginDenseStep () override
+    {
+      if (!fvalid) rhs->Evaluate (y, f);
+      yprev = y;
+      fprev = f;
+    }
+    void EndDenseStep () override
+    {
+      rhs->Evaluate (y, f);
+      fvalid = true;
+    }
+    void DoInterpolate (double s, VectorView<double> u) const override
+    {
+      HermiteInterpolate (tprev, t, s, yprev, fprev, y, f, u);
+    }
+    
+  public:
+    FirstOrderIntegrator (shared_ptr<NonlinearFunction> _rhs, double _dt,
+                          NewtonParameters _params)
+      : TimeIntegrator(_rhs->DimX(), _dt, _params), rhs(_rhs), y(_rhs->DimX()),
+        equs([this](double h) { return BuildEquation(h); }),
+        yprev(_rhs->DimX()), fprev(_rhs->DimX()), f(_rhs->DimX())
+    {
+      y = 0.0;
+      yold = make_shared<ConstantFunction>(y);
+      ynew = make_shared<IdentityFunction>(y.Size());
+    }
+
+    VectorView<double> Solution() const override { return y.View(); }
+    VectorView<double> Y() const { return y.View(); }
+    
+    void SetState (double _t, VectorView<double> _y)
+    {
+      t = tprev = _t;
+      y = _y;
+      yold->Set(y);
+      fvalid = false;
+    }
+
+    size_t StateSize() const override { return y.Size(); }
+    void GetFullState (VectorView<double> u) const override { u = y; }
+    void SetFullState (double _t, VectorView<double> u) override { SetState (_t, u); }
+    void InterpolateFullState (double s, VectorView<double> u) const override
+    {
+      Interpolate (s, u);
+    }
+  };
+
   
   // implicit Euler method for dy/dt = rhs(y)
-  void SolveODE_IE(double tend, int steps,
-                   VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
-                   std::function<void(double,VectorView<double>)> callback = nullptr)
+  class ImplicitEulerIntegrator : public FirstOrderIntegrator
   {
-    double dt = tend/steps;
+    shared_ptr<NonlinearFunction> BuildEquation (double h) override
+    {
+      return ynew-yold - h * rhs;
+    }
+  public:
+    ImplicitEulerIntegrator (shared_ptr<NonlinearFunction> _rhs, double _dt,
+                             NewtonParameters _params = NewtonParameters())
+      : FirstOrderIntegrator(_rhs, _dt, _params) { }
+  };
 
-    auto yold = make_shared<ConstantFunction>(y);
-    auto ynew = make_shared<IdentityFunction>(y.Size());
-    auto equ = ynew-yold - dt * rhs;
+  
+  // Crank-Nicholson method for dy/dt = rhs(y)
+  class CrankNicolsonIntegrator : public FirstOrderIntegrator
+  {
+    shared_ptr<NonlinearFunction> BuildEquation (double h) override
+    {
+      return ynew-yold - (h/2) * (Compose(rhs, yold) + Compose(rhs, ynew));
+    }
+  public:
+    CrankNicolsonIntegrator (shared_ptr<NonlinearFunction> _rhs, double _dt,
+                             NewtonParameters _params = NewtonParameters())
+      : FirstOrderIntegrator(_rhs, _dt, _params) { }
+  };
+  
+  
+  // Butcher tableaux of an IMEX Runge-Kutta pair. The first stage is
+  // explicit, the implicit stages share the diagonal entry gamma, such that
+  // all Newton systems are y - h*gamma*stiff(y) = c with the same Jacobian.
+  struct IMEXTableau
+  {
+    std::vector<std::vector<double>> aex, aim;
+    std::vector<double> bex, bim;
 
-    double t = 0;
+    size_t Stages() const { return bex.size(); }
+    double Gamma() const { return aim.back().back(); }
+
+    // forward-backward Euler, first order
+    static IMEXTableau Euler ()
+    {
+      return { { { 0, 0 }, { 1, 0 } }, { { 0, 0 }, { 0, 1 } },
+               { 1, 0 }, { 0, 1 } };
+    }
+    
+    // ARS(2,2,2) of Ascher, Ruuth, Spiteri: second order, L-stable, stiffly accurate
+    static IMEXTableau ARS222 ()
+    {
+      double gamma = 1-1/std::sqrt(2.0);
+      double delta = 1-1/(2*gamma);
+      return { { { 0, 0, 0 }, { gamma, 0, 0 }, { delta, 1-delta, 0 } },
+               { { 0, 0, 0 }, { 0, gamma, 0 }, { 0, 1-gamma, gamma } },
+               { delta, 1-delta, 0 }, { 0, 1-gamma, gamma } };
+    }
+  };
+  
+  
+  // IMEX Runge-Kutta method for dy/dt = stiff(y) + nonstiff(y): nonstiff is
+  // integrated explicitly, Newton only sees the Jacobian of stiff
+  class IMEXIntegrator : public FirstOrderIntegrator
+  {
+    shared_ptr<NonlinearFunction> stiff, nonstiff;
+    IMEXTableau tableau;
+    shared_ptr<ConstantFunction> stagec;   // explicit part of a stage
+    std::vector<Vector<>> fs, fn;           // stiff and nonstiff stage values
+    Vector<> ystage, c;
+
+    shared_ptr<NonlinearFunction> BuildEquation (double h) override
+    {
+      return ynew - stagec - (h*tableau.Gamma()) * stiff;
+    }
+
+    void DoStep (double h) override
+    {
+      size_t s = tableau.Stages();
+      double gamma = tableau.Gamma();
+      ystage = y;
+      for (size_t i = 0; i < s; i++)
+        {
+          c = y;
+          for (size_t j = 0; j < i; j++)
+            {
+              if (tableau.aex[i][j] != 0) c += (h*tableau.aex[i][j]) * fn[j];
+              if (tableau.aim[i][j] != 0) c += (h*tableau.aim[i][j]) * fs[j];
+            }
+          
+          if (i == 0)
+            ystage = c;
+          else
+            {
+              stagec->Set (c);
+              Solve (equs(h), ystage, h);
+            }
+
+          nonstiff->Evaluate (ystage, fn[i]);
+          if (i == 0)
+            stiff->Evaluate (ystage, fs[i]);
+          else
+            {
+              // stiff(Y) from the stage equation, without another evaluation
+              fs[i] = ystage - c;
+              fs[i] *= 1/(h*gamma);
+            }
+        }
+
+      for (size_t j = 0; j < s; j++)
+        {
+          if (tableau.bex[j] != 0) y += (h*tableau.bex[j]) * fn[j];
+          if (tableau.bim[j] != 0) y += (h*tableau.bim[j]) * fs[j];
+        }
+      yold->Set(y);
+    }
+    
+  public:
+    IMEXIntegrator (shared_ptr<NonlinearFunction> _stiff,
+                    shared_ptr<NonlinearFunction> _nonstiff,
+                    double _dt, IMEXTableau _tableau = IMEXTableau::ARS222(),
+                    NewtonParameters _params = NewtonParameters())
+      : FirstOrderIntegrator(_stiff + _nonstiff, _dt, _params),
+        stiff(_stiff), nonstiff(_nonstiff), tableau(_tableau),
+        ystage(_stiff->DimX()), c(_stiff->DimX())
+    {
+      if (_stiff->DimX() != _nonstiff->DimX() || _stiff->DimF() != _nonstiff->DimF())
+        throw std::invalid_argument("stiff and nonstiff part differ in dimensions");
+      for (size_t i = 0; i < tableau.Stages(); i++)
+        {
+          if (tableau.aim[i][i] != (i == 0 ? 0 : tableau.Gamma()))
+            throw std::invalid_argument("IMEX tableau needs an explicit first stage and constant diagonal");
+          fs.emplace_back (_stiff->DimX());
+          fn.emplace_back (_stiff->DimX());
+        }
+      stagec = make_shared<ConstantFunction>(c);
+    }
+  };
+  
+  
+  // implicit Euler method for dy/dt = rhs(y)
+  inline void SolveODE_IE(double tend, int steps,
+                          VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
+                          std::function<void(double,VectorView<double>)> callback = nullptr,
+                          NewtonParameters params = NewtonParameters())
+  {
+    ImplicitEulerIntegrator integrator(rhs, tend/steps, params);
+    integrator.SetState (0, y);
 
     for (int i = 0; i < steps; i++)
       {
-        NewtonSolver (equ, y);
-        yold->Set(y);
-        t += dt;
-        if (callback) callback(t, y);
+        integrator.Step();
+        y = integrator.Y();
+        if (callback) callback(integrator.Time(), y);
       }
   }
 
   // implicit Euler method for dy/dt = rhs(y), full Matrix output
   // the first row of all_y needs to hold the initial y value
-  void SolveODE_IE(double tend, int steps,
-                   MatrixView<> all_y, shared_ptr<NonlinearFunction> rhs,
-                   std::function<void(double,VectorView<double>)> callback = nullptr)
+  inline void SolveODE_IE(double tend, int steps,
+                          MatrixView<> all_y, shared_ptr<NonlinearFunction> rhs,
+                          std::function<void(double,VectorView<double>)> callback = nullptr,
+                          NewtonParameters params = NewtonParameters())
   {
     if (all_y.width() != rhs->DimF() || all_y.height() != steps) {throw std::invalid_argument("all_y does not have the right dimensions, maybe that it was ColMajor");}
 
-    double dt = tend/steps;
-    Vector<> y(all_y.width());
-    y = all_y.Row(0);
-
-    auto yold = make_shared<ConstantFunction>(y);
-    auto ynew = make_shared<IdentityFunction>(y.Size());
-    auto equ = ynew-yold - dt * rhs;
-
-    double t = 0;
+    ImplicitEulerIntegrator integrator(rhs, tend/steps, params);
+    integrator.SetState (0, all_y.Row(0));
 
     for (int i = 0; i < steps; i++)
       {
-        NewtonSolver (equ, y);
-        yold->Set(y);
-        t += dt;
-        if (callback) callback(t, y);
-        all_y.Row(i) = y;
+        integrator.Step();
+        if (callback) callback(integrator.Time(), integrator.Y());
+        all_y.Row(i) = integrator.Y();
       }
   }
 
+  // implicit Euler method for dy/dt = rhs(y) with dense output: the rows of
+  // out receive the solution at the ascending times in [0, tend], which are
+  // independent of the step size tend/steps
+  inline void SolveODE_IE(double tend, int steps,
+                          VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
+                          VectorView<double> times, MatrixView<> out,
+                          NewtonParameters params = NewtonParameters())
+  {
+    ImplicitEulerIntegrator integrator(rhs, tend/steps, params);
+    integrator.SetState (0, y);
+    integrator.AdvanceDense (tend, times, out);
+    y = integrator.Y();
+  }
+
   
   // explicit Euler method for dy/dt = rhs(y)
-  void SolveODE_EE(double tend, int steps,
-                   VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
-                   std::function<void(double, VectorView<double>)> callback = nullptr)
+  inline void SolveODE_EE(double tend, int steps,
+                          VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
+                          std::function<void(double, VectorView<double>)> callback = nullptr)
   {
     double dt = tend/steps;
     if (rhs->DimX() != y.Size() || rhs->DimX() != y.Size()){throw std::invalid_argument("rhs does not have the right dimensions"); }
@@ -85,9 +578,9 @@ namespace Neo_ODE
 
   // explicit Euler method for dy/dt = rhs(y)
   // the first row of all_y needs to hold the initial y value
-  void SolveODE_EE(double tend, int steps,
-                   MatrixView<> all_y, shared_ptr<NonlinearFunction> rhs,
-                   std::function<void(double, VectorView<double>)> callback = nullptr)
+  inline void SolveODE_EE(double tend, int steps,
+                          MatrixView<> all_y, shared_ptr<NonlinearFunction> rhs,
+                          std::function<void(double, VectorView<double>)> callback = nullptr)
   {
     double dt = tend/steps;
     if (all_y.width() != rhs->DimF() || all_y.height() != steps) {throw std::invalid_argument("all_y does not have the right dimensions, maybe that it was ColMajor");}
@@ -109,159 +602,396 @@ namespace Neo_ODE
   }
 
   // Crank-Nicholson method
-  void SolveODE_CN(double tend, int steps,
-                   VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
-                   std::function<void(double, VectorView<double>)> callback = nullptr)
+  inline void SolveODE_CN(double tend, int steps,
+                          VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
+                          std::function<void(double, VectorView<double>)> callback = nullptr,
+                          NewtonParameters params = NewtonParameters())
   {
-    // h
-    double dt = tend/steps;
-    double t = 0;
-
-    // set up equation
-    auto yold = make_shared<ConstantFunction>(y); // y_i
-    auto ynew = make_shared<IdentityFunction>(y.Size()); // y_{i+1}
-    auto equ = ynew-yold - (dt/2) * (Compose(rhs, yold) + Compose(rhs, ynew));
+    CrankNicolsonIntegrator integrator(rhs, tend/steps, params);
+    integrator.SetState (0, y);
 
     for (int i = 0; i < steps; i++)
     {
-      // solve equation
-      NewtonSolver (equ, y);
-      yold->Set(y);
-
-      t += dt;
-      if (callback) callback(t, y);
+      integrator.Step();
+      y = integrator.Y();
+      if (callback) callback(integrator.Time(), y);
     }
   }
 
   // Crank-Nicholson method
   // the first row of all_y needs to hold the initial y value
-  void SolveODE_CN(double tend, int steps,
-                   MatrixView<> all_y, shared_ptr<NonlinearFunction> rhs,
-                   std::function<void(double,VectorView<double>)> callback = nullptr)
+  inline void SolveODE_CN(double tend, int steps,
+                          MatrixView<> all_y, shared_ptr<NonlinearFunction> rhs,
+                          std::function<void(double,VectorView<double>)> callback = nullptr,
+                          NewtonParameters params = NewtonParameters())
   {
     if (all_y.width() != rhs->DimF() || all_y.height() != steps) {throw std::invalid_argument("all_y does not have the right dimensions, maybe that it was ColMajor");}
     
-    // h
-    double dt = tend/steps;
-    double t = 0;
-    Vector<> y(all_y.width());
-    y = all_y.Row(0);
-
-    // set up equation
-    auto yold = make_shared<ConstantFunction>(y); // y_i
-    auto ynew = make_shared<IdentityFunction>(y.Size()); // y_{i+1}
-    auto equ = ynew-yold - (dt/2) * (Compose(rhs, yold) + Compose(rhs, ynew));
+    CrankNicolsonIntegrator integrator(rhs, tend/steps, params);
+    integrator.SetState (0, all_y.Row(0));
 
     for (int i = 0; i < steps; i++)
     {
-      // solve equation
-      NewtonSolver (equ, y);
-      yold->Set(y);
-
-      t += dt;
-      if (callback) callback(t, y);
-      all_y.Row(i) = y;
+      integrator.Step();
+      if (callback) callback(integrator.Time(), integrator.Y());
+      all_y.Row(i) = integrator.Y();
     }
   }
+
+  // Crank-Nicholson method with dense output at the ascending times in [0, tend]
+  inline void SolveODE_CN(double tend, int steps,
+                          VectorView<double> y, shared_ptr<NonlinearFunction> rhs,
+                          VectorView<double> times, MatrixView<> out,
+                          NewtonParameters params = NewtonParameters())
+  {
+    CrankNicolsonIntegrator integrator(rhs, tend/steps, params);
+    integrator.SetState (0, y);
+    integrator.AdvanceDense (tend, times, out);
+    y = integrator.Y();
+  }
+  
+  
+  
+  // IMEX Runge-Kutta method for dy/dt = stiff(y) + nonstiff(y)
+  inline void SolveODE_IMEX(double tend, int steps, VectorView<double> y,
+                            shared_ptr<NonlinearFunction> stiff, shared_ptr<NonlinearFunction> nonstiff,
+                            std::function<void(double,VectorView<double>)> callback = nullptr,
+                            IMEXTableau tableau = IMEXTableau::ARS222(),
+                            NewtonParameters params = NewtonParameters())
+  {
+    IMEXIntegrator integrator(stiff, nonstiff, tend/steps, tableau, params);
+    integrator.SetState (0, y);
+    integrator.Advance (tend, callback);
+    y = integrator.Y();
+  }
   
   
   
   // Newmark and generalized alpha:
   // https://miaodi.github.io/finite%20element%20method/newmark-generalized/
+
+  // trees of one step of a second order method: residual, xnew(a), vnew(a)
+  using SecondOrderStepTrees = std::tuple<shared_ptr<NonlinearFunction>,
+                                          shared_ptr<NonlinearFunction>,
+                                          shared_ptr<NonlinearFunction>>;
+  
+  // one step implicit methods for mass*d^2x/dt^2 = rhs with the acceleration
+  // as Newton unknown, the derived classes provide the trees of one step.
+  // The rhs is rhs(x), or rhs(x, v) for damping if its DimX is twice its DimF.
+  class SecondOrderIntegrator : public TimeIntegrator
+  {
+  protected:
+    shared_ptr<NonlinearFunction> rhs, mass;
+    bool velocitydependent;
+
+    shared_ptr<NonlinearFunction> Rhs (shared_ptr<NonlinearFunction> x,
+                                       shared_ptr<NonlinearFunction> v) const
+    {
+      return velocitydependent ? Compose(rhs, Stack(x, v)) : Compose(rhs, x);
+    }
+    
+    Vector<> x, v, a;
+    shared_ptr<ConstantFunction> xold, vold, aold;
+    shared_ptr<IdentityFunction> anew;
+    StepEquations<std::function<SecondOrderStepTrees(double)>> equs;
+
+    // x, v, a at the beginning of the last step, for dense output
+    Vector<> xprev, vprev, aprev;
+
+    virtual SecondOrderStepTrees BuildEquations (double h) = 0;
+    
+    void DoStep (double h) override
+    {
+      auto [equ, xnew, vnew] = equs(h);
+      Solve (equ, a, h);
+      xnew -> Evaluate (a, x);
+      vnew -> Evaluate (a, v);
+
+      xold->Set(x);
+      vold->Set(v);
+      aold->Set(a);
+    }
+    void Restore () override { a = aold->Get(); }
+    void SaveState (std::ostream & ost) const override
+    {
+      WriteBinary (ost, x);
+      WriteBinary (ost, v);
+      WriteBinary (ost, a);
+    }
+    void LoadState (std::istream & ist) override
+    {
+      ReadBinary (ist, x);
+      ReadBinary (ist, v);
+      ReadBinary (ist, a);
+      SetState (t, x, v, a);
+    }
+
+    void BeginDenseStep () override
+    {
+      xprev = x;
+      vprev = v;
+      aprev = a;
+    }
+    void EndDenseStep () override { ; }
+    void DoInterpolate (double s, VectorView<double> u) const override
+    {
+      HermiteInterpolate (tprev, t, s, xprev, vprev, x, v, u);
+    }
+    
+  public:
+    SecondOrderIntegrator (shared_ptr<NonlinearFunction> _rhs,
+                           shared_ptr<NonlinearFunction> _mass,
+                           double _dt, NewtonParameters _params)
+      : TimeIntegrator(_rhs->DimF(), _dt, _params), rhs(_rhs), mass(_mass),
+        velocitydependent(_rhs->DimX() == 2*_rhs->DimF()),
+        x(_rhs->DimF()), v(_rhs->DimF()), a(_rhs->DimF()),
+        equs([this](double h) { return BuildEquations(h); }),
+        xprev(_rhs->DimF()), vprev(_rhs->DimF()), aprev(_rhs->DimF())
+    {
+      x = 0.0;
+      v = 0.0;
+      a = 0.0;
+      xold = make_shared<ConstantFunction>(x);
+      vold = make_shared<ConstantFunction>(v);
+      aold = make_shared<ConstantFunction>(a);
+      anew = make_shared<IdentityFunction>(a.Size());
+    }
+
+    VectorView<double> Solution() const override { return x.View(); }
+    VectorView<double> X() const { return x.View(); }
+    VectorView<double> V() const { return v.View(); }
+    VectorView<double> A() const { return a.View(); }
+
+    // f = rhs(x) or rhs(x, v)
+    void EvaluateRhs (VectorView<double> _x, VectorView<double> _v, VectorView<double> f) const
+    {
+      if (!velocitydependent)
+        {
+          rhs->Evaluate (_x, f);
+          return;
+        }
+      Vector<> xv(2*_x.Size());
+      xv.Range(0, _x.Size()) = _x;
+      xv.Range(_x.Size(), 2*_x.Size()) = _v;
+      rhs->Evaluate (xv, f);
+    }
+
+    void SetState (double _t, VectorView<double> _x, VectorView<double> _v, VectorView<double> _a)
+    {
+      t = tprev = _t;
+      x = _x;
+      v = _v;
+      a = _a;
+      xold->Set(x);
+      vold->Set(v);
+      aold->Set(a);
+    }
+
+    void GetState (VectorView<double> _x, VectorView<double> _v, VectorView<double> _a) const
+    {
+      _x = x;
+      _v = v;
+      _a = a;
+    }
+
+    // position and velocity at time s of the last step, the velocity is
+    // interpolated from v and a
+    void Interpolate (double s, VectorView<double> _x, VectorView<double> _v) const
+    {
+      TimeIntegrator::Interpolate (s, _x);
+      if (t != tprev)
+        HermiteInterpolate (tprev, t, std::min(t, std::max(tprev, s)), vprev, aprev, v, a, _v);
+      else
+        _v = v;
+    }
+    using TimeIntegrator::Interpolate;
+
+    size_t StateSize() const override { return 3*x.Size(); }
+    
+    void GetFullState (VectorView<double> u) const override
+    {
+      size_t n = x.Size();
+      GetState (u.Range(0, n), u.Range(n, 2*n), u.Range(2*n, 3*n));
+    }
+    
+    void SetFullState (double _t, VectorView<double> u) override
+    {
+      size_t n = x.Size();
+      SetState (_t, u.Range(0, n), u.Range(n, 2*n), u.Range(2*n, 3*n));
+    }
+
+    // x and v by Hermite interpolation, a linear
+    void InterpolateFullState (double s, VectorView<double> u) const override
+    {
+      size_t n = x.Size();
+      Interpolate (s, u.Range(0, n), u.Range(n, 2*n));
+      double th = (t > tprev) ? (std::min(t, std::max(tprev, s))-tprev)/(t-tprev) : 1;
+      for (size_t i = 0; i < n; i++)
+        u(2*n+i) = (1-th)*aprev(i) + th*a(i);
+    }
+  };
+
   
   // Newmark method for  mass*d^2x/dt^2 = rhs
-  void SolveODE_Newmark(double tend, int steps,
-                        VectorView<double> x, VectorView<double> dx,
-                        shared_ptr<NonlinearFunction> rhs,   
-                        shared_ptr<NonlinearFunction> mass,  
-                        std::function<void(double,VectorView<double>)> callback = nullptr)
+  class NewmarkIntegrator : public SecondOrderIntegrator
   {
-    double dt = tend/steps;
     double gamma = 0.5;
     double beta = 0.25;
+    
+    SecondOrderStepTrees BuildEquations (double h) override
+    {
+      shared_ptr<NonlinearFunction> vnew = vold + h*((1-gamma)*aold+gamma*anew);
+      shared_ptr<NonlinearFunction> xnew = xold + h*vold + h*h/2 * ((1-2*beta)*aold+2*beta*anew);
+      shared_ptr<NonlinearFunction> equ = Compose(mass, anew) - Rhs(xnew, vnew);
+      return { equ, xnew, vnew };
+    }
+    
+  public:
+    NewmarkIntegrator (shared_ptr<NonlinearFunction> _rhs,
+                       shared_ptr<NonlinearFunction> _mass,
+                       double _dt, NewtonParameters _params = NewtonParameters())
+      : SecondOrderIntegrator(_rhs, _mass, _dt, _params) { }
 
-    Vector<> a(x.Size());
-    Vector<> v(x.Size());
-
-    auto xold = make_shared<ConstantFunction>(x);
-    auto vold = make_shared<ConstantFunction>(dx);
-    auto aold = make_shared<ConstantFunction>(x);
-
-    rhs->Evaluate (xold->Get(), aold->Get());
+    using SecondOrderIntegrator::SetState;
     
-    auto anew = make_shared<IdentityFunction>(a.Size());
-    auto vnew = vold + dt*((1-gamma)*aold+gamma*anew);
-    auto xnew = xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew);    
+    // initial acceleration from rhs, as for an identity mass
+    void SetState (double _t, VectorView<double> _x, VectorView<double> _v)
+    {
+      EvaluateRhs (_x, _v, a);
+      SetState (_t, _x, _v, a);
+    }
+  };
 
-    auto equ = Compose(mass, anew) - Compose(rhs, xnew);
+  
+  // Newmark method for  mass*d^2x/dt^2 = rhs
+  inline void SolveODE_Newmark(double tend, int steps,
+                               VectorView<double> x, VectorView<double> dx,
+                               shared_ptr<NonlinearFunction> rhs,   
+                               shared_ptr<NonlinearFunction> mass,  
+                               std::function<void(double,VectorView<double>)> callback = nullptr,
+                               NewtonParameters params = NewtonParameters())
+  {
+    NewmarkIntegrator integrator(rhs, mass, tend/steps, params);
+    integrator.SetState (0, x, dx);
 
-    double t = 0;
     for (int i = 0; i < steps; i++)            
       {
-        NewtonSolver (equ, a);
-        xnew -> Evaluate (a, x);
-        vnew -> Evaluate (a, v);
-
-        xold->Set(x);
-        vold->Set(v);
-        aold->Set(a);
-        t += dt;
-        if (callback) callback(t, x);
+        integrator.Step();
+        x = integrator.X();
+        if (callback) callback(integrator.Time(), x);
       }
-    dx = v;
+    dx = integrator.V();
   }
 
+  // Newmark method with dense output of x at the ascending times in [0, tend]
+  inline void SolveODE_Newmark(double tend, int steps,
+                               VectorView<double> x, VectorView<double> dx,
+                               shared_ptr<NonlinearFunction> rhs,   
+                               shared_ptr<NonlinearFunction> mass,
+                               VectorView<double> times, MatrixView<> out,
+                               NewtonParameters params = NewtonParameters())
+  {
+    NewmarkIntegrator integrator(rhs, mass, tend/steps, params);
+    integrator.SetState (0, x, dx);
+    integrator.AdvanceDense (tend, times, out);
+    x = integrator.X();
+    dx = integrator.V();
+  }
 
 
 
-  // Generalized alpha method for M d^2x/dt^2 = rhs
-  void SolveODE_Alpha (double tend, int steps, double rhoinf,
-                       VectorView<double> x, VectorView<double> dx, VectorView<double> ddx,
-                       shared_ptr<NonlinearFunction> rhs,   
-                       shared_ptr<NonlinearFunction> mass,  
-                       std::function<void(double,VectorView<double>)> callback = nullptr)
+  // Generalized alpha method for M d^2x/dt^2 = rhs as a resumable object.
+  // In addition to the common state, rhoinf and the last x, v, a are saved.
+  class AlphaIntegrator : public SecondOrderIntegrator
   {
-    double dt = tend/steps;
-    double alpham = (2*rhoinf-1)/(rhoinf+1);
-    double alphaf = rhoinf/(rhoinf+1);
-    double gamma = 0.5-alpham+alphaf;
-    double beta = 0.25 * (1-alpham+alphaf)*(1-alpham+alphaf);
-
-    Vector<> a(x.Size());
-    Vector<> v(x.Size());
-
-    auto xold = make_shared<ConstantFunction>(x);
-    auto vold = make_shared<ConstantFunction>(dx);
-    auto aold = make_shared<ConstantFunction>(ddx);
-    // rhs->Evaluate (xold->Get(), aold->Get()); // solve with M ???
+    double rhoinf;
+    double alpham, alphaf, gamma, beta;
     
-    auto anew = make_shared<IdentityFunction>(a.Size());
-    auto vnew = vold + dt*((1-gamma)*aold+gamma*anew);
-    auto xnew = xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew);    
+    SecondOrderStepTrees BuildEquations (double h) override
+    {
+      shared_ptr<NonlinearFunction> vnew = vold + h*((1-gamma)*aold+gamma*anew);
+      shared_ptr<NonlinearFunction> xnew = xold + h*vold + h*h/2 * ((1-2*beta)*aold+2*beta*anew);
 
-    // auto equ = Compose(mass, (1-alpham)*anew+alpham*aold) - Compose(rhs, (1-alphaf)*xnew+alphaf*xold);
-    auto equ = Compose(mass, (1-alpham)*anew+alpham*aold) - (1-alphaf)*Compose(rhs,xnew) - alphaf*Compose(rhs, xold);
+      // auto equ = Compose(mass, (1-alpham)*anew+alpham*aold) - Compose(rhs, (1-alphaf)*xnew+alphaf*xold);
+      shared_ptr<NonlinearFunction> equ = Compose(mass, (1-alpham)*anew+alpham*aold) - (1-alphaf)*Rhs(xnew, vnew) - alphaf*Rhs(xold, vold);
+      return { equ, xnew, vnew };
+    }
 
-    double t = 0;
-    a = ddx;
+    void SaveState (std::ostream & ost) const override
+    {
+      WriteBinary (ost, rhoinf);
+      SecondOrderIntegrator::SaveState (ost);
+    }
+    void LoadState (std::istream & ist) override
+    {
+      double _rhoinf;
+      ReadBinary (ist, _rhoinf);
+      SetRhoInf (_rhoinf);
+      SecondOrderIntegrator::LoadState (ist);
+    }
+    
+  public:
+    AlphaIntegrator (shared_ptr<NonlinearFunction> _rhs,
+                     shared_ptr<NonlinearFunction> _mass,
+                     double _dt, double _rhoinf = 0.8,
+                     NewtonParameters _params = NewtonParameters())
+      : SecondOrderIntegrator(_rhs, _mass, _dt, _params)
+    {
+      SetRhoInf (_rhoinf);
+    }
+
+    void SetRhoInf (double _rhoinf)
+    {
+      rhoinf = _rhoinf;
+      alpham = (2*rhoinf-1)/(rhoinf+1);
+      alphaf = rhoinf/(rhoinf+1);
+      gamma = 0.5-alpham+alphaf;
+      beta = 0.25 * (1-alpham+alphaf)*(1-alpham+alphaf);
+      equs.Clear();
+      newton.InvalidateJacobian();
+    }
+
+    double RhoInf() const { return rhoinf; }
+    double AlphaM() const { return alpham; }
+    double AlphaF() const { return alphaf; }
+    double Gamma() const { return gamma; }
+    double Beta() const { return beta; }
+  };
+  
+
+  // Generalized alpha method for M d^2x/dt^2 = rhs
+  inline void SolveODE_Alpha (double tend, int steps, double rhoinf,
+                              VectorView<double> x, VectorView<double> dx, VectorView<double> ddx,
+                              shared_ptr<NonlinearFunction> rhs,   
+                              shared_ptr<NonlinearFunction> mass,  
+                              std::function<void(double,VectorView<double>)> callback = nullptr,
+                              NewtonParameters params = NewtonParameters())
+  {
+    AlphaIntegrator integrator(rhs, mass, tend/steps, rhoinf, params);
+    integrator.SetState (0, x, dx, ddx);
 
     for (int i = 0; i < steps; i++)
       {
-        NewtonSolver (equ, a);
-        xnew -> Evaluate (a, x);
-        vnew -> Evaluate (a, v);
-
-        xold->Set(x);
-        vold->Set(v);
-        aold->Set(a);
-        t += dt;
-        if (callback) callback(t, x);
+        integrator.Step();
+        x = integrator.X();
+        if (callback) callback(integrator.Time(), x);
       }
-    dx = v;
-    ddx = a;
+    integrator.GetState (x, dx, ddx);
   }
 
-  
+  // Generalized alpha method with dense output of x at the ascending times in [0, tend]
+  inline void SolveODE_Alpha (double tend, int steps, double rhoinf,
+                              VectorView<double> x, VectorView<double> dx, VectorView<double> ddx,
+                              shared_ptr<NonlinearFunction> rhs,   
+                              shared_ptr<NonlinearFunction> mass,  
+                              VectorView<double> times, MatrixView<> out,
+                              NewtonParameters params = NewtonParameters())
+  {
+    AlphaIntegrator integrator(rhs, mass, tend/steps, rhoinf, params);
+    integrator.SetState (0, x, dx, ddx);
+    integrator.AdvanceDense (tend, times, out);
+    integrator.GetState (x, dx, ddx);
+  }
 
 }
 
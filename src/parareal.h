@@ -0,0 +1,134 @@
+#ifndef PARAREAL_H
+#define PARAREAL_H
+
+#include <functional>
+#include <algorithm>
+
+#include "ode.h"
+#include "taskpool.h"
+
+namespace Neo_ODE
+{
+
+  // advances the state y from time t0 to t1 in place
+  using Propagator = std::function<void(double, double, VectorView<double>)>;
+
+  
+  // propagators built from the fixed step solvers, with the given number
+  // of steps per call. The right hand sides must be autonomous.
+  inline Propagator IEPropagator (shared_ptr<NonlinearFunction> rhs, int steps,
+                                  NewtonParameters params = NewtonParameters())
+  {
+    return [rhs, steps, params] (double t0, double t1, VectorView<double> y)
+    { SolveODE_IE (t1-t0, steps, y, rhs, nullptr, params); };
+  }
+
+  inline Propagator CNPropagator (shared_ptr<NonlinearFunction> rhs, int steps,
+                                  NewtonParameters params = NewtonParameters())
+  {
+    return [rhs, steps, params] (double t0, double t1, VectorView<double> y)
+    { SolveODE_CN (t1-t0, steps, y, rhs, nullptr, params); };
+  }
+
+  // generalized alpha for M d^2x/dt^2 = rhs, the state is y = (x, v, a)
+  inline Propagator AlphaPropagator (shared_ptr<NonlinearFunction> rhs,
+                                     shared_ptr<NonlinearFunction> mass,
+                                     double rhoinf, int steps,
+                                     NewtonParameters params = NewtonParameters())
+  {
+    return [rhs, mass, rhoinf, steps, params] (double t0, double t1, VectorView<double> y)
+    {
+      size_t n = rhs->DimF();
+      SolveODE_Alpha (t1-t0, steps, rhoinf,
+                      y.Range(0, n), y.Range(n, 2*n), y.Range(2*n, 3*n),
+                      rhs, mass, nullptr, params);
+    };
+  }
+
+
+  // Parareal iteration on [0, tend] split into time slices:
+  //
+  //   U_{n+1}^{k+1} = G(U_n^{k+1}) + F(U_n^k) - G(U_n^k)
+  //
+  // The fine propagator F runs on all open slices in parallel, the cheap
+  // coarse propagator G sequentially. After iteration k the first k slices
+  // are exact, so at most 'slices' iterations are needed; we stop when the
+  // largest change of a slice value is below tol*(1+|U|).
+  // Both propagators are called concurrently and must be thread safe.
+  // y holds the initial value and receives the value at tend; the callback
+  // is called at the slice ends after convergence. Returns the number of
+  // iterations.
+  inline int SolveODE_Parareal (double tend, int slices, VectorView<double> y,
+                                Propagator coarse, Propagator fine,
+                                int maxiterations = 10, double tol = 1e-8,
+                                std::function<void(double,VectorView<double>)> callback = nullptr,
+                                size_t nthreads = 0)
+  {
+    size_t n = y.Size();
+    double dT = tend/slices;
+    auto T = [dT](int i) { return i*dT; };
+
+    Matrix<> U(slices+1, n);       // slice start values
+    Matrix<> Fine(slices, n);      // F(U_n^k)
+    Matrix<> Coarse(slices, n);    // G(U_n^k)
+    Vector<> tmp(n);
+
+    // initial guess by the coarse propagator
+    U.Row(0) = y;
+    for (int i = 0; i < slices; i++)
+      {
+        tmp = U.Row(i);
+        coarse (T(i), T(i+1), tmp);
+        Coarse.Row(i) = tmp;
+        U.Row(i+1) = tmp;
+      }
+
+    TaskPool pool(nthreads);
+    int k = 0;
+    int first = 0;      // slices before 'first' are converged
+    while (k < maxiterations && first < slices)
+      {
+        k++;
+        pool.ParallelFor (slices-first, [&](size_t j)
+        {
+          int i = first+j;
+          Vector<> yi(n);
+          yi = U.Row(i);
+          fine (T(i), T(i+1), yi);
+          Fine.Row(i) = yi;
+        });
+
+        // the fine solution of the first open slice is exact
+        double maxchange = 0;
+        for (int i = first; i < slices; i++)
+          {
+            tmp = U.Row(i);
+            coarse (T(i), T(i+1), tmp);
+            double change = 0, norm = 0;
+            for (size_t j = 0; j < n; j++)
+              {
+                double unew = tmp(j) + Fine(i,j) - Coarse(i,j);
+                change = std::max(change, std::abs(unew-U(i+1,j)));
+                norm = std::max(norm, std::abs(unew));
+                U(i+1,j) = unew;
+              }
+            Coarse.Row(i) = tmp;
+            maxchange = std::max(maxchange, change/(1+norm));
+          }
+        first++;
+        if (maxchange < tol) break;
+      }
+
+    if (callback)
+      for (int i = 1; i <= slices; i++)
+        {
+          tmp = U.Row(i);
+          callback(T(i), tmp);
+        }
+    y = U.Row(slices);
+    return k;
+  }
+
+}
+
+#endif
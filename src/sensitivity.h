@@ -0,0 +1,541 @@
+#ifndef SENSITIVITY_H
+#define SENSITIVITY_H
+
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "ode.h"
+#include "banded.h"
+
+namespace Neo_ODE
+{
+
+  // Derivatives of time integrations with respect to the parameters p of
+  // a ParametricFunction rhs, for the implicit Euler, Crank-Nicolson and
+  // generalized alpha methods. They are the derivatives of the discrete
+  // steps (exact up to the Newton tolerance), so steps are never halved.
+  //  - forward: the sensitivities dy/dp are stepped along with y, one
+  //    solve with NumParameters() right hand sides per step,
+  //  - adjoint: the gradient of an objective sum_{n=1}^{steps} g(t_n, y_n)
+  //    costs one backward sweep with one transposed solve per step, for
+  //    any number of parameters. The forward states are recomputed segment
+  //    by segment from checkpoints every 'interval' steps (default
+  //    sqrt(steps)), which needs memory for steps/interval + interval states.
+  // The initial state is independent of p.
+
+  // value of g(t, y), writes dg/dy into dgdy (which is zero on entry)
+  using ObjectiveFunction = std::function<double(double t, VectorView<double> y, VectorView<double> dgdy)>;
+
+
+  // solver for a step matrix or its transpose, factored in its band if it is narrow
+  class StepMatrixSolver
+  {
+    Matrix<> a;
+    BandedLU<double> band;
+    DenseLU<double> dense;
+    bool useband = false;
+    Vector<> col;
+  public:
+    StepMatrixSolver (size_t n) : a(n, n), col(n) { }
+
+    void Factor (MatrixView<double> m, bool transpose = false)
+    {
+      size_t n = a.height();
+      for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < n; j++)
+          a(i,j) = transpose ? m(j,i) : m(i,j);
+      size_t lower, upper;
+      Bandwidth (a, lower, upper);
+      useband = 2*(lower+upper) < n;
+      if (useband)
+        band.Factor (a, lower, upper);
+      else
+        dense.Factor (a);
+    }
+
+    // b = A^{-1} b
+    void Solve (VectorView<double> b)
+    {
+      if (useband)
+        band.Solve (b);
+      else
+        dense.Solve (b);
+    }
+
+    // B = A^{-1} B, column by column
+    void SolveColumns (MatrixView<double> b)
+    {
+      for (size_t j = 0; j < b.width(); j++)
+        {
+          for (size_t i = 0; i < b.height(); i++) col(i) = b(i,j);
+          Solve (col);
+          for (size_t i = 0; i < b.height(); i++) b(i,j) = col(i);
+        }
+    }
+  };
+
+
+  // y += s * a^T x, for the columns first ... first+y.Size()-1 of a
+  inline void AddTransMult (double s, MatrixView<double> a, VectorView<double> x,
+                            VectorView<double> y, size_t first = 0)
+  {
+    for (size_t i = 0; i < a.height(); i++)
+      {
+        double sx = s*x(i);
+        if (sx == 0) continue;
+        for (size_t j = 0; j < y.Size(); j++)
+          y(j) += sx * a(i, first+j);
+      }
+  }
+
+
+  // Runs the steps of the integrator, then calls backstep(k, u0, u1) for
+  // k = steps-1, ..., 0 with the full states before and after step k.
+  // The integrator ends in its final state.
+  inline void CheckpointedSweep (TimeIntegrator & integrator, int steps, int interval,
+                                 const std::function<void(int, VectorView<double>, VectorView<double>)> & backstep)
+  {
+    if (interval <= 0)
+      interval = std::max(1, int(std::sqrt(double(steps))));
+    size_t m = integrator.StateSize();
+    double t0 = integrator.Time();
+    double h = integrator.TimeStep();
+
+    // the Jacobian is refreshed at every checkpoint, so that the
+    // recomputation repeats the Newton iterations exactly
+    std::vector<Vector<>> checkpoints;
+    for (int k = 0; k < steps; k++)
+      {
+        if (k % interval == 0)
+          {
+            checkpoints.emplace_back (m);
+            integrator.GetFullState (checkpoints.back());
+            integrator.InvalidateJacobian();
+          }
+        integrator.Step();
+      }
+    double tend = integrator.Time();
+    Vector<> final(m);
+    integrator.GetFullState (final);
+
+    std::vector<Vector<>> states;
+    for (int k = 0; k <= interval; k++)
+      states.emplace_back (m);
+    for (size_t seg = checkpoints.size(); seg-- > 0; )
+      {
+        int first = int(seg)*interval;
+        int last = std::min(steps, first+interval);
+        states[0] = checkpoints[seg];
+        integrator.SetFullState (t0 + first*h, states[0]);
+        integrator.InvalidateJacobian();
+        for (int k = first; k < last; k++)
+          {
+            integrator.Step();
+            integrator.GetFullState (states[k+1-first]);
+          }
+        for (int k = last; k-- > first; )
+          backstep (k, states[k-first], states[k+1-first]);
+      }
+    integrator.SetFullState (tend, final);
+    integrator.InvalidateJacobian();
+  }
+
+
+
+  // Derivatives of the theta method y1 - y0 - h (theta f(y1) + (1-theta) f(y0)) = 0,
+  // theta = 1 is implicit Euler, theta = 1/2 Crank-Nicolson. The derivatives
+  // at the end of a step are kept for the beginning of the next one.
+  class ThetaStepDerivatives
+  {
+    shared_ptr<ParametricFunction> rhs;
+    double theta, h;
+    size_t n, np;
+  public:
+    Matrix<> J0, J1, P0, P1;    // df/dy and df/dp at y0 and y1
+    StepMatrixSolver solver;
+
+    ThetaStepDerivatives (shared_ptr<ParametricFunction> _rhs, double _theta, double _h)
+      : rhs(_rhs), theta(_theta), h(_h), n(_rhs->DimX()), np(_rhs->NumParameters()),
+        J0(n, n), J1(n, n), P0(n, np), P1(n, np), solver(n) { }
+
+    void At (VectorView<double> y, MatrixView<double> J, MatrixView<double> P) const
+    {
+      rhs->EvaluateDeriv (y, J);
+      rhs->EvaluateParameterDeriv (y, P);
+    }
+
+    // I - theta h J1
+    void FactorStepMatrix (bool transpose)
+    {
+      Matrix<> a(n, n);
+      a = (-theta*h) * J1;
+      for (size_t i = 0; i < n; i++) a(i,i) += 1;
+      solver.Factor (a, transpose);
+    }
+
+    // S1 = (I - theta h J1)^{-1} ((I + (1-theta) h J0) S0 + h (theta P1 + (1-theta) P0))
+    void Forward (MatrixView<double> sens)
+    {
+      Matrix<> r(n, np);
+      r = J0*sens;
+      r *= (1-theta)*h;
+      r += sens;
+      r += (theta*h) * P1;
+      r += ((1-theta)*h) * P0;
+      FactorStepMatrix (false);
+      solver.SolveColumns (r);
+      sens = r;
+    }
+
+    // from the adjoint lam of y1 to that of y0, adds the parameter part to grad
+    void Backward (VectorView<double> lam, VectorView<double> grad)
+    {
+      FactorStepMatrix (true);
+      solver.Solve (lam);
+      Vector<> mu(n);
+      mu = lam;
+      AddTransMult (theta*h, P1, mu, grad);
+      if (theta < 1)
+        {
+          AddTransMult ((1-theta)*h, P0, mu, grad);
+          AddTransMult ((1-theta)*h, J0, mu, lam);
+        }
+    }
+  };
+
+
+  inline std::unique_ptr<FirstOrderIntegrator>
+  ThetaIntegrator (double theta, shared_ptr<ParametricFunction> rhs, double h, NewtonParameters params)
+  {
+    params.maxhalvings = 0;
+    if (theta == 1)
+      return std::make_unique<ImplicitEulerIntegrator>(rhs, h, params);
+    return std::make_unique<CrankNicolsonIntegrator>(rhs, h, params);
+  }
+
+  inline void SensitivityODE_Theta (double theta, double tend, int steps, VectorView<double> y,
+                                    shared_ptr<ParametricFunction> rhs, MatrixView<double> sens,
+                                    std::function<void(double,VectorView<double>)> callback,
+                                    NewtonParameters params)
+  {
+    if (sens.height() != rhs->DimX() || sens.width() != rhs->NumParameters())
+      throw std::invalid_argument("sensitivity matrix needs DimX rows and NumParameters columns");
+    double h = tend/steps;
+    auto integrator = ThetaIntegrator (theta, rhs, h, params);
+    integrator->SetState (0, y);
+    ThetaStepDerivatives deriv(rhs, theta, h);
+    deriv.At (y, deriv.J0, deriv.P0);
+    for (int i = 0; i < steps; i++)
+      {
+        integrator->Step();
+        deriv.At (integrator->Y(), deriv.J1, deriv.P1);
+        deriv.Forward (sens);
+        deriv.J0 = deriv.J1;
+        deriv.P0 = deriv.P1;
+        if (callback) callback(integrator->Time(), integrator->Y());
+      }
+    y = integrator->Y();
+  }
+
+  inline double AdjointODE_Theta (double theta, double tend, int steps, VectorView<double> y,
+                                  shared_ptr<ParametricFunction> rhs, ObjectiveFunction objective,
+                                  VectorView<double> gradient, int interval, NewtonParameters params)
+  {
+    if (gradient.Size() != rhs->NumParameters())
+      throw std::invalid_argument("gradient needs NumParameters entries");
+    size_t n = rhs->DimX();
+    double h = tend/steps;
+    auto integrator = ThetaIntegrator (theta, rhs, h, params);
+    integrator->SetState (0, y);
+    ThetaStepDerivatives deriv(rhs, theta, h);
+
+    double value = 0;
+    Vector<> lam(n), dg(n);
+    lam = 0.0;
+    gradient = 0.0;
+    CheckpointedSweep (*integrator, steps, interval,
+                       [&](int k, VectorView<double> y0, VectorView<double> y1)
+    {
+      dg = 0.0;
+      value += objective ((k+1)*h, y1, dg);
+      lam += dg;
+      // the derivatives at y1 were those at y0 of step k+1
+      if (theta == 1 || k == steps-1)
+        deriv.At (y1, deriv.J1, deriv.P1);
+      else
+        {
+          deriv.J1 = deriv.J0;
+          deriv.P1 = deriv.P0;
+        }
+      if (theta < 1)
+        deriv.At (y0, deriv.J0, deriv.P0);
+      deriv.Backward (lam, gradient);
+    });
+    y = integrator->Y();
+    return value;
+  }
+
+
+  // implicit Euler with forward sensitivities sens = dy/dp, of size
+  // DimX x NumParameters, which hold the initial sensitivities on entry
+  inline void SensitivityODE_IE (double tend, int steps, VectorView<double> y,
+                                 shared_ptr<ParametricFunction> rhs, MatrixView<double> sens,
+                                 std::function<void(double,VectorView<double>)> callback = nullptr,
+                                 NewtonParameters params = NewtonParameters())
+  {
+    SensitivityODE_Theta (1, tend, steps, y, rhs, sens, callback, params);
+  }
+
+  inline void SensitivityODE_CN (double tend, int steps, VectorView<double> y,
+                                 shared_ptr<ParametricFunction> rhs, MatrixView<double> sens,
+                                 std::function<void(double,VectorView<double>)> callback = nullptr,
+                                 NewtonParameters params = NewtonParameters())
+  {
+    SensitivityODE_Theta (0.5, tend, steps, y, rhs, sens, callback, params);
+  }
+
+  // implicit Euler, returns sum_n g(t_n, y_n) and its gradient with respect
+  // to the parameters, y is the final state
+  inline double AdjointODE_IE (double tend, int steps, VectorView<double> y,
+                               shared_ptr<ParametricFunction> rhs, ObjectiveFunction objective,
+                               VectorView<double> gradient, int interval = 0,
+                               NewtonParameters params = NewtonParameters())
+  {
+    return AdjointODE_Theta (1, tend, steps, y, rhs, objective, gradient, interval, params);
+  }
+
+  inline double AdjointODE_CN (double tend, int steps, VectorView<double> y,
+                               shared_ptr<ParametricFunction> rhs, ObjectiveFunction objective,
+                               VectorView<double> gradient, int interval = 0,
+                               NewtonParameters params = NewtonParameters())
+  {
+    return AdjointODE_Theta (0.5, tend, steps, y, rhs, objective, gradient, interval, params);
+  }
+
+
+
+  // Derivatives of the generalized alpha step for the acceleration a1,
+  //   M((1-am) a1 + am a0) - (1-af) F(x1, v1) - af F(x0, v0) = 0,
+  //   x1 = x0 + h v0 + h^2/2 ((1-2 beta) a0 + 2 beta a1),
+  //   v1 = v0 + h ((1-gamma) a0 + gamma a1),
+  // with K = dF/dx, C = dF/dv, P = dF/dp and the step matrix
+  //   S = (1-am) M - (1-af) (beta h^2 K1 + gamma h C1)
+  class AlphaStepDerivatives
+  {
+    shared_ptr<ParametricFunction> rhs;
+    shared_ptr<NonlinearFunction> mass;
+    double am, af, gamma, beta, h;
+    size_t n, np;
+    bool velocitydependent;
+    Matrix<> jac;
+    Vector<> xv;
+  public:
+    Matrix<> K0, C0, P0, K1, C1, P1, M;
+    StepMatrixSolver solver;
+
+    AlphaStepDerivatives (shared_ptr<ParametricFunction> _rhs, shared_ptr<NonlinearFunction> _mass,
+                          const AlphaIntegrator & integrator)
+      : rhs(_rhs), mass(_mass),
+        am(integrator.AlphaM()), af(integrator.AlphaF()),
+        gamma(integrator.Gamma()), beta(integrator.Beta()), h(integrator.TimeStep()),
+        n(_rhs->DimF()), np(_rhs->NumParameters()),
+        velocitydependent(_rhs->DimX() == 2*_rhs->DimF()),
+        jac(n, _rhs->DimX()), xv(_rhs->DimX()),
+        K0(n, n), C0(n, n), P0(n, np), K1(n, n), C1(n, n), P1(n, np), M(n, n),
+        solver(n)
+    {
+      C0 = 0.0;
+      C1 = 0.0;
+    }
+
+    // derivatives at the full state u = (x, v, a)
+    void At (VectorView<double> u, MatrixView<double> K, MatrixView<double> C, MatrixView<double> P)
+    {
+      xv.Range(0, n) = u.Range(0, n);
+      if (velocitydependent)
+        xv.Range(n, 2*n) = u.Range(n, 2*n);
+      rhs->EvaluateDeriv (xv, jac);
+      rhs->EvaluateParameterDeriv (xv, P);
+      for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < n; j++)
+          {
+            K(i,j) = jac(i,j);
+            if (velocitydependent) C(i,j) = jac(i,n+j);
+          }
+    }
+
+    void SwapEnds ()
+    {
+      K0 = K1;
+      C0 = C1;
+      P0 = P1;
+    }
+
+    // mass matrix and step matrix of the step from u0 to u1
+    void FactorStepMatrix (VectorView<double> u0, VectorView<double> u1, bool transpose)
+    {
+      Vector<> amid(n);
+      amid = (1-am) * u1.Range(2*n, 3*n);
+      amid += am * u0.Range(2*n, 3*n);
+      mass->EvaluateDeriv (amid, M);
+      Matrix<> s(n, n);
+      s = (1-am) * M;
+      s += (-(1-af)*beta*h*h) * K1;
+      if (velocitydependent)
+        s += (-(1-af)*gamma*h) * C1;
+      solver.Factor (s, transpose);
+    }
+
+    void Forward (VectorView<double> u0, VectorView<double> u1,
+                  MatrixView<double> sx, MatrixView<double> sv, MatrixView<double> sa)
+    {
+      FactorStepMatrix (u0, u1, false);
+      Matrix<> xi(n, np), eta(n, np), r(n, np), tmp(n, np);
+      xi = sx;
+      xi += h * sv;
+      xi += (h*h/2*(1-2*beta)) * sa;
+      eta = sv;
+      eta += (h*(1-gamma)) * sa;
+
+      r = K1*xi;
+      if (velocitydependent)
+        {
+          tmp = C1*eta;
+          r += tmp;
+        }
+      r += P1;
+      r *= 1-af;
+      tmp = K0*sx;
+      if (velocitydependent)
+        tmp += C0*sv;
+      tmp += P0;
+      r += af * tmp;
+      tmp = M*sa;
+      r += (-am) * tmp;
+
+      solver.SolveColumns (r);
+      sa = r;
+      sx = xi;
+      sx += (beta*h*h) * r;
+      sv = eta;
+      sv += (gamma*h) * r;
+    }
+
+    // from the adjoint (lx, lv, la) of u1 to that of u0, adds the parameter part to grad
+    void Backward (VectorView<double> u0, VectorView<double> u1,
+                   VectorView<double> lx, VectorView<double> lv, VectorView<double> la,
+                   VectorView<double> grad)
+    {
+      FactorStepMatrix (u0, u1, true);
+      Vector<> mu(n), ax(n), av(n);
+      mu = (beta*h*h) * lx;
+      mu += (gamma*h) * lv;
+      mu += la;
+      solver.Solve (mu);
+
+      ax = lx;
+      AddTransMult (1-af, K1, mu, ax);
+      av = lv;
+      if (velocitydependent)
+        AddTransMult (1-af, C1, mu, av);
+      AddTransMult (1-af, P1, mu, grad);
+      AddTransMult (af, P0, mu, grad);
+
+      lx = ax;
+      AddTransMult (af, K0, mu, lx);
+      lv = h * ax;
+      lv += av;
+      if (velocitydependent)
+        AddTransMult (af, C0, mu, lv);
+      la = (h*h/2*(1-2*beta)) * ax;
+      la += (h*(1-gamma)) * av;
+      AddTransMult (-am, M, mu, la);
+    }
+  };
+
+
+  // generalized alpha with forward sensitivities of x, v and a, of size
+  // DimF x NumParameters, which hold the initial sensitivities on entry
+  inline void SensitivityODE_Alpha (double tend, int steps, double rhoinf,
+                                    VectorView<double> x, VectorView<double> dx, VectorView<double> ddx,
+                                    shared_ptr<ParametricFunction> rhs,
+                                    shared_ptr<NonlinearFunction> mass,
+                                    MatrixView<double> sx, MatrixView<double> sv, MatrixView<double> sa,
+                                    std::function<void(double,VectorView<double>)> callback = nullptr,
+                                    NewtonParameters params = NewtonParameters())
+  {
+    size_t n = rhs->DimF();
+    if (sx.height() != n || sx.width() != rhs->NumParameters())
+      throw std::invalid_argument("sensitivity matrices need DimF rows and NumParameters columns");
+    params.maxhalvings = 0;
+    AlphaIntegrator integrator(rhs, mass, tend/steps, rhoinf, params);
+    integrator.SetState (0, x, dx, ddx);
+    AlphaStepDerivatives deriv(rhs, mass, integrator);
+
+    Vector<> u0(3*n), u1(3*n);
+    integrator.GetFullState (u0);
+    deriv.At (u0, deriv.K0, deriv.C0, deriv.P0);
+    for (int i = 0; i < steps; i++)
+      {
+        integrator.Step();
+        integrator.GetFullState (u1);
+        deriv.At (u1, deriv.K1, deriv.C1, deriv.P1);
+        deriv.Forward (u0, u1, sx, sv, sa);
+        deriv.SwapEnds();
+        u0 = u1;
+        if (callback) callback(integrator.Time(), integrator.X());
+      }
+    integrator.GetState (x, dx, ddx);
+  }
+
+  // generalized alpha, returns sum_n g(t_n, x_n) and its gradient with
+  // respect to the parameters, (x, dx, ddx) is the final state
+  inline double AdjointODE_Alpha (double tend, int steps, double rhoinf,
+                                  VectorView<double> x, VectorView<double> dx, VectorView<double> ddx,
+                                  shared_ptr<ParametricFunction> rhs,
+                                  shared_ptr<NonlinearFunction> mass,
+                                  ObjectiveFunction objective, VectorView<double> gradient,
+                                  int interval = 0, NewtonParameters params = NewtonParameters())
+  {
+    if (gradient.Size() != rhs->NumParameters())
+      throw std::invalid_argument("gradient needs NumParameters entries");
+    size_t n = rhs->DimF();
+    double h = tend/steps;
+    params.maxhalvings = 0;
+    AlphaIntegrator integrator(rhs, mass, h, rhoinf, params);
+    integrator.SetState (0, x, dx, ddx);
+    AlphaStepDerivatives deriv(rhs, mass, integrator);
+
+    double value = 0;
+    Vector<> lam(3*n), dg(n);
+    lam = 0.0;
+    gradient = 0.0;
+    auto lx = lam.Range(0, n), lv = lam.Range(n, 2*n), la = lam.Range(2*n, 3*n);
+    CheckpointedSweep (integrator, steps, interval,
+                       [&](int k, VectorView<double> u0, VectorView<double> u1)
+    {
+      dg = 0.0;
+      value += objective ((k+1)*h, u1.Range(0, n), dg);
+      lx += dg;
+      if (k == steps-1)
+        deriv.At (u1, deriv.K1, deriv.C1, deriv.P1);
+      else
+        {
+          deriv.K1 = deriv.K0;
+          deriv.C1 = deriv.C0;
+          deriv.P1 = deriv.P0;
+        }
+      deriv.At (u0, deriv.K0, deriv.C0, deriv.P0);
+      deriv.Backward (u0, u1, lx, lv, la, gradient);
+    });
+    integrator.GetState (x, dx, ddx);
+    return value;
+  }
+
+}
+
+#endif
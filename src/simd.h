@@ -0,0 +1,135 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+// Runtime dispatch of hot loops to AVX2 / AVX-512 code, such that one
+// generic binary (e.g. one Python wheel) uses the vector units of the
+// machine it runs on. A kernel body is an always-inline function, it is
+// compiled once per instruction set by NEO_ODE_MULTIVERSION and the
+// variant is selected by the CPU features detected once at startup.
+// The environment variable NEO_ODE_SIMD=generic|avx2|avx512 caps the level.
+// Results may differ in the last bits between levels, since the vector
+// variants contract to fused multiply-adds.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NEO_ODE_HAVE_DISPATCH 1
+#define NEO_ODE_INLINE inline __attribute__((always_inline))
+#define NEO_ODE_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define NEO_ODE_TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx512vl,avx2,fma")))
+#else
+#define NEO_ODE_HAVE_DISPATCH 0
+#define NEO_ODE_INLINE inline
+#endif
+
+namespace Neo_ODE
+{
+
+  enum SIMD_LEVEL { SIMD_GENERIC=0, SIMD_AVX2=1, SIMD_AVX512=2 };
+
+  inline SIMD_LEVEL DetectSIMDLevel ()
+  {
+    SIMD_LEVEL level = SIMD_GENERIC;
+#if NEO_ODE_HAVE_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      level = SIMD_AVX2;
+    if (level == SIMD_AVX2 && __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+      level = SIMD_AVX512;
+#endif
+    if (const char * cap = std::getenv("NEO_ODE_SIMD"))
+      {
+        SIMD_LEVEL maxlevel = SIMD_AVX512;
+        if (std::strcmp(cap, "generic") == 0) maxlevel = SIMD_GENERIC;
+        if (std::strcmp(cap, "avx2") == 0) maxlevel = SIMD_AVX2;
+        if (maxlevel < level) level = maxlevel;
+      }
+    return level;
+  }
+
+  // the selected level, detected at the first call. Modules call it at import.
+  inline SIMD_LEVEL & SIMDLevelRef ()
+  {
+    static SIMD_LEVEL level = DetectSIMDLevel();
+    return level;
+  }
+
+  inline SIMD_LEVEL SIMDLevel () { return SIMDLevelRef(); }
+
+  // for benchmarks: levels above the detected one are ignored
+  inline void SetSIMDLevel (SIMD_LEVEL level)
+  {
+    SIMD_LEVEL detected = DetectSIMDLevel();
+    SIMDLevelRef() = level < detected ? level : detected;
+  }
+
+  inline const char * SIMDLevelName (SIMD_LEVEL level = SIMDLevel())
+  {
+    switch (level)
+      {
+      case SIMD_AVX2: return "avx2";
+      case SIMD_AVX512: return "avx512";
+      default: return "generic";
+      }
+  }
+
+}
+
+
+// Defines the function template NAME(args...), which calls BODY(args...)
+// compiled for the selected instruction set. BODY is a NEO_ODE_INLINE
+// function (template), inlined into every variant.
+#if NEO_ODE_HAVE_DISPATCH
+#define NEO_ODE_MULTIVERSION(NAME, BODY)                                  \
+  template <typename... Args>                                             \
+  void NAME##_generic (Args... args) { BODY (args...); }                  \
+  template <typename... Args>                                             \
+  NEO_ODE_TARGET_AVX2 void NAME##_avx2 (Args... args) { BODY (args...); } \
+  template <typename... Args>                                             \
+  NEO_ODE_TARGET_AVX512 void NAME##_avx512 (Args... args) { BODY (args...); } \
+  template <typename... Args>                                             \
+  inline void NAME (Args... args)                                         \
+  {                                                                       \
+    switch (::Neo_ODE::SIMDLevel())                                       \
+      {                                                                   \
+      case ::Neo_ODE::SIMD_AVX512: NAME##_avx512 (args...); break;        \
+      case ::Neo_ODE::SIMD_AVX2: NAME##_avx2 (args...); break;            \
+      default: NAME##_generic (args...);                                  \
+      }                                                                   \
+  }
+#else
+#define NEO_ODE_MULTIVERSION(NAME, BODY)                                  \
+  template <typename... Args>                                             \
+  inline void NAME (Args... args) { BODY (args...); }
+#endif
+
+
+namespace Neo_ODE
+{
+  namespace simd
+  {
+    // z = a x + b y, z may be x or y
+    template <typename T>
+    NEO_ODE_INLINE void LinCombBody (size_t n, T a, const T * x, T b, const T * y, T * z)
+    {
+      for (size_t i = 0; i < n; i++)
+        z[i] = a*x[i] + b*y[i];
+    }
+
+    // y -= a x, the row operation of Gaussian elimination
+    template <typename T>
+    NEO_ODE_INLINE void SubAxBody (size_t n, T a, const T * __restrict x, T * __restrict y)
+    {
+      for (size_t i = 0; i < n; i++)
+        y[i] -= a*x[i];
+    }
+
+    NEO_ODE_MULTIVERSION (LinComb, LinCombBody)
+    NEO_ODE_MULTIVERSION (SubAx, SubAxBody)
+  }
+}
+
+#endif
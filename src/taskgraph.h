@@ -0,0 +1,333 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "nonlinfunc.h"
+#include "ode.h"
+#include "taskpool.h"
+
+namespace Neo_ODE
+{
+
+  // Evaluates a function tree as a graph of (function, argument) nodes.
+  // The same function applied to the same argument becomes one node, e.g.
+  // the rhs at the new values shared by several terms of a residual. Every
+  // node value (and Jacobian) is computed once per evaluation, values of
+  // constant nodes only when their constants changed. Independent nodes run
+  // concurrently on the task pool.
+  // Leaf functions may be called concurrently and have to be thread safe.
+  template <typename T>
+  class FunctionGraphT : public NonlinearFunctionT<T>
+  {
+    enum KIND { INPUT, LEAF, SUM, SCALE, STACK };
+
+    struct Node
+    {
+      KIND kind;
+      shared_ptr<NonlinearFunctionT<T>> func;  // for LEAF nodes
+      int a = -1, b = -1;                     // argument nodes
+      T faca = 1, facb = 1;
+      size_t dim;
+      bool constant = false;
+      std::vector<T> idfacs;   // Jacobian (idfacs[0] I, idfacs[1] I, ...), empty if general
+      bool needjac = false;    // the Jacobian matrix is used by the root
+    };
+
+    shared_ptr<NonlinearFunctionT<T>> root;
+    shared_ptr<TaskPool> pool;
+    std::vector<Node> nodes;
+    std::vector<std::vector<size_t>> successors;
+    std::map<std::pair<const NonlinearFunctionT<T>*, int>, int> known;
+    int rootnode;
+
+    mutable std::vector<Vector<T>> values;
+    mutable std::vector<Matrix<T>> jacobians;
+    mutable std::vector<size_t> versions, cachedversions;
+    mutable bool valid = false;   // values are those at the input values[0]
+
+    int AddNode (Node node)
+    {
+      switch (node.kind)
+        {
+        case INPUT: node.constant = false; break;
+        case LEAF: node.constant = node.func->IsConstant() || nodes[node.a].constant; break;
+        case SCALE: node.constant = nodes[node.a].constant; break;
+        default: node.constant = nodes[node.a].constant && nodes[node.b].constant;
+        }
+
+      // affine nodes of the input, e.g. xnew and Stack(xnew, vnew)
+      size_t n = nodes.empty() ? node.dim : nodes[0].dim;
+      if (node.constant)
+        {
+          if (node.dim % n == 0)
+            node.idfacs.assign (node.dim/n, T(0));
+        }
+      else
+        switch (node.kind)
+          {
+          case INPUT: node.idfacs.assign (1, T(1)); break;
+          case LEAF: break;
+          case SUM:
+            if (nodes[node.a].idfacs.size() && nodes[node.a].idfacs.size() == nodes[node.b].idfacs.size())
+              for (size_t k = 0; k < nodes[node.a].idfacs.size(); k++)
+                node.idfacs.push_back (node.faca*nodes[node.a].idfacs[k] + node.facb*nodes[node.b].idfacs[k]);
+            break;
+          case SCALE:
+            for (T f : nodes[node.a].idfacs)
+              node.idfacs.push_back (node.faca*f);
+            break;
+          case STACK:
+            if (nodes[node.a].idfacs.size() && nodes[node.b].idfacs.size())
+              for (int arg : { node.a, node.b })
+                for (T f : nodes[arg].idfacs)
+                  node.idfacs.push_back (f);
+            break;
+          }
+      nodes.push_back (node);
+      return int(nodes.size())-1;
+    }
+
+    // node of f applied to the value of node 'arg'
+    int Build (shared_ptr<NonlinearFunctionT<T>> f, int arg)
+    {
+      const NonlinearFunctionT<T> * ptr = f.get();
+      // a constant does not depend on its argument
+      bool constant = dynamic_cast<const ConstantFunctionT<T>*>(ptr) != nullptr;
+      auto key = std::make_pair (ptr, constant ? -1 : arg);
+      if (auto pos = known.find(key); pos != known.end())
+        return pos->second;
+
+      int nr;
+      if (dynamic_cast<const IdentityFunctionT<T>*>(ptr))
+        nr = arg;
+      else if (auto sum = dynamic_cast<const SumFunctionT<T>*>(ptr))
+        {
+          int a = Build (sum->fa, arg);
+          int b = Build (sum->fb, arg);
+          nr = AddNode (Node { SUM, nullptr, a, b, sum->faca, sum->facb, f->DimF() });
+        }
+      else if (auto scale = dynamic_cast<const ScaleFunctionT<T>*>(ptr))
+        {
+          int a = Build (scale->fa, arg);
+          nr = AddNode (Node { SCALE, nullptr, a, -1, scale->fac, 1, f->DimF() });
+        }
+      else if (auto comp = dynamic_cast<const ComposeFunctionT<T>*>(ptr))
+        nr = Build (comp->fa, Build (comp->fb, arg));
+      else if (auto stack = dynamic_cast<const StackFunctionT<T>*>(ptr))
+        {
+          int a = Build (stack->fa, arg);
+          int b = Build (stack->fb, arg);
+          nr = AddNode (Node { STACK, nullptr, a, b, 1, 1, f->DimF() });
+        }
+      else
+        nr = AddNode (Node { LEAF, f, arg, -1, 1, 1, f->DimF() });
+
+      known[key] = nr;
+      return nr;
+    }
+
+    void EvaluateNode (size_t i) const
+    {
+      const Node & node = nodes[i];
+      if (node.constant && cachedversions[i] == versions[i]) return;
+      cachedversions[i] = versions[i];
+      auto val = values[i].View();
+      switch (node.kind)
+        {
+        case INPUT: break;
+        case LEAF:
+          node.func->Evaluate (values[node.a], val);
+          break;
+        case SUM:
+          simd::LinComb (node.dim, node.faca, values[node.a].Data(),
+                         node.facb, values[node.b].Data(), val.Data());
+          break;
+        case SCALE:
+          val = node.faca * values[node.a];
+          break;
+        case STACK:
+          val.Range(0, nodes[node.a].dim) = values[node.a];
+          val.Range(nodes[node.a].dim, node.dim) = values[node.b];
+          break;
+        }
+    }
+
+    // Jacobian with respect to the graph input, by the chain rule
+    void DifferentiateNode (size_t i) const
+    {
+      const Node & node = nodes[i];
+      if (node.constant || !node.needjac) return;
+      MatrixView<T> jac = jacobians[i];
+      switch (node.kind)
+        {
+        case INPUT: break;
+        case LEAF:
+          if (node.a == 0)
+            node.func->EvaluateDeriv (values[0], jac);
+          else if (auto & facs = nodes[node.a].idfacs; facs.size() == 1)
+            {
+              node.func->EvaluateDeriv (values[node.a], jac);
+              jac *= facs[0];
+            }
+          else if (facs.size())
+            {
+              // combination of the column blocks, without the matrix product
+              size_t n = jac.width();
+              Matrix<T> tmp(node.dim, nodes[node.a].dim);
+              node.func->EvaluateDeriv (values[node.a], tmp);
+              jac = T(0);
+              for (size_t k = 0; k < facs.size(); k++)
+                for (size_t l = 0; l < node.dim; l++)
+                  simd::LinComb (n, T(1), &jac(l,0), facs[k], &tmp(l,k*n), &jac(l,0));
+            }
+          else
+            {
+              Matrix<T> tmp(node.dim, nodes[node.a].dim);
+              node.func->EvaluateDeriv (values[node.a], tmp);
+              jac = tmp * jacobians[node.a];
+            }
+          break;
+        case SUM:
+          for (size_t k = 0; k < node.dim; k++)
+            simd::LinComb (jac.width(), node.faca, &jacobians[node.a](k,0),
+                           node.facb, &jacobians[node.b](k,0), &jac(k,0));
+          break;
+        case SCALE:
+          jac = node.faca * jacobians[node.a];
+          break;
+        case STACK:
+          for (size_t k = 0; k < nodes[node.a].dim; k++)
+            jac.Row(k) = jacobians[node.a].Row(k);
+          for (size_t k = 0; k < nodes[node.b].dim; k++)
+            jac.Row(nodes[node.a].dim+k) = jacobians[node.b].Row(k);
+          break;
+        }
+    }
+
+    // nodes are created after their arguments, so the index order is topological
+    void UpdateVersions () const
+    {
+      for (size_t i = 1; i < nodes.size(); i++)
+        {
+          const Node & node = nodes[i];
+          versions[i] = versions[node.a] + (node.b >= 0 ? versions[node.b] : 0)
+            + (node.func ? node.func->Version() : 0);
+        }
+    }
+    
+    void Run (void (FunctionGraphT::*work)(size_t) const) const
+    {
+      if (!pool)
+        {
+          for (size_t i = 1; i < nodes.size(); i++)
+            (this->*work)(i);
+          return;
+        }
+      pool->RunGraph (successors, [this, work](size_t i) { (this->*work)(i+1); });
+    }
+
+  public:
+    FunctionGraphT (shared_ptr<NonlinearFunctionT<T>> _root,
+                    shared_ptr<TaskPool> _pool = nullptr)
+      : root(_root), pool(_pool)
+    {
+      AddNode (Node { INPUT, nullptr, -1, -1, 1, 1, root->DimX() });
+      rootnode = Build (root, 0);
+      known.clear();
+
+      // the task graph of all nodes but the input
+      successors.resize (nodes.size()-1);
+      for (size_t i = 1; i < nodes.size(); i++)
+        for (int arg : { nodes[i].a, nodes[i].b })
+          if (arg > 0) successors[arg-1].push_back(i-1);
+
+      // functions of affine nodes take the factors instead of the matrices
+      nodes[rootnode].needjac = true;
+      for (size_t i = nodes.size(); i-- > 1; )
+        if (nodes[i].needjac)
+          for (int arg : { nodes[i].a, nodes[i].b })
+            if (arg >= 0 && (nodes[i].kind != LEAF || nodes[arg].idfacs.empty()))
+              nodes[arg].needjac = true;
+      nodes[0].needjac = true;
+
+      for (auto & node : nodes)
+        {
+          values.emplace_back (node.dim);
+          jacobians.emplace_back (node.needjac ? node.dim : 0, root->DimX());
+          jacobians.back() = T(0);
+        }
+      jacobians[0].Diag() = T(1);
+      versions.assign (nodes.size(), 0);
+      cachedversions.assign (nodes.size(), size_t(-1));
+    }
+
+    size_t NumNodes() const { return nodes.size()-1; }
+
+    size_t DimX() const override { return root->DimX(); }
+    size_t DimF() const override { return root->DimF(); }
+
+    void Evaluate (VectorView<T> x, VectorView<T> f) const override
+    {
+      values[0] = x;
+      UpdateVersions();
+      Run (&FunctionGraphT::EvaluateNode);
+      valid = true;
+      f = values[rootnode];
+    }
+
+    void EvaluateDeriv (VectorView<T> x, MatrixView<T> df) const override
+    {
+      // Newton evaluates the function before its derivative at the same x
+      size_t rootversion = versions[rootnode];
+      UpdateVersions();
+      bool same = valid && versions[rootnode] == rootversion;
+      for (size_t i = 0; same && i < x.Size(); i++)
+        same = values[0](i) == x(i);
+      if (!same)
+        {
+          values[0] = x;
+          Run (&FunctionGraphT::EvaluateNode);
+          valid = true;
+        }
+      Run (&FunctionGraphT::DifferentiateNode);
+      df = jacobians[rootnode];
+    }
+  };
+
+  using FunctionGraph = FunctionGraphT<double>;
+
+
+  // lets the integrator evaluate its residual trees as task graphs,
+  // one graph per tree
+  inline void UseTaskGraph (TimeIntegrator & integrator, shared_ptr<TaskPool> pool)
+  {
+    auto graphs = make_shared<std::map<shared_ptr<NonlinearFunction>, shared_ptr<FunctionGraph>>>();
+    integrator.SetEquationWrapper
+      ([graphs, pool] (shared_ptr<NonlinearFunction> equ) -> shared_ptr<NonlinearFunction>
+      {
+        auto & graph = (*graphs)[equ];
+        if (!graph)
+          {
+            // the integrators keep only a few trees alive
+            if (graphs->size() > 16)
+              {
+                graphs->clear();
+                return (*graphs)[equ] = make_shared<FunctionGraph>(equ, pool);
+              }
+            graph = make_shared<FunctionGraph>(equ, pool);
+          }
+        return graph;
+      });
+  }
+
+
+#ifdef NEO_ODE_EXTERN_TEMPLATES
+  extern template class FunctionGraphT<double>;
+#endif
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Neo_ODE
+{
+
+  // fixed pool of worker threads running loops of independent tasks
+  class TaskPool
+  {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeup, finished;
+
+    const std::function<void(size_t)> * task = nullptr;
+    size_t ntasks = 0;
+    std::atomic<size_t> next{0};
+    size_t done = 0;
+    size_t generation = 0;
+    size_t active = 0;
+    bool stop = false;
+    std::exception_ptr error;
+
+    // the pool whose tasks the calling thread is running, if any
+    static const TaskPool *& Current ()
+    {
+      static thread_local const TaskPool * current = nullptr;
+      return current;
+    }
+
+    // takes tasks of the current loop until none is left
+    void Work (const std::function<void(size_t)> & func, size_t n)
+    {
+      const TaskPool * outer = Current();
+      Current() = this;
+      size_t mydone = 0;
+      for (size_t i = next++; i < n; i = next++)
+        {
+          try
+            {
+              func(i);
+            }
+          catch (...)
+            {
+              std::lock_guard<std::mutex> guard(mutex);
+              if (!error) error = std::current_exception();
+            }
+          mydone++;
+        }
+      Current() = outer;
+      std::lock_guard<std::mutex> guard(mutex);
+      done += mydone;
+      if (done == n) finished.notify_all();
+    }
+
+    void WorkerLoop ()
+    {
+      size_t seen = 0;
+      while (true)
+        {
+          const std::function<void(size_t)> * func;
+          size_t n;
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait (lock, [&] { return stop || generation != seen; });
+            if (stop) return;
+            seen = generation;
+            // woken too late, the loop is already finished
+            if (!task) continue;
+            func = task;
+            n = ntasks;
+            active++;
+          }
+          Work (*func, n);
+          {
+            std::lock_guard<std::mutex> guard(mutex);
+            active--;
+            if (active == 0) finished.notify_all();
+          }
+        }
+    }
+    
+  public:
+    // nthreads = 0 uses all hardware threads, the calling thread counts as one
+    TaskPool (size_t nthreads = 0)
+    {
+      if (nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+      for (size_t i = 1; i < nthreads; i++)
+        workers.emplace_back ([this] { WorkerLoop(); });
+    }
+
+    ~TaskPool ()
+    {
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        stop = true;
+      }
+      wakeup.notify_all();
+      for (auto & w : workers)
+        w.join();
+    }
+
+    TaskPool (const TaskPool &) = delete;
+    TaskPool & operator= (const TaskPool &) = delete;
+
+    size_t NumThreads() const { return workers.size()+1; }
+
+    // calls func(i) for 0 <= i < n in parallel and returns when all calls are
+    // finished. The first exception thrown by a task is rethrown. Called from
+    // a task of the same pool, whose threads may all be waiting in such
+    // calls, or from another thread while a loop runs, e.g. a worker of a
+    // second pool used by a task, the loop runs sequentially in the caller.
+    void ParallelFor (size_t n, const std::function<void(size_t)> & func)
+    {
+      if (n == 0) return;
+      bool busy = Current() == this;
+      if (!busy)
+        {
+          std::lock_guard<std::mutex> guard(mutex);
+          busy = task != nullptr;
+          if (!busy)
+            {
+              task = &func;
+              ntasks = n;
+              next = 0;
+              done = 0;
+              error = nullptr;
+              generation++;
+            }
+        }
+      if (busy)
+        {
+          std::exception_ptr first;
+          for (size_t i = 0; i < n; i++)
+            {
+              try
+                {
+                  func(i);
+                }
+              catch (...)
+                {
+                  if (!first) first = std::current_exception();
+                }
+            }
+          if (first) std::rethrow_exception(first);
+          return;
+        }
+      wakeup.notify_all();
+      
+      Work (func, n);
+      
+      std::unique_lock<std::mutex> lock(mutex);
+      // wait for the tasks and for all workers to leave this loop
+      finished.wait (lock, [&] { return done == n && active == 0; });
+      task = nullptr;
+      if (error) std::rethrow_exception(error);
+    }
+
+
+    // Runs the tasks of a dependency graph: func(i) is called after all
+    // tasks j with i in successors[j] are finished. Every thread keeps a
+    // deque of ready tasks, takes the newest of its own and steals the
+    // oldest of the others when it runs dry. Called while a loop of the pool
+    // runs, the graph runs sequentially in the caller as ParallelFor does.
+    void RunGraph (const std::vector<std::vector<size_t>> & successors,
+                   const std::function<void(size_t)> & func)
+    {
+      size_t n = successors.size();
+      if (n == 0) return;
+      
+      std::vector<std::atomic<int>> pending(n);
+      for (auto & p : pending) p.store(0);
+      for (auto & succ : successors)
+        for (size_t s : succ) pending[s]++;
+
+      size_t nthreads = NumThreads();
+      std::vector<std::deque<size_t>> queues(nthreads);
+      std::vector<std::mutex> locks(nthreads);
+      for (size_t i = 0, k = 0; i < n; i++)
+        if (pending[i] == 0) queues[k++ % nthreads].push_back(i);
+      
+      std::atomic<size_t> completed{0};
+      std::atomic<bool> failed{false};
+
+      ParallelFor (nthreads, [&](size_t me)
+      {
+        while (completed < n && !failed)
+          {
+            size_t i = 0;
+            bool found = false;
+            for (size_t k = 0; !found && k < nthreads; k++)
+              {
+                size_t q = (me+k) % nthreads;
+                std::lock_guard<std::mutex> guard(locks[q]);
+                if (queues[q].empty()) continue;
+                if (k == 0)
+                  {
+                    i = queues[q].back();
+                    queues[q].pop_back();
+                  }
+                else
+                  {
+                    i = queues[q].front();
+                    queues[q].pop_front();
+                  }
+                found = true;
+              }
+            if (!found)
+              {
+                std::this_thread::yield();
+                continue;
+              }
+
+            try
+              {
+                func(i);
+              }
+            catch (...)
+              {
+                failed = true;
+                throw;
+              }
+            for (size_t s : successors[i])
+              if (--pending[s] == 0)
+                {
+                  std::lock_guard<std::mutex> guard(locks[me]);
+                  queues[me].push_back(s);
+                }
+            completed++;
+          }
+      });
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <vector.h>
+
+namespace Neo_ODE
+{
+  using namespace Neo_CLA;
+
+  // Compressed storage of the states y(t_i) of a long run. Every component
+  // is encoded against its linear extrapolation from the two previous
+  // states, as varint of
+  //  - lossless (tolerance 0): the XOR of the bit patterns, which is small
+  //    when they share sign, exponent and leading mantissa bits,
+  //  - lossy (tolerance > 0): the zigzag difference of the values quantized
+  //    to steps of 2*tolerance, so every component is within tolerance.
+  // Every keyinterval-th state is a keyframe, encoded without prediction.
+  // States are decoded from the preceding keyframe on.
+  class CompressedTrajectory
+  {
+    size_t dim;
+    double tolerance;
+    size_t keyinterval;
+    std::vector<uint8_t> data;
+    std::vector<size_t> keyoffsets;
+    std::vector<double> times;
+    // the two previous states, quantized or bit patterns
+    std::vector<int64_t> last, beforelast;
+
+    static void PutVarint (std::vector<uint8_t> & out, uint64_t v)
+    {
+      while (v >= 0x80)
+        {
+          out.push_back (uint8_t(v) | 0x80);
+          v >>= 7;
+        }
+      out.push_back (uint8_t(v));
+    }
+
+    static uint64_t GetVarint (const uint8_t * & p)
+    {
+      uint64_t v = 0;
+      for (int shift = 0; ; shift += 7)
+        {
+          uint8_t b = *p++;
+          v |= uint64_t(b & 0x7f) << shift;
+          if (!(b & 0x80)) return v;
+        }
+    }
+
+    static uint64_t ZigZag (int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+    static int64_t UnZigZag (uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+    int64_t Encode (double y) const
+    {
+      if (tolerance > 0)
+        return std::llround (y / (2*tolerance));
+      int64_t bits;
+      std::memcpy (&bits, &y, sizeof(bits));
+      return bits;
+    }
+
+    double Decode (int64_t v) const
+    {
+      if (tolerance > 0)
+        return double(v) * (2*tolerance);
+      double y;
+      std::memcpy (&y, &v, sizeof(y));
+      return y;
+    }
+
+    // extrapolation of order 0 (none), 1 (constant) or 2 (linear)
+    int64_t Predict (int64_t prev, int64_t prevprev, size_t order) const
+    {
+      if (order == 0) return 0;
+      if (order == 1) return prev;
+      if (tolerance > 0) return 2*prev - prevprev;
+      return Encode (2*Decode(prev) - Decode(prevprev));
+    }
+
+    int64_t Combine (int64_t pred, uint64_t code) const
+    {
+      if (tolerance > 0)
+        return pred + UnZigZag(code);
+      return pred ^ int64_t(code);
+    }
+
+    uint64_t Difference (int64_t pred, int64_t v) const
+    {
+      if (tolerance > 0)
+        return ZigZag (v - pred);
+      return uint64_t(pred ^ v);
+    }
+
+    // decodes one state at position pos into prev (and prevprev), the
+    // state has the given index within its key interval
+    void DecodeState (const uint8_t * & pos, size_t order,
+                      std::vector<int64_t> & prev, std::vector<int64_t> & prevprev) const
+    {
+      for (size_t i = 0; i < dim; i++)
+        {
+          int64_t v = Combine (Predict (prev[i], prevprev[i], order), GetVarint(pos));
+          prevprev[i] = prev[i];
+          prev[i] = v;
+        }
+    }
+
+  public:
+    CompressedTrajectory (size_t _dim, double _tolerance = 0, size_t _keyinterval = 64)
+      : dim(_dim), tolerance(_tolerance), keyinterval(_keyinterval),
+        last(_dim, 0), beforelast(_dim, 0)
+    {
+      if (tolerance < 0 || keyinterval == 0)
+        throw std::invalid_argument("trajectory needs tolerance >= 0 and keyinterval > 0");
+    }
+
+    size_t Dim() const { return dim; }
+    size_t Size() const { return times.size(); }
+    double Tolerance() const { return tolerance; }
+    double Time (size_t i) const { return times[i]; }
+    // bytes of the encoded states
+    size_t Bytes() const { return data.size(); }
+
+    void Append (double t, VectorView<double> y)
+    {
+      if (y.Size() != dim)
+        throw std::invalid_argument("trajectory state has wrong dimension");
+      size_t order = std::min<size_t>(times.size() % keyinterval, 2);
+      if (order == 0)
+        keyoffsets.push_back (data.size());
+      for (size_t i = 0; i < dim; i++)
+        {
+          int64_t v = Encode (y(i));
+          PutVarint (data, Difference (Predict (last[i], beforelast[i], order), v));
+          beforelast[i] = last[i];
+          last[i] = v;
+        }
+      times.push_back (t);
+    }
+
+    // callback for the solvers, e.g. SolveODE_IE(tend, steps, y, rhs, traj.Recorder())
+    std::function<void(double,VectorView<double>)> Recorder ()
+    {
+      return [this] (double t, VectorView<double> y) { Append (t, y); };
+    }
+
+    // Sequential decoding, from a keyframe on
+    class Reader
+    {
+      const CompressedTrajectory & traj;
+      size_t next;
+      const uint8_t * pos;
+      std::vector<int64_t> state, prevstate;
+
+      void Advance ()
+      {
+        if (Done()) throw std::out_of_range("trajectory reader at end");
+        traj.DecodeState (pos, std::min<size_t>(next % traj.keyinterval, 2), state, prevstate);
+        next++;
+      }
+
+    public:
+      Reader (const CompressedTrajectory & _traj, size_t first = 0)
+        : traj(_traj), state(_traj.dim, 0), prevstate(_traj.dim, 0)
+      {
+        if (first > traj.Size())
+          throw std::out_of_range("trajectory index out of range");
+        size_t key = first / traj.keyinterval;
+        next = key * traj.keyinterval;
+        pos = traj.data.data() + (key < traj.keyoffsets.size() ? traj.keyoffsets[key] : traj.data.size());
+        while (next < first) Advance();
+      }
+
+      size_t Dim() const { return traj.dim; }
+      bool Done() const { return next >= traj.Size(); }
+      // index of the state Next will decode
+      size_t Index() const { return next; }
+
+      // decodes the next state into y, returns its time
+      double Next (double * y)
+      {
+        Advance();
+        for (size_t i = 0; i < traj.dim; i++)
+          y[i] = traj.Decode (state[i]);
+        return traj.times[next-1];
+      }
+
+      double Next (VectorView<double> y)
+      {
+        Advance();
+        for (size_t i = 0; i < traj.dim; i++)
+          y(i) = traj.Decode (state[i]);
+        return traj.times[next-1];
+      }
+    };
+
+    // state i, decoded from its keyframe on
+    void Get (size_t i, VectorView<double> y) const
+    {
+      if (i >= Size()) throw std::out_of_range("trajectory index out of range");
+      Reader reader(*this, i);
+      reader.Next (y);
+    }
+
+    void Save (std::ostream & ost) const
+    {
+      uint64_t header[5] = { dim, keyinterval, times.size(), data.size(), 0 };
+      std::memcpy (&header[4], &tolerance, sizeof(double));
+      ost.write (reinterpret_cast<const char*>(header), sizeof(header));
+      ost.write (reinterpret_cast<const char*>(times.data()), times.size()*sizeof(double));
+      ost.write (reinterpret_cast<const char*>(data.data()), data.size());
+    }
+
+    static CompressedTrajectory Load (std::istream & ist)
+    {
+      uint64_t header[5];
+      ist.read (reinterpret_cast<char*>(header), sizeof(header));
+      double tol;
+      std::memcpy (&tol, &header[4], sizeof(double));
+      CompressedTrajectory traj(header[0], tol, header[1]);
+      traj.times.resize (header[2]);
+      traj.data.resize (header[3]);
+      ist.read (reinterpret_cast<char*>(traj.times.data()), traj.times.size()*sizeof(double));
+      ist.read (reinterpret_cast<char*>(traj.data.data()), traj.data.size());
+      if (!ist) throw std::runtime_error("trajectory stream is truncated");
+
+      // recover the keyframe offsets and the last state by decoding once
+      const uint8_t * pos = traj.data.data();
+      for (size_t k = 0; k < traj.times.size(); k++)
+        {
+          if (k % traj.keyinterval == 0)
+            traj.keyoffsets.push_back (pos - traj.data.data());
+          traj.DecodeState (pos, std::min<size_t>(k % traj.keyinterval, 2), traj.last, traj.beforelast);
+        }
+      return traj;
+    }
+  };
+
+}
+
+#endif